@@ -0,0 +1,317 @@
+// Copyright (c) 2013 Pennies developers and contributors
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// scrypt micro-benchmarks: scrypt_hash at every Nfactor up to the current one,
+// scanhash_scrypt and the PBKDF2 passes for every mix the cpu runs, and
+// scratchpad allocation. Script interpreter benchmarks over standard scripts
+// and the numeric ops of the script test vectors, with the heap allocations
+// each one makes. Results go to stdout as CSV, or JSON with -json.
+//
+// Usage: bench_pennies [-json] [-mintime=<ms>] [-maxnfactor=<n>] [-scannfactor=<n>] [-scrypthugepages]
+//
+// scanhash_scrypt runs at -scannfactor (default the highest Nfactor benchmarked)
+// and holds one scratchpad per lane, so keep it low enough to fit in memory.
+//
+
+#include "main.h"
+#include "ui_interface.h"
+#include "wallet.h"
+#include "bitcoinrpc.h"
+
+extern "C" {
+#include "scrypt-jane/scrypt-jane.h"
+}
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+// Every heap allocation of the process, for the allocations per operation
+static int64 nAllocs = 0;
+
+void* operator new(size_t nSize)
+{
+    nAllocs++;
+    void* p = malloc(nSize ? nSize : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void Shutdown(void* parg)
+{
+  exit(0);
+}
+
+void StartShutdown()
+{
+  exit(0);
+}
+
+class CBenchResult
+{
+public:
+    string strName;
+    string strVariant;
+    int nNfactor;
+    int nLanes;
+    int64 nOps;
+    int64 nMicros;
+    int64 nAllocs;
+};
+
+static vector<CBenchResult> vResults;
+static int64 nMinMicros = 1000000;
+
+// Call fn, which returns the operations it did, until nMinMicros have passed
+static void Bench(const string& strName, const string& strVariant, int nNfactor, int nLanes, boost::function<int64()> fn)
+{
+    // Warm up: runs the power-on self test and grows the scratchpad
+    fn();
+
+    CBenchResult result;
+    result.strName = strName;
+    result.strVariant = strVariant;
+    result.nNfactor = nNfactor;
+    result.nLanes = nLanes;
+    result.nOps = 0;
+    int64 nAllocsStart = nAllocs;
+    int64 nStart = GetTimeMicros();
+    do
+    {
+        result.nOps += fn();
+        result.nMicros = GetTimeMicros() - nStart;
+    } while (result.nMicros < nMinMicros);
+    result.nAllocs = nAllocs - nAllocsStart;
+    vResults.push_back(result);
+
+    fprintf(stderr, "%s %s Nfactor %d x%d: %.1f/s\n", strName.c_str(), strVariant.c_str(), nNfactor, nLanes,
+            1000000.0 * result.nOps / max(result.nMicros, (int64)1));
+}
+
+static int64 BenchScryptHash(block_header* pheader, unsigned char Nfactor)
+{
+    uint32_t hash[8];
+    pheader->nonce++;
+    scrypt_hash(pheader, sizeof(*pheader), hash, Nfactor);
+    return 1;
+}
+
+static int64 BenchScanHash(block_header* pheader, void* scratchbuf, unsigned char Nfactor, unsigned int nLanes)
+{
+    uint32_t nHashesDone = 0;
+    uint256 result;
+    block_header res_header;
+    scanhash_scrypt(pheader, scratchbuf, pheader->nonce + nLanes, nHashesDone, UBEGIN(result), &res_header, Nfactor);
+    pheader->nonce += nHashesDone;
+    return nHashesDone;
+}
+
+// bytes_in -> bytes_out, 80 -> 128 before the mix and 128 -> 32 after it
+static int64 BenchPBKDF2(size_t nSaltBytes, size_t nOutBytes, size_t nLanes)
+{
+    unsigned char password[SCRYPT_MAX_LANES][80], salt[SCRYPT_MAX_LANES][128], out[SCRYPT_MAX_LANES][128];
+    const unsigned char *ppassword[SCRYPT_MAX_LANES], *psalt[SCRYPT_MAX_LANES];
+    unsigned char *pout[SCRYPT_MAX_LANES];
+    for (size_t i = 0; i < nLanes; i++)
+    {
+        memset(password[i], (int)i, sizeof(password[i]));
+        memset(salt[i], (int)i, sizeof(salt[i]));
+        ppassword[i] = password[i];
+        psalt[i] = salt[i];
+        pout[i] = out[i];
+    }
+    scrypt_pbkdf2_stage(ppassword, sizeof(password[0]), psalt, nSaltBytes, pout, nOutBytes, nLanes);
+    return nLanes;
+}
+
+// Fresh scratchpad for one lane at Nfactor, including first touch of every page
+static int64 BenchScratchAlloc(unsigned char Nfactor, string* pstrPages)
+{
+    scrypt_scratchpad sp;
+    scrypt_scratchpad_init(&sp);
+    size_t nBytes = scrypt_scratchpad_bytes(Nfactor, 0, 0);
+    scrypt_scratchpad_reserve(&sp, nBytes);
+    memset(sp.ptr, 0, nBytes);
+    *pstrPages = scrypt_buffer_pages(&sp);
+    scrypt_scratchpad_free(&sp);
+    return 1;
+}
+
+// Evaluate scriptSig then scriptPubKey on one stack, as VerifyScript does
+static int64 BenchEvalScript(const CScript* pscriptSig, const CScript* pscriptPubKey, const CTransaction* ptx)
+{
+    CScriptStack stack;
+    EvalScript(stack, *pscriptSig, *ptx, 0, 0);
+    EvalScript(stack, *pscriptPubKey, *ptx, 0, 0);
+    return 1;
+}
+
+// Whole input check as block connection runs it, with the transaction's
+// signature hasher. With fCacheStore the signature comes from the cache past
+// the first run, without it every run verifies the signature.
+static int64 BenchVerifyScript(const CTransaction* ptxFrom, const CTransaction* ptxTo, const CSignatureHasher* phasher, bool fCacheStore)
+{
+    VerifyScript(ptxTo->vin[0].scriptSig, ptxFrom->vout[0].scriptPubKey, *ptxTo, 0, true, 0, fCacheStore, phasher);
+    return 1;
+}
+
+static void BenchScripts()
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CScript scriptPubKeyHash;
+    scriptPubKeyHash.SetDestination(key.GetPubKey().GetID());
+    CScript scriptPubKey = CScript() << key.GetPubKey().Raw() << OP_CHECKSIG;
+
+    for (int nType = 0; nType < 2; nType++)
+    {
+        string strVariant = nType == 0 ? "pubkeyhash" : "pubkey";
+        CTransaction txFrom;
+        txFrom.vout.resize(1);
+        txFrom.vout[0].nValue = COIN;
+        txFrom.vout[0].scriptPubKey = nType == 0 ? scriptPubKeyHash : scriptPubKey;
+        CTransaction txTo;
+        txTo.vin.resize(1);
+        txTo.vin[0].prevout.hash = txFrom.GetHash();
+        txTo.vin[0].prevout.n = 0;
+        txTo.vout.resize(1);
+        txTo.vout[0].nValue = COIN;
+        txTo.vout[0].scriptPubKey = scriptPubKeyHash;
+
+        // Signed by hand, SignSignature's own check would leave the
+        // signature in the cache
+        vector<unsigned char> vchSig;
+        key.Sign(SignatureHash(txFrom.vout[0].scriptPubKey, txTo, 0, SIGHASH_ALL), vchSig);
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        txTo.vin[0].scriptSig << vchSig;
+        if (nType == 0)
+            txTo.vin[0].scriptSig << key.GetPubKey().Raw();
+
+        CSignatureHasher hasher(txTo);
+        if (!VerifyScript(txTo.vin[0].scriptSig, txFrom.vout[0].scriptPubKey, txTo, 0, true, 0, false, &hasher))
+        {
+            fprintf(stderr, "BenchScripts() : can't sign %s\n", strVariant.c_str());
+            continue;
+        }
+        Bench("verify_script", strVariant, 0, 1, boost::bind(BenchVerifyScript, &txFrom, &txTo, &hasher, false));
+        Bench("verify_script", strVariant + "_cached", 0, 1, boost::bind(BenchVerifyScript, &txFrom, &txTo, &hasher, true));
+    }
+
+    // Numeric and stack ops as in the script_valid.json vectors
+    CTransaction txEmpty;
+    CScript scriptNumSig = CScript() << 5 << 0 << 10 << -1;
+    CScript scriptNum = CScript() << OP_ABS << 1 << OP_NUMEQUALVERIFY << OP_WITHIN << OP_VERIFY
+                                  << 1 << 2 << OP_ADD << 3 << OP_EQUALVERIFY << 7 << OP_DUP << OP_1ADD << OP_MAX
+                                  << 2147483647 << OP_DUP << OP_ADD << OP_SIZE << OP_NIP << OP_SUB
+                                  << OP_DEPTH << OP_1SUB << OP_PICK << OP_ADD << 6 << OP_NUMEQUAL;
+    if (!VerifyScript(scriptNumSig, scriptNum, txEmpty, 0, false, 0))
+        fprintf(stderr, "BenchScripts() : numeric script failed\n");
+    Bench("eval_script", "numeric", 0, 1, boost::bind(BenchEvalScript, &scriptNumSig, &scriptNum, &txEmpty));
+}
+
+static void PrintResults(bool fJSON)
+{
+    if (fJSON)
+    {
+        Array results;
+        BOOST_FOREACH(const CBenchResult& result, vResults)
+        {
+            Object obj;
+            obj.push_back(Pair("benchmark",  result.strName));
+            obj.push_back(Pair("variant",    result.strVariant));
+            obj.push_back(Pair("nfactor",    result.nNfactor));
+            obj.push_back(Pair("lanes",      result.nLanes));
+            obj.push_back(Pair("ops",        (boost::int64_t)result.nOps));
+            obj.push_back(Pair("seconds",    result.nMicros / 1000000.0));
+            obj.push_back(Pair("opspersec",  1000000.0 * result.nOps / max(result.nMicros, (int64)1)));
+            obj.push_back(Pair("usecperop",  (double)result.nMicros / max(result.nOps, (int64)1)));
+            obj.push_back(Pair("allocsperop", (double)result.nAllocs / max(result.nOps, (int64)1)));
+            results.push_back(obj);
+        }
+        Object obj;
+        obj.push_back(Pair("version",    FormatFullVersion()));
+        obj.push_back(Pair("time",       (boost::int64_t)GetTime()));
+        obj.push_back(Pair("benchmarks", results));
+        printf("%s\n", write_string(Value(obj), true).c_str());
+        return;
+    }
+
+    printf("benchmark,variant,nfactor,lanes,ops,seconds,opspersec,usecperop,allocsperop\n");
+    BOOST_FOREACH(const CBenchResult& result, vResults)
+        printf("%s,%s,%d,%d,%"PRI64d",%.6f,%.3f,%.3f,%.3f\n", result.strName.c_str(), result.strVariant.c_str(),
+               result.nNfactor, result.nLanes, result.nOps, result.nMicros / 1000000.0,
+               1000000.0 * result.nOps / max(result.nMicros, (int64)1),
+               (double)result.nMicros / max(result.nOps, (int64)1),
+               (double)result.nAllocs / max(result.nOps, (int64)1));
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToConsole = false;
+    fPrintToDebugger = false;
+
+    nMinMicros = GetArg("-mintime", 1000) * 1000;
+    scrypt_set_hugepages(GetBoolArg("-scrypthugepages"));
+    int nMaxNfactor = min((int)GetArg("-maxnfactor", 255), (int)GetNfactor(GetTime()));
+    unsigned char nScanNfactor = (unsigned char)GetArg("-scannfactor", nMaxNfactor);
+
+    block_header header;
+    memset(&header, 0, sizeof(header));
+    header.timestamp = GetTime();
+
+    // scrypt_hash at every Nfactor the chain has used so far
+    for (int nNfactor = 4; nNfactor <= nMaxNfactor; nNfactor++)
+        Bench("scrypt_hash", scrypt_mix_name(), nNfactor, 1, boost::bind(BenchScryptHash, &header, (unsigned char)nNfactor));
+
+    // scanhash_scrypt and the PBKDF2 passes for every mix and lane count the cpu runs
+    size_t masks[32];
+    size_t nMasks = scrypt_cpu_masks(masks, sizeof(masks) / sizeof(masks[0]));
+    set<pair<string, size_t> > setSeen;
+    for (size_t i = 0; i < nMasks; i++)
+    {
+        scrypt_set_cpu_mask(masks[i]);
+        string strMix = scrypt_mix_name();
+        size_t nLanes = scrypt_lanes_max();
+        if (!setSeen.insert(make_pair(strMix, nLanes)).second)
+            continue;
+
+        void* scratchbuf = scrypt_buffer_alloc();
+        Bench("scanhash_scrypt", strMix, nScanNfactor, nLanes, boost::bind(BenchScanHash, &header, scratchbuf, nScanNfactor, (unsigned int)nLanes));
+        scrypt_buffer_free(scratchbuf);
+
+        Bench("pbkdf2_pre", strMix, 0, nLanes, boost::bind(BenchPBKDF2, 80, 128, nLanes));
+        Bench("pbkdf2_post", strMix, 0, nLanes, boost::bind(BenchPBKDF2, 128, 32, nLanes));
+    }
+    scrypt_set_cpu_mask((size_t)-1);
+
+    // scratchpad allocation and first touch
+    for (int nNfactor = 4; nNfactor <= nMaxNfactor; nNfactor++)
+    {
+        string strPages;
+        BenchScratchAlloc((unsigned char)nNfactor, &strPages);
+        Bench("scratch_alloc", strPages, nNfactor, 1, boost::bind(BenchScratchAlloc, (unsigned char)nNfactor, &strPages));
+    }
+
+    // script interpreter
+    BenchScripts();
+
+    PrintResults(GetBoolArg("-json"));
+    return 0;
+}
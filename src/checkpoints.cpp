@@ -247,6 +247,10 @@ namespace Checkpoints
         // Select the last proof-of-work block
         const CBlockIndex *pindex = GetLastBlockIndex(pindexBest, false);
         // Search forward for a block within max span and maturity window
+        // pennies: every block up to the maturity window passes the test, jump past them
+        int nSkipTo = std::min(pindexBest->nHeight - std::min(6, nCoinbaseMaturity - 20) + 1, pindexBest->nHeight);
+        if (pindex->nHeight < nSkipTo && pindex->IsInMainChain())
+            pindex = FindBlockByHeight(nSkipTo);
         while (pindex->pnext && (pindex->GetBlockTime() + CHECKPOINT_MAX_SPAN <= pindexBest->GetBlockTime() || pindex->nHeight + std::min(6, nCoinbaseMaturity - 20) <= pindexBest->nHeight))
             pindex = pindex->pnext;
         return pindex->GetBlockHash();
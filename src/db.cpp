@@ -14,8 +14,13 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 #ifndef WIN32
 #include "sys/stat.h"
+#include <sys/mman.h>
 #endif
 
 using namespace std;
@@ -82,6 +87,7 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
         nEnvFlags |= DB_PRIVATE;
 
     int nDbCache = GetArg("-dbcache", 25);
+    SetTxCacheSize((int64)nDbCache << 20);
     dbenv.set_lg_dir(pathLogDir.string().c_str());
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
     dbenv.set_lg_bsize(1048576);
@@ -362,6 +368,48 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+bool CDB::WriteBatch(CDBBatch& batch)
+{
+    if (!pdb)
+        return false;
+    if (fReadOnly)
+        assert(!"WriteBatch called on database in read-only mode");
+    if (batch.empty())
+        return true;
+
+    bool fOwnTxn = !activeTxn;
+    if (fOwnTxn && !TxnBegin())
+        return false;
+
+    BOOST_FOREACH(const CDBBatch::CEntry& entry, batch.vEntries)
+    {
+        Dbt datKey(&batch.ssArena[entry.nKeyPos], entry.nKeySize);
+        int ret;
+        if (entry.fErase)
+        {
+            ret = pdb->del(activeTxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue(&batch.ssArena[entry.nValuePos], entry.nValueSize);
+            ret = pdb->put(activeTxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            printf("%s, batch write error:%s\n", strFile.c_str(), db_strerror(ret));
+            if (fOwnTxn)
+                TxnAbort();
+            return false;
+        }
+    }
+
+    if (fOwnTxn)
+        return TxnCommit();
+    return true;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (!fShutdown)
@@ -490,6 +538,11 @@ void CDBEnv::Flush(bool fShutdown)
                 mi++;
         }
         printf("DBFlush(%s)%s ended %15"PRI64d"ms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started", GetTimeMillis() - nStart);
+        CTxDBWriteStats stats;
+        GetTxDBWriteStats(stats);
+        if (stats.nBatches)
+            printf("DBFlush : blkindex.dat write batches %"PRI64d", writes %"PRI64d", erases %"PRI64d", bytes %"PRI64d", avg %.2fms\n",
+                   stats.nBatches, stats.nWrites, stats.nErases, stats.nBytes, stats.nMicros / 1000.0 / stats.nBatches);
         if (fShutdown)
         {
             char** listp;
@@ -511,17 +564,230 @@ void CDBEnv::Flush(bool fShutdown)
 // CTxDB
 //
 
+// pennies: txindex entries (including "not indexed") and transactions read
+// or connected recently, least recently used first out once the cache grows
+// past -dbcache. Only committed state lives here, so entries are never dirty
+// and can be dropped at any time.
+class CTxCacheEntry
+{
+public:
+    bool fIndexed;
+    bool fHaveIndex;
+    CTxIndex txindex;
+    bool fHaveTx;
+    CTransaction tx;
+    unsigned int nBytes;
+    std::list<uint256>::iterator itLRU;
+
+    CTxCacheEntry() : fIndexed(false), fHaveIndex(false), fHaveTx(false), nBytes(0) {}
+
+    unsigned int GetBytes() const
+    {
+        unsigned int n = sizeof(*this) + sizeof(uint256) * 3;
+        if (fHaveIndex)
+            n += txindex.vSpent.size() * sizeof(CDiskTxPos);
+        if (fHaveTx)
+            n += tx.vin.size() * (sizeof(CTxIn) + 32) + tx.vout.size() * (sizeof(CTxOut) + 32) +
+                 ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        return n;
+    }
+};
+
+static CCriticalSection cs_txCache;
+static map<uint256, CTxCacheEntry> mapTxCache;
+static std::list<uint256> listTxCacheLRU;
+static int64 nTxCacheBytes = 0;
+static int64 nTxCacheMaxBytes = 25 << 20;
+
+void SetTxCacheSize(int64 nBytes)
+{
+    LOCK(cs_txCache);
+    nTxCacheMaxBytes = nBytes;
+}
+
+// Entry for hash, created if needed and moved to the front of the LRU list
+static CTxCacheEntry& TxCacheTouch(const uint256& hash)
+{
+    map<uint256, CTxCacheEntry>::iterator mi = mapTxCache.find(hash);
+    if (mi == mapTxCache.end())
+    {
+        mi = mapTxCache.insert(make_pair(hash, CTxCacheEntry())).first;
+        listTxCacheLRU.push_front(hash);
+        mi->second.itLRU = listTxCacheLRU.begin();
+    }
+    else
+        listTxCacheLRU.splice(listTxCacheLRU.begin(), listTxCacheLRU, mi->second.itLRU);
+    return mi->second;
+}
+
+// Account for a changed entry and evict from the back until under budget
+static void TxCacheResize(CTxCacheEntry& entry)
+{
+    nTxCacheBytes -= entry.nBytes;
+    entry.nBytes = entry.GetBytes();
+    nTxCacheBytes += entry.nBytes;
+    while (nTxCacheBytes > nTxCacheMaxBytes && listTxCacheLRU.size() > 1)
+    {
+        map<uint256, CTxCacheEntry>::iterator mi = mapTxCache.find(listTxCacheLRU.back());
+        nTxCacheBytes -= mi->second.nBytes;
+        mapTxCache.erase(mi);
+        listTxCacheLRU.pop_back();
+    }
+}
+
+static void TxCacheStoreIndex(const uint256& hash, bool fIndexed, const CTxIndex& txindex)
+{
+    LOCK(cs_txCache);
+    CTxCacheEntry& entry = TxCacheTouch(hash);
+    entry.fHaveIndex = true;
+    entry.fIndexed = fIndexed;
+    if (fIndexed)
+        entry.txindex = txindex;
+    else
+        entry.txindex.SetNull();
+    TxCacheResize(entry);
+}
+
+static void TxCacheStoreTx(const uint256& hash, const CTransaction& tx)
+{
+    LOCK(cs_txCache);
+    CTxCacheEntry& entry = TxCacheTouch(hash);
+    if (entry.fHaveTx)
+        return;
+    entry.fHaveTx = true;
+    entry.tx = tx;
+    TxCacheResize(entry);
+}
+
+static CCriticalSection cs_txdbWriteStats;
+static CTxDBWriteStats txdbWriteStats;
+
+void GetTxDBWriteStats(CTxDBWriteStats& stats)
+{
+    LOCK(cs_txdbWriteStats);
+    stats = txdbWriteStats;
+}
+
+void CTxDB::TxnClear()
+{
+    mapTxnWrites.clear();
+    setTxnErases.clear();
+    mapTxnBlockIndex.clear();
+}
+
+bool CTxDB::TxnBegin()
+{
+    TxnClear();
+    return CDB::TxnBegin();
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!pdb || !activeTxn)
+        return false;
+
+    // Write back everything staged as one batch inside the transaction
+    int64 nStart = GetTimeMicros();
+    unsigned int nEntries = mapTxnBlockIndex.size() + mapTxnWrites.size() + setTxnErases.size();
+    CDBBatch batch(256 + mapTxnBlockIndex.size() * 256 + mapTxnWrites.size() * 128 + setTxnErases.size() * 48, nEntries);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CDiskBlockIndex)& item, mapTxnBlockIndex)
+        batch.Write(make_pair(string("blockindex"), item.first), item.second);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& item, mapTxnWrites)
+        batch.Write(make_pair(string("tx"), item.first), item.second);
+    BOOST_FOREACH(const uint256& hash, setTxnErases)
+        batch.Erase(make_pair(string("tx"), hash));
+    if (!WriteBatch(batch))
+    {
+        TxnAbort();
+        return error("CTxDB::TxnCommit() : WriteBatch failed");
+    }
+
+    if (!CDB::TxnCommit())
+    {
+        TxnClear();
+        return false;
+    }
+    int64 nMicros = GetTimeMicros() - nStart;
+
+    // Committed, the cache can take them now
+    BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& item, mapTxnWrites)
+        TxCacheStoreIndex(item.first, true, item.second);
+    BOOST_FOREACH(const uint256& hash, setTxnErases)
+        TxCacheStoreIndex(hash, false, CTxIndex());
+    TxnClear();
+
+    if (!batch.empty())
+    {
+        LOCK(cs_txdbWriteStats);
+        txdbWriteStats.nBatches++;
+        txdbWriteStats.nWrites += batch.GetWrites();
+        txdbWriteStats.nErases += batch.GetErases();
+        txdbWriteStats.nBytes += batch.GetBytes();
+        txdbWriteStats.nMicros += nMicros;
+        if (fLogPerf)
+            printf("CTxDB::TxnCommit() : %u writes, %u erases, %u bytes in %.2fms (total %"PRI64d" batches, %"PRI64d" writes, %"PRI64d" erases, %"PRI64d" bytes, avg %.2fms)\n",
+                   batch.GetWrites(), batch.GetErases(), batch.GetBytes(), nMicros / 1000.0,
+                   txdbWriteStats.nBatches, txdbWriteStats.nWrites, txdbWriteStats.nErases, txdbWriteStats.nBytes,
+                   txdbWriteStats.nMicros / 1000.0 / txdbWriteStats.nBatches);
+    }
+    return true;
+}
+
+bool CTxDB::TxnAbort()
+{
+    TxnClear();
+    return CDB::TxnAbort();
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    if (activeTxn)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTxnWrites.find(hash);
+        if (mi != mapTxnWrites.end())
+        {
+            txindex = mi->second;
+            return true;
+        }
+        if (setTxnErases.count(hash))
+            return false;
+    }
+
+    {
+        LOCK(cs_txCache);
+        map<uint256, CTxCacheEntry>::iterator mi = mapTxCache.find(hash);
+        if (mi != mapTxCache.end() && mi->second.fHaveIndex)
+        {
+            TxCacheTouch(hash);
+            if (mi->second.fIndexed)
+                txindex = mi->second.txindex;
+            return mi->second.fIndexed;
+        }
+    }
+
+    bool fIndexed = Read(make_pair(string("tx"), hash), txindex);
+    if (!fIndexed)
+        txindex.SetNull();
+    TxCacheStoreIndex(hash, fIndexed, txindex);
+    return fIndexed;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (activeTxn)
+    {
+        mapTxnWrites[hash] = txindex;
+        setTxnErases.erase(hash);
+        return true;
+    }
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    TxCacheStoreIndex(hash, true, txindex);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -531,7 +797,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -539,13 +805,22 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    if (activeTxn)
+    {
+        mapTxnWrites.erase(hash);
+        setTxnErases.insert(hash);
+        return true;
+    }
+    bool fErased = Erase(make_pair(string("tx"), hash));
+    TxCacheStoreIndex(hash, false, CTxIndex());
+    return fErased;
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
+    CTxIndex txindex;
+    return ReadTxIndex(hash, txindex);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
@@ -554,7 +829,7 @@ bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
     tx.SetNull();
     if (!ReadTxIndex(hash, txindex))
         return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    return ReadDiskTx(hash, txindex.pos, tx);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -574,8 +849,41 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadDiskTx(uint256 hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    {
+        LOCK(cs_txCache);
+        map<uint256, CTxCacheEntry>::iterator mi = mapTxCache.find(hash);
+        if (mi != mapTxCache.end() && mi->second.fHaveTx)
+        {
+            TxCacheTouch(hash);
+            tx = mi->second.tx;
+            return true;
+        }
+    }
+
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    TxCacheStoreTx(hash, tx);
+    return true;
+}
+
+void CTxDB::CacheTx(const CTransaction& tx)
+{
+    TxCacheStoreTx(tx.GetHash(), tx);
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
+    // pennies: within a transaction the last write of each entry wins, so
+    // only that one reaches the database
+    if (activeTxn)
+    {
+        uint256 hash = blockindex.GetBlockHash();
+        mapTxnBlockIndex.erase(hash);
+        mapTxnBlockIndex.insert(make_pair(hash, blockindex));
+        return true;
+    }
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
@@ -641,29 +949,35 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
 
 bool CTxDB::LoadBlockIndex()
 {
-    if (!LoadBlockIndexGuts())
+    // pennies: the snapshot already carries chain trust and stake modifier
+    // checksums, they are only computed for an index read from the database
+    bool fSnapshot = LoadBlockIndexSnapshot();
+    if (!fSnapshot && !LoadBlockIndexGuts())
         return false;
 
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Calculate nChainTrust
+    if (!fSnapshot)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
-        // ppcoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
-        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
-            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : uint256(0)) + pindex->GetBlockTrust();
+            // ppcoin: calculate stake modifier checksum
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+            if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+                return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
+        }
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -676,11 +990,12 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    UpdateBestChainIndex(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestHeightTime = pindexBest->GetBlockTime();    // WM - Record timestamp of current best block.
-    bnBestChainTrust = pindexBest->bnChainTrust;
+    nBestChainTrust = pindexBest->nChainTrust;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
     // ppcoin: load hashSyncCheckpoint
@@ -689,7 +1004,9 @@ bool CTxDB::LoadBlockIndex()
     printf("LoadBlockIndex(): synchronized checkpoint %s\n", Checkpoints::hashSyncCheckpoint.ToString().c_str());
 
     // Load bnBestInvalidTrust, OK if it doesn't exist
-    ReadBestInvalidTrust(bnBestInvalidTrust);
+    CBigNum bnBestInvalidTrust;
+    if (ReadBestInvalidTrust(bnBestInvalidTrust))
+        nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
     // Verify blocks in the best chain
     int nCheckLevel = GetArg("-checklevel", 1);
@@ -918,6 +1235,418 @@ bool CTxDB::LoadBlockIndexGuts()
 
 
 
+//
+// pennies: block index snapshot
+//
+// A flat copy of the whole in-memory block index, written on clean shutdown
+// and loaded instead of walking the blockindex records of blkindex.dat on
+// the next start. Entries are in height order and have a fixed size, and
+// they refer to their neighbours by position, so they decode on all cores
+// without map lookups and load without a height sort. They also carry
+// the chain trust and stake modifier checksum so neither is recomputed. The
+// file is removed once loaded, a node that does not shut down cleanly falls
+// back to the database on its next start.
+//
+
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+// Entries checksummed as one unit, each unit hashed on its own thread
+static const unsigned int BLOCKINDEX_SNAPSHOT_CHUNK = 4096;
+
+class CBlockIndexSnapshotHeader
+{
+public:
+    unsigned char pchMagic[4];
+    int nSnapshotVersion;
+    unsigned int nEntries;
+    unsigned int nEntrySize;
+    uint256 hashBestChain;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(FLATDATA(pchMagic));
+        READWRITE(nSnapshotVersion);
+        READWRITE(nEntries);
+        READWRITE(nEntrySize);
+        READWRITE(hashBestChain);
+    )
+};
+
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hashBlock;
+    int nPrev;
+    int nNext;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    int64 nMint;
+    int64 nMoneySupply;
+    unsigned int nFlags;
+    uint64 nStakeModifier;
+    unsigned int nStakeModifierChecksum;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    uint256 hashProofOfStake;
+    int nVersion;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    uint256 hashChainTrust;
+
+    CBlockIndexSnapshotEntry()
+    {
+        nPrev = nNext = -1;
+        nFile = nBlockPos = 0;
+        nHeight = 0;
+        nMint = nMoneySupply = 0;
+        nFlags = 0;
+        nStakeModifier = 0;
+        nStakeModifierChecksum = 0;
+        nStakeTime = 0;
+        nVersion = 0;
+        nTime = nBits = nNonce = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(nPrev);
+        READWRITE(nNext);
+        READWRITE(nFile);
+        READWRITE(nBlockPos);
+        READWRITE(nHeight);
+        READWRITE(nMint);
+        READWRITE(nMoneySupply);
+        READWRITE(nFlags);
+        READWRITE(nStakeModifier);
+        READWRITE(nStakeModifierChecksum);
+        READWRITE(prevoutStake);
+        READWRITE(nStakeTime);
+        READWRITE(hashProofOfStake);
+        READWRITE(nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(hashChainTrust);
+    )
+};
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+// Hash every BLOCKINDEX_SNAPSHOT_CHUNK entries of pentries into vChunkHash
+static void HashSnapshotChunks(const char* pentries, unsigned int nEntries, unsigned int nEntrySize,
+                               vector<uint256>* pvChunkHash, unsigned int nFirst, unsigned int nStep)
+{
+    for (unsigned int i = nFirst; i < pvChunkHash->size(); i += nStep)
+    {
+        const char* pbegin = pentries + (size_t)i * BLOCKINDEX_SNAPSHOT_CHUNK * nEntrySize;
+        unsigned int nCount = min(BLOCKINDEX_SNAPSHOT_CHUNK, nEntries - i * BLOCKINDEX_SNAPSHOT_CHUNK);
+        (*pvChunkHash)[i] = Hash(pbegin, pbegin + (size_t)nCount * nEntrySize);
+    }
+}
+
+static uint256 SnapshotChecksum(const char* pheader, unsigned int nHeaderSize, const char* pentries, unsigned int nEntries, unsigned int nEntrySize)
+{
+    vector<uint256> vChunkHash((nEntries + BLOCKINDEX_SNAPSHOT_CHUNK - 1) / BLOCKINDEX_SNAPSHOT_CHUNK);
+
+    unsigned int nThreads = max(1u, min(boost::thread::hardware_concurrency(), (unsigned int)vChunkHash.size()));
+    boost::thread_group threads;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threads.create_thread(boost::bind(&HashSnapshotChunks, pentries, nEntries, nEntrySize, &vChunkHash, i, nThreads));
+    HashSnapshotChunks(pentries, nEntries, nEntrySize, &vChunkHash, 0, nThreads);
+    threads.join_all();
+
+    vChunkHash.push_back(Hash(pheader, pheader + nHeaderSize));
+    return Hash(BEGIN(vChunkHash[0]), END(vChunkHash.back()));
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    if (!GetBoolArg("-indexsnapshot", true) || fClient)
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    LOCK(cs_main);
+    if (mapBlockIndex.empty())
+        return false;
+
+    // Entries in height order, so loading allocates them from the block index
+    // arena in the order chain walks visit them
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    map<const CBlockIndex*, int> mapPos;
+    int nPos = 0;
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        mapPos[item.second] = nPos++;
+
+    CBlockIndexSnapshotHeader header;
+    memcpy(header.pchMagic, pchMessageStart, sizeof(header.pchMagic));
+    header.nSnapshotVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nEntries = mapBlockIndex.size();
+    header.nEntrySize = ::GetSerializeSize(CBlockIndexSnapshotEntry(), SER_DISK, CLIENT_VERSION);
+    header.hashBestChain = hashBestChain;
+
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << header;
+    CDataStream ssEntries(SER_DISK, CLIENT_VERSION);
+    ssEntries.reserve((size_t)header.nEntries * header.nEntrySize);
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        const CBlockIndex* pindex = item.second;
+        CBlockIndexSnapshotEntry entry;
+        entry.hashBlock = pindex->GetBlockHash();
+        entry.nPrev = pindex->pprev ? mapPos[pindex->pprev] : -1;
+        entry.nNext = pindex->pnext ? mapPos[pindex->pnext] : -1;
+        entry.nFile = pindex->nFile;
+        entry.nBlockPos = pindex->nBlockPos;
+        entry.nHeight = pindex->nHeight;
+        entry.nMint = pindex->nMint;
+        entry.nMoneySupply = pindex->nMoneySupply;
+        entry.nFlags = pindex->nFlags;
+        entry.nStakeModifier = pindex->nStakeModifier;
+        entry.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+        entry.prevoutStake = pindex->prevoutStake;
+        entry.nStakeTime = pindex->nStakeTime;
+        entry.hashProofOfStake = pindex->hashProofOfStake;
+        entry.nVersion = pindex->nVersion;
+        entry.hashMerkleRoot = pindex->hashMerkleRoot;
+        entry.nTime = pindex->nTime;
+        entry.nBits = pindex->nBits;
+        entry.nNonce = pindex->nNonce;
+        entry.hashChainTrust = pindex->nChainTrust;
+        ssEntries << entry;
+    }
+    uint256 hashChecksum = SnapshotChecksum(&ssHeader[0], ssHeader.size(), &ssEntries[0], header.nEntries, header.nEntrySize);
+
+    // Write to a temporary file and move it into place
+    boost::filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    try {
+        fileout.write(&ssHeader[0], ssHeader.size());
+        fileout.write(&ssEntries[0], ssEntries.size());
+        fileout << hashChecksum;
+    }
+    catch (std::exception &e) {
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : rename failed");
+
+    printf("WriteBlockIndexSnapshot() : %u entries, %"PRIszu" bytes in %"PRI64d"ms\n",
+           header.nEntries, ssHeader.size() + ssEntries.size() + sizeof(hashChecksum), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Decode entries nFirst, nFirst + nStep, ... into the preallocated vIndex
+static void DecodeSnapshotEntries(const char* pentries, unsigned int nEntrySize, vector<CBlockIndex*>* pvIndex,
+                                  vector<uint256>* pvHash, unsigned int nFirst, unsigned int nStep, boost::atomic<bool>* pfError)
+{
+    vector<CBlockIndex*>& vIndex = *pvIndex;
+    try {
+        for (unsigned int i = nFirst; i < vIndex.size() && !*pfError; i += nStep)
+        {
+            const char* pbegin = pentries + (size_t)i * nEntrySize;
+            CBlockIndexSnapshotEntry entry;
+            CBufferReader(pbegin, pbegin + nEntrySize, SER_DISK, CLIENT_VERSION) >> entry;
+            if (entry.nPrev >= (int)vIndex.size() || entry.nNext >= (int)vIndex.size())
+            {
+                *pfError = true;
+                break;
+            }
+
+            CBlockIndex* pindex = vIndex[i];
+            (*pvHash)[i]            = entry.hashBlock;
+            pindex->pprev           = entry.nPrev >= 0 ? vIndex[entry.nPrev] : NULL;
+            pindex->pnext           = entry.nNext >= 0 ? vIndex[entry.nNext] : NULL;
+            pindex->nFile           = entry.nFile;
+            pindex->nBlockPos       = entry.nBlockPos;
+            pindex->nHeight         = entry.nHeight;
+            pindex->nMint           = entry.nMint;
+            pindex->nMoneySupply    = entry.nMoneySupply;
+            pindex->nFlags          = entry.nFlags;
+            pindex->nStakeModifier  = entry.nStakeModifier;
+            pindex->nStakeModifierChecksum = entry.nStakeModifierChecksum;
+            pindex->prevoutStake    = entry.prevoutStake;
+            pindex->nStakeTime      = entry.nStakeTime;
+            pindex->hashProofOfStake = entry.hashProofOfStake;
+            pindex->nVersion        = entry.nVersion;
+            pindex->hashMerkleRoot  = entry.hashMerkleRoot;
+            pindex->nTime           = entry.nTime;
+            pindex->nBits           = entry.nBits;
+            pindex->nNonce          = entry.nNonce;
+            pindex->nChainTrust = entry.hashChainTrust;
+
+            if (!pindex->CheckIndex() || !CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+            {
+                *pfError = true;
+                break;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        *pfError = true;
+    }
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    // Only a clean shutdown leaves a snapshot behind, and anything written
+    // from here on goes to the database alone. The file is removed before
+    // anything can return early, so a stale one is never loaded later.
+    boost::filesystem::path pathSnapshot = BlockIndexSnapshotPath();
+    if (!GetBoolArg("-indexsnapshot", true))
+    {
+        boost::filesystem::remove(pathSnapshot);
+        return false;
+    }
+
+    FILE* file = fopen(pathSnapshot.string().c_str(), "rb");
+    if (!file)
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    // Map the file, or read it whole where mapping isn't available
+    const char* pbegin = NULL;
+    size_t nSize = 0;
+    vector<char> vData;
+#ifndef WIN32
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (p != MAP_FAILED)
+        {
+            pbegin = (const char*)p;
+            nSize = st.st_size;
+        }
+    }
+#endif
+    if (!pbegin)
+    {
+        int nFileSize = GetFilesize(file);
+        if (nFileSize > 0)
+        {
+            vData.resize(nFileSize);
+            if (fread(&vData[0], 1, nFileSize, file) == (size_t)nFileSize)
+            {
+                pbegin = &vData[0];
+                nSize = nFileSize;
+            }
+        }
+    }
+    fclose(file);
+    boost::filesystem::remove(pathSnapshot);
+    if (!pbegin)
+        return false;
+
+    bool fLoaded = false;
+    vector<CBlockIndex*> vIndex;
+    do
+    {
+        // Header, then check it describes this database and the file size
+        CBlockIndexSnapshotHeader header;
+        unsigned int nHeaderSize = ::GetSerializeSize(header, SER_DISK, CLIENT_VERSION);
+        unsigned int nEntrySize = ::GetSerializeSize(CBlockIndexSnapshotEntry(), SER_DISK, CLIENT_VERSION);
+        uint256 hashBestChainDB;
+        try {
+            CBufferReader(pbegin, pbegin + nSize, SER_DISK, CLIENT_VERSION) >> header;
+        }
+        catch (std::exception &e) {
+            printf("LoadBlockIndexSnapshot() : bad header\n");
+            break;
+        }
+        if (memcmp(header.pchMagic, pchMessageStart, sizeof(header.pchMagic)) != 0 ||
+            header.nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION || header.nEntrySize != nEntrySize || header.nEntries == 0 ||
+            nSize != nHeaderSize + (size_t)header.nEntries * nEntrySize + sizeof(uint256))
+        {
+            printf("LoadBlockIndexSnapshot() : version or size mismatch\n");
+            break;
+        }
+        if (!ReadHashBestChain(hashBestChainDB) || hashBestChainDB != header.hashBestChain)
+        {
+            printf("LoadBlockIndexSnapshot() : snapshot is not of the current best chain\n");
+            break;
+        }
+
+        const char* pentries = pbegin + nHeaderSize;
+        uint256 hashChecksum;
+        memcpy(hashChecksum.begin(), pbegin + nSize - sizeof(uint256), sizeof(uint256));
+        if (SnapshotChecksum(pbegin, nHeaderSize, pentries, header.nEntries, nEntrySize) != hashChecksum)
+        {
+            printf("LoadBlockIndexSnapshot() : checksum mismatch\n");
+            break;
+        }
+
+        // Decode on every core
+        vIndex.resize(header.nEntries);
+        for (unsigned int i = 0; i < header.nEntries; i++)
+            vIndex[i] = new CBlockIndex();
+        vector<uint256> vHash(header.nEntries);
+        boost::atomic<bool> fError(false);
+        unsigned int nThreads = max(1u, boost::thread::hardware_concurrency());
+        boost::thread_group threads;
+        for (unsigned int i = 1; i < nThreads; i++)
+            threads.create_thread(boost::bind(&DecodeSnapshotEntries, pentries, nEntrySize, &vIndex, &vHash, i, nThreads, &fError));
+        DecodeSnapshotEntries(pentries, nEntrySize, &vIndex, &vHash, 0, nThreads, &fError);
+        threads.join_all();
+        if (fError)
+        {
+            printf("LoadBlockIndexSnapshot() : bad entry\n");
+            break;
+        }
+
+        mapBlockIndex.clear();
+        for (unsigned int i = 0; i < header.nEntries; i++)
+        {
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(vHash[i], vIndex[i])).first;
+            vIndex[i]->phashBlock = &((*mi).first);
+            if (pindexGenesisBlock == NULL && vHash[i] == hashGenesisBlock)
+                pindexGenesisBlock = vIndex[i];
+            if (vIndex[i]->IsProofOfStake())
+                setStakeSeen.insert(make_pair(vIndex[i]->prevoutStake, vIndex[i]->nStakeTime));
+        }
+        if (mapBlockIndex.size() != header.nEntries)
+        {
+            // Duplicate hashes, the snapshot can't be trusted
+            mapBlockIndex.clear();
+            setStakeSeen.clear();
+            pindexGenesisBlock = NULL;
+            printf("LoadBlockIndexSnapshot() : duplicate entries\n");
+            break;
+        }
+        vIndex.clear();
+        fLoaded = true;
+        printf("LoadBlockIndexSnapshot() : %u entries in %"PRI64d"ms on %u threads\n", header.nEntries, GetTimeMillis() - nStart, nThreads);
+    } while (false);
+
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        delete pindex;
+#ifndef WIN32
+    if (vData.empty())
+        munmap((void*)pbegin, nSize);
+#endif
+
+    return fLoaded;
+}
+
+
+
+
 
 //
 // CAddrDB
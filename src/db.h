@@ -8,6 +8,7 @@
 #include "main.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -93,6 +94,77 @@ public:
 extern CDBEnv bitdb;
 
 
+/** Puts and erases collected into one pre-sized arena and applied together
+ * by CDB::WriteBatch, rather than a key and value stream allocated for each
+ * record. Records are applied in the order they were added.
+ */
+class CDBBatch
+{
+private:
+    class CEntry
+    {
+    public:
+        bool fErase;
+        unsigned int nKeyPos;
+        unsigned int nKeySize;
+        unsigned int nValuePos;
+        unsigned int nValueSize;
+    };
+
+    CDataStream ssArena;
+    std::vector<CEntry> vEntries;
+    unsigned int nErases;
+
+    friend class CDB;
+
+public:
+    CDBBatch(size_t nReserveBytes=65536, size_t nReserveEntries=256) : ssArena(SER_DISK, CLIENT_VERSION), nErases(0)
+    {
+        ssArena.reserve(nReserveBytes);
+        vEntries.reserve(nReserveEntries);
+    }
+
+    template<typename K, typename T>
+    void Write(const K& key, const T& value)
+    {
+        CEntry entry;
+        entry.fErase = false;
+        entry.nKeyPos = ssArena.size();
+        ssArena << key;
+        entry.nValuePos = ssArena.size();
+        entry.nKeySize = entry.nValuePos - entry.nKeyPos;
+        ssArena << value;
+        entry.nValueSize = ssArena.size() - entry.nValuePos;
+        vEntries.push_back(entry);
+    }
+
+    template<typename K>
+    void Erase(const K& key)
+    {
+        CEntry entry;
+        entry.fErase = true;
+        entry.nKeyPos = ssArena.size();
+        ssArena << key;
+        entry.nKeySize = ssArena.size() - entry.nKeyPos;
+        entry.nValuePos = entry.nValueSize = 0;
+        vEntries.push_back(entry);
+        nErases++;
+    }
+
+    bool empty() const                  { return vEntries.empty(); }
+    unsigned int GetWrites() const      { return vEntries.size() - nErases; }
+    unsigned int GetErases() const      { return nErases; }
+    unsigned int GetBytes() const       { return ssArena.size(); }
+
+    void Clear()
+    {
+        ssArena.clear();
+        vEntries.clear();
+        nErases = 0;
+    }
+};
+
+
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
@@ -226,6 +298,10 @@ protected:
         return (ret == 0);
     }
 
+    // Apply every record of batch, inside the open transaction if there is
+    // one and in a transaction of its own otherwise
+    bool WriteBatch(CDBBatch& batch);
+
     Dbc* GetCursor()
     {
         if (!pdb)
@@ -326,7 +402,31 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
+/** Size in bytes of the in-memory txindex and transaction cache shared by all CTxDB */
+void SetTxCacheSize(int64 nBytes);
+
+/** Write batches CTxDB has committed, counted since startup */
+class CTxDBWriteStats
+{
+public:
+    int64 nBatches;
+    int64 nWrites;
+    int64 nErases;
+    int64 nBytes;
+    int64 nMicros;
+
+    CTxDBWriteStats() : nBatches(0), nWrites(0), nErases(0), nBytes(0), nMicros(0) {}
+};
+void GetTxDBWriteStats(CTxDBWriteStats& stats);
+
+/** Access to the transaction database (blkindex.dat)
+ *
+ * pennies: tx index entries and the transactions they point to are cached in
+ * memory across all CTxDB instances, so connecting a block mostly reads from
+ * memory. Inside TxnBegin/TxnCommit txindex and block index changes are only
+ * staged, and are written back as one CDBBatch just before the database
+ * transaction commits.
+ */
 class CTxDB : public CDB
 {
 public:
@@ -334,7 +434,19 @@ public:
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    // txindex and block index changes of the open transaction, not yet in
+    // the database
+    std::map<uint256, CTxIndex> mapTxnWrites;
+    std::set<uint256> setTxnErases;
+    std::map<uint256, CDiskBlockIndex> mapTxnBlockIndex;
+
+    void TxnClear();
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -344,6 +456,10 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    // Transaction hash stored at pos, from the cache when it is there
+    bool ReadDiskTx(uint256 hash, const CDiskTxPos& pos, CTransaction& tx);
+    // Keep a transaction that is about to be indexed in the cache
+    void CacheTx(const CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
@@ -356,8 +472,12 @@ public:
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
 };
 
+/** Write the block index to blkindex.snapshot for a fast next start */
+bool WriteBlockIndexSnapshot();
+
 
 
 
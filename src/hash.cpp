@@ -1,5 +1,9 @@
 #include "hash.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
@@ -97,3 +101,149 @@ int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx)
     SHA512_Update(&pctx->ctxOuter, buf, 64);
     return SHA512_Final(pmd, &pctx->ctxOuter);
 }
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#if defined(__SSE2__)
+
+#define ROTR4(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+#define ADD4(a, b) _mm_add_epi32(a, b)
+
+// One compression of the initial state over block w, four lanes at once;
+// word i of lane l is at [i][l]
+static void SHA256Transform4Way(uint32_t state[8][4], const uint32_t block[16][4])
+{
+    __m128i w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_loadu_si128((const __m128i*)block[i]);
+    for (int i = 16; i < 64; i++)
+    {
+        __m128i s0 = _mm_xor_si128(_mm_xor_si128(ROTR4(w[i-15], 7), ROTR4(w[i-15], 18)), _mm_srli_epi32(w[i-15], 3));
+        __m128i s1 = _mm_xor_si128(_mm_xor_si128(ROTR4(w[i-2], 17), ROTR4(w[i-2], 19)), _mm_srli_epi32(w[i-2], 10));
+        w[i] = ADD4(ADD4(w[i-16], s0), ADD4(w[i-7], s1));
+    }
+
+    __m128i a = _mm_set1_epi32(sha256_h[0]), b = _mm_set1_epi32(sha256_h[1]);
+    __m128i c = _mm_set1_epi32(sha256_h[2]), d = _mm_set1_epi32(sha256_h[3]);
+    __m128i e = _mm_set1_epi32(sha256_h[4]), f = _mm_set1_epi32(sha256_h[5]);
+    __m128i g = _mm_set1_epi32(sha256_h[6]), h = _mm_set1_epi32(sha256_h[7]);
+    for (int i = 0; i < 64; i++)
+    {
+        __m128i S1 = _mm_xor_si128(_mm_xor_si128(ROTR4(e, 6), ROTR4(e, 11)), ROTR4(e, 25));
+        __m128i ch = _mm_xor_si128(_mm_and_si128(e, f), _mm_andnot_si128(e, g));
+        __m128i t1 = ADD4(ADD4(ADD4(h, S1), ADD4(ch, _mm_set1_epi32(sha256_k[i]))), w[i]);
+        __m128i S0 = _mm_xor_si128(_mm_xor_si128(ROTR4(a, 2), ROTR4(a, 13)), ROTR4(a, 22));
+        __m128i maj = _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, _mm_or_si128(a, b)));
+        __m128i t2 = ADD4(S0, maj);
+        h = g; g = f; f = e; e = ADD4(d, t1);
+        d = c; c = b; b = a; a = ADD4(t1, t2);
+    }
+
+    _mm_storeu_si128((__m128i*)state[0], ADD4(a, _mm_set1_epi32(sha256_h[0])));
+    _mm_storeu_si128((__m128i*)state[1], ADD4(b, _mm_set1_epi32(sha256_h[1])));
+    _mm_storeu_si128((__m128i*)state[2], ADD4(c, _mm_set1_epi32(sha256_h[2])));
+    _mm_storeu_si128((__m128i*)state[3], ADD4(d, _mm_set1_epi32(sha256_h[3])));
+    _mm_storeu_si128((__m128i*)state[4], ADD4(e, _mm_set1_epi32(sha256_h[4])));
+    _mm_storeu_si128((__m128i*)state[5], ADD4(f, _mm_set1_epi32(sha256_h[5])));
+    _mm_storeu_si128((__m128i*)state[6], ADD4(g, _mm_set1_epi32(sha256_h[6])));
+    _mm_storeu_si128((__m128i*)state[7], ADD4(h, _mm_set1_epi32(sha256_h[7])));
+}
+
+#undef ROTR4
+#undef ADD4
+
+#else
+
+static inline uint32_t ROTR32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void SHA256Transform4Way(uint32_t state[8][4], const uint32_t block[16][4])
+{
+    for (int l = 0; l < 4; l++)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = block[i][l];
+        for (int i = 16; i < 64; i++)
+            w[i] = w[i-16] + (ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3)) +
+                   w[i-7] + (ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+        uint32_t a = sha256_h[0], b = sha256_h[1], c = sha256_h[2], d = sha256_h[3];
+        uint32_t e = sha256_h[4], f = sha256_h[5], g = sha256_h[6], h = sha256_h[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) | (c & (a | b)));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0][l] = a + sha256_h[0]; state[1][l] = b + sha256_h[1];
+        state[2][l] = c + sha256_h[2]; state[3][l] = d + sha256_h[3];
+        state[4][l] = e + sha256_h[4]; state[5][l] = f + sha256_h[5];
+        state[6][l] = g + sha256_h[6]; state[7][l] = h + sha256_h[7];
+    }
+}
+
+#endif
+
+void Hash4Way(const unsigned char* const pmsg[4], size_t nLen, uint256 hash[4])
+{
+    assert(nLen <= 55);
+
+    // Message, 0x80 and the bit length, as big endian words
+    uint32_t block[16][4];
+    for (int l = 0; l < 4; l++)
+    {
+        unsigned char pad[64];
+        memcpy(pad, pmsg[l], nLen);
+        memset(pad + nLen, 0, sizeof(pad) - nLen);
+        pad[nLen] = 0x80;
+        pad[62] = (unsigned char)((nLen * 8) >> 8);
+        pad[63] = (unsigned char)(nLen * 8);
+        for (int i = 0; i < 16; i++)
+            block[i][l] = ((uint32_t)pad[4*i] << 24) | ((uint32_t)pad[4*i+1] << 16) | ((uint32_t)pad[4*i+2] << 8) | pad[4*i+3];
+    }
+    uint32_t state[8][4];
+    SHA256Transform4Way(state, block);
+
+    // Second pass over the 32 byte digest
+    for (int i = 0; i < 8; i++)
+        for (int l = 0; l < 4; l++)
+            block[i][l] = state[i][l];
+    for (int l = 0; l < 4; l++)
+    {
+        block[8][l] = 0x80000000;
+        for (int i = 9; i < 15; i++)
+            block[i][l] = 0;
+        block[15][l] = 256;
+    }
+    SHA256Transform4Way(state, block);
+
+    for (int l = 0; l < 4; l++)
+    {
+        unsigned char* p = hash[l].begin();
+        for (int i = 0; i < 8; i++)
+        {
+            p[4*i]   = (unsigned char)(state[i][l] >> 24);
+            p[4*i+1] = (unsigned char)(state[i][l] >> 16);
+            p[4*i+2] = (unsigned char)(state[i][l] >> 8);
+            p[4*i+3] = (unsigned char)state[i][l];
+        }
+    }
+}
@@ -126,6 +126,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** Double SHA-256 of four messages of the same length, at most 55 bytes so
+ * each fits one block. Runs the four in SSE2 lanes where available */
+void Hash4Way(const unsigned char* const pmsg[4], size_t nLen, uint256 hash[4]);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -17,6 +17,10 @@
 #include <boost/algorithm/string/predicate.hpp>
 #include <openssl/crypto.h>
 
+extern "C" {
+#include "scrypt-jane/scrypt-jane.h"
+}
+
 #ifndef WIN32
 #include <signal.h>
 #endif
@@ -75,6 +79,7 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        WriteBlockIndexSnapshot();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -223,8 +228,16 @@ std::string HelpMessage()
         "  -pid=<file>            " + _("Specify pid file (default: pennies.pid)") + "\n" +
         "  -gen                   " + _("Generate coins") + "\n" +
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
+        "  -mineraffinity         " + _("Pin each mining thread to its own cpu, keeping its scrypt scratchpad on the local NUMA node (default: 0)") + "\n" +
+        "  -scrypthugepages       " + _("Back scrypt scratchpads with huge pages when available (default: 0)") + "\n" +
+        "  -nativesign            " + _("Sign with the built-in constant time secp256k1 code instead of OpenSSL (default: 0)") + "\n" +
+        "  -scryptthreads=<n>     " + _("Threads hashing received block headers ahead of block processing, 0 to disable (default: cores - 1)") + "\n" +
+        "  -sigcache=<n>          " + _("Size of the cache of verified signatures in megabytes (default: 32)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Size of the cache of verified signatures in entries, used when -sigcache is not given") + "\n" +
+        "  -par=<n>               " + _("Threads verifying block scripts besides the one connecting the block, 0 to disable (default: cores - 1, at most 16)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
-        "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbcache=<n>           " + _("Set database cache size in megabytes, used for both the database and the transaction index cache (default: 25)") + "\n" +
+        "  -indexsnapshot         " + _("Save the block index to blkindex.snapshot on shutdown and load it on start (default: 1)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -418,6 +431,8 @@ bool AppInit2()
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps", true);//timestamp is very important for debug
     fLogPerf = GetBoolArg("-logperf");
+    scrypt_set_hugepages(GetBoolArg("-scrypthugepages"));
+    fNativeSign = GetBoolArg("-nativesign");
 	nSyncThreshold = GetArg("-syncthreshold", nSyncThreshold);
 	nSyncTimer = GetArg("-synctimer", nSyncTimer);
 
@@ -494,12 +509,16 @@ bool AppInit2()
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Pennies version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using scrypt mix %s, %u lanes\n", scrypt_mix_name(), (unsigned int)scrypt_lanes_max());
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
     printf("Used data directory %s\n", strDataDir.c_str());
     std::ostringstream strErrors;
 
+    // pennies: started after daemonizing, blocks may be connected from step 7 on
+    StartScriptCheckThreads(GetArg("-par", max(boost::thread::hardware_concurrency(), 1u) - 1));
+
     if (fDaemon)
         fprintf(stdout, "Pennies server starting\n");
 
@@ -6,6 +6,7 @@
 
 #include "kernel.h"
 #include "db.h"
+#include "hash.h"
 
 using namespace std;
 
@@ -202,37 +203,97 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     return true;
 }
 
+// pennies: GetKernelStakeModifier results by block-from hash. A result only
+// depends on the best chain above the block, so blocks connected on top never
+// change it and only a reorg below it drops it
+class CStakeModifierCacheEntry
+{
+public:
+    uint64 nStakeModifier;
+    int nStakeModifierHeight;
+    int64 nStakeModifierTime;
+};
+
+static const unsigned int MAX_STAKE_MODIFIER_CACHE = 100000;
+static CCriticalSection cs_stakeModifierCache;
+static map<uint256, CStakeModifierCacheEntry> mapStakeModifierCache;
+
+// Kernel candidates by outpoint. Like the modifiers they only go stale on a
+// reorg, which may also move txPrev to another block
+static const unsigned int MAX_STAKE_KERNEL_CANDIDATES = 100000;
+static map<COutPoint, CStakeKernelCandidate> mapStakeKernelCandidates;
+
+void StakeModifierCacheReorganize(int nForkHeight)
+{
+    LOCK(cs_stakeModifierCache);
+    map<uint256, CStakeModifierCacheEntry>::iterator it = mapStakeModifierCache.begin();
+    while (it != mapStakeModifierCache.end())
+    {
+        if (it->second.nStakeModifierHeight > nForkHeight)
+            mapStakeModifierCache.erase(it++);
+        else
+            ++it;
+    }
+    mapStakeKernelCandidates.clear();
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
 {
+    {
+        LOCK(cs_stakeModifierCache);
+        map<uint256, CStakeModifierCacheEntry>::const_iterator it = mapStakeModifierCache.find(hashBlockFrom);
+        if (it != mapStakeModifierCache.end())
+        {
+            nStakeModifier = it->second.nStakeModifier;
+            nStakeModifierHeight = it->second.nStakeModifierHeight;
+            nStakeModifierTime = it->second.nStakeModifierTime;
+            return true;
+        }
+    }
+
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    map<uint256, CBlockIndex*>::const_iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
         return error("GetKernelStakeModifier() : block not indexed, hash:%s", hashBlockFrom.ToString().c_str());
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexFrom = mi->second;
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval)
+    // pennies: the block the walk through pnext for the stake modifier a
+    // selection interval later would stop at, found by binary search
+    const CBlockIndex* pindex = NULL;
+    if (pindexFrom->IsInMainChain())
+        pindex = FindStakeModifierBlock(pindexFrom, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+    if (!pindex)
+    {   // reached best block; may happen if node is behind on block chain
+        const CBlockIndex* pindexLast = pindexFrom->IsInMainChain() ? pindexBest : pindexFrom;
+        if (fPrintProofOfStake || (pindexLast->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
+            return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
+                pindexLast->GetBlockHash().ToString().c_str(), pindexLast->nHeight, hashBlockFrom.ToString().c_str());
+        else
+            return false;
+    }
+    nStakeModifierHeight = pindex->nHeight;
+    nStakeModifierTime = pindex->GetBlockTime();
+    nStakeModifier = pindex->nStakeModifier;
+
     {
-        if (!pindex->pnext)
-        {   // reached best block; may happen if node is behind on block chain
-            if (fPrintProofOfStake || (pindex->GetBlockTime() + nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime()))
-                return error("GetKernelStakeModifier() : reached best block %s at height %d from block %s",
-                    pindex->GetBlockHash().ToString().c_str(), pindex->nHeight, hashBlockFrom.ToString().c_str());
-            else
-                return false;
-        }
-        pindex = pindex->pnext;
-        if (pindex->GeneratedStakeModifier())
+        LOCK(cs_stakeModifierCache);
+        // Evict a random entry when full
+        if (mapStakeModifierCache.size() >= MAX_STAKE_MODIFIER_CACHE)
         {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
+            map<uint256, CStakeModifierCacheEntry>::iterator it = mapStakeModifierCache.lower_bound(GetRandHash());
+            if (it == mapStakeModifierCache.end())
+                it = mapStakeModifierCache.begin();
+            mapStakeModifierCache.erase(it);
         }
+        CStakeModifierCacheEntry& entry = mapStakeModifierCache[hashBlockFrom];
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
     }
-    nStakeModifier = pindex->nStakeModifier;
     return true;
 }
 
@@ -323,6 +384,132 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+bool GetStakeKernelCandidate(CTxDB& txdb, const CTransaction& txPrev, unsigned int nOut, CStakeKernelCandidate& candidate)
+{
+    COutPoint prevout(txPrev.GetHash(), nOut);
+    {
+        LOCK(cs_stakeModifierCache);
+        map<COutPoint, CStakeKernelCandidate>::const_iterator it = mapStakeKernelCandidates.find(prevout);
+        if (it != mapStakeKernelCandidates.end())
+        {
+            candidate = it->second;
+            return true;
+        }
+    }
+
+    CTxIndex txindex;
+    if (!txdb.ReadTxIndex(prevout.hash, txindex))
+        return false;
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    uint64 nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64 nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(block.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+        return false;
+
+    candidate.prevout = prevout;
+    candidate.nValueIn = txPrev.vout[nOut].nValue;
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nTimeBlockFrom = block.GetBlockTime();
+
+    // The start of the kernel hash exactly as CheckStakeKernelHash serializes it
+    unsigned int nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << candidate.nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << nOut;
+    assert(ss.size() == sizeof(candidate.pchPrefix));
+    memcpy(candidate.pchPrefix, &ss[0], sizeof(candidate.pchPrefix));
+
+    {
+        LOCK(cs_stakeModifierCache);
+        if (mapStakeKernelCandidates.size() >= MAX_STAKE_KERNEL_CANDIDATES)
+        {
+            map<COutPoint, CStakeKernelCandidate>::iterator it = mapStakeKernelCandidates.lower_bound(COutPoint(GetRandHash(), 0));
+            if (it == mapStakeKernelCandidates.end())
+                it = mapStakeKernelCandidates.begin();
+            mapStakeKernelCandidates.erase(it);
+        }
+        mapStakeKernelCandidates[prevout] = candidate;
+    }
+    return true;
+}
+
+// Largest hash a kernel of this coin at nTimeTx passes with, the product
+// CheckStakeKernelHash compares against clamped to 256 bits
+static uint256 StakeKernelTarget(const CStakeKernelCandidate& candidate, const CBigNum& bnTargetPerCoinDay, unsigned int nTimeTx)
+{
+    int64 nTimeWeight = min((int64)nTimeTx - candidate.nTimeTxPrev, (int64)nStakeMaxAge) - nStakeMinAge;
+    CBigNum bnTarget = CBigNum(candidate.nValueIn) * nTimeWeight / COIN / (24 * 60 * 60) * bnTargetPerCoinDay;
+    if (bnTarget < 0)
+        return 0;
+    if (bnTarget > CBigNum(~uint256(0)))
+        return ~uint256(0);
+    return bnTarget.getuint256();
+}
+
+bool FindStakeKernel(const vector<CStakeKernelCandidate>& vCandidates, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     size_t& nCandidateRet, unsigned int& nTimeTxRet)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    for (size_t nCandidate = 0; nCandidate < vCandidates.size() && !fShutdown; nCandidate++)
+    {
+        const CStakeKernelCandidate& candidate = vCandidates[nCandidate];
+
+        // Coin day weight only grows with the timestamp, so the target at the
+        // latest one bounds every other and most hashes fail against it alone
+        uint256 hashTargetMax = StakeKernelTarget(candidate, bnTargetPerCoinDay, nTimeTx);
+        if (hashTargetMax == 0)
+            continue;
+
+        // Timestamps go into four lanes at a time, newest first
+        unsigned char pchMsg[4][sizeof(candidate.pchPrefix) + 4];
+        const unsigned char* pmsg[4];
+        unsigned int nTimes[4];
+        for (int l = 0; l < 4; l++)
+        {
+            memcpy(pchMsg[l], candidate.pchPrefix, sizeof(candidate.pchPrefix));
+            pmsg[l] = pchMsg[l];
+        }
+        for (unsigned int n = 0; n < nSearchInterval; n += 4)
+        {
+            int nLanes = 0;
+            for (unsigned int i = n; i < nSearchInterval && i < n + 4; i++)
+            {
+                unsigned int nTime = nTimeTx - i;
+                if (nTime < candidate.nTimeTxPrev || candidate.nTimeBlockFrom + nStakeMinAge > nTime)
+                    break; // older timestamps fail the same way
+                nTimes[nLanes] = nTime;
+                memcpy(pchMsg[nLanes] + sizeof(candidate.pchPrefix), &nTime, 4);
+                nLanes++;
+            }
+            if (nLanes == 0)
+                break;
+            for (int l = nLanes; l < 4; l++)
+                memcpy(pchMsg[l], pchMsg[0], sizeof(pchMsg[0]));
+
+            uint256 hashProofOfStake[4];
+            Hash4Way(pmsg, sizeof(pchMsg[0]), hashProofOfStake);
+            for (int l = 0; l < nLanes; l++)
+            {
+                if (hashProofOfStake[l] > hashTargetMax)
+                    continue;
+                if (hashProofOfStake[l] > StakeKernelTarget(candidate, bnTargetPerCoinDay, nTimes[l]))
+                    continue;
+                nCandidateRet = nCandidate;
+                nTimeTxRet = nTimes[l];
+                return true;
+            }
+            if (nLanes < 4)
+                break;
+        }
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
 int CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake)
 {
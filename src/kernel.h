@@ -17,10 +17,35 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Drop cached kernel stake modifiers that came from blocks above nForkHeight,
+// and every cached kernel candidate
+void StakeModifierCacheReorganize(int nForkHeight);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+// Everything the kernel hash of one coin depends on except the timestamp
+class CStakeKernelCandidate
+{
+public:
+    COutPoint prevout;
+    int64 nValueIn;
+    unsigned int nTimeTxPrev;
+    unsigned int nTimeBlockFrom;
+    // nStakeModifier, nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev and prevout.n as hashed
+    unsigned char pchPrefix[24];
+};
+
+// Fill candidate for output nOut of txPrev, from cache when possible
+bool GetStakeKernelCandidate(CTxDB& txdb, const CTransaction& txPrev, unsigned int nOut, CStakeKernelCandidate& candidate);
+
+// Search timestamps nTimeTx down to nTimeTx - nSearchInterval + 1 for the first
+// candidate with a kernel meeting the nBits target, in the order of
+// vCandidates and newest timestamp first. Needs no locks
+bool FindStakeKernel(const std::vector<CStakeKernelCandidate>& vCandidates, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval,
+                     size_t& nCandidateRet, unsigned int& nTimeTxRet);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 int CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake);
@@ -8,6 +8,9 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "secp256k1.h"
+
+bool fNativeSign = false;
 
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
@@ -285,6 +288,22 @@ CPubKey CKey::GetPubKey() const
 
 bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 {
+    if (fNativeSign)
+    {
+        bool fCompressed;
+        CSecret vchSecret = GetSecret(fCompressed);
+        size_t nSigLen = 0;
+        vchSig.resize(72);
+        // Checked before it leaves, a signature that does not verify would be
+        // a bug or a hardware fault; OpenSSL signs instead
+        if (Secp256k1Sign((unsigned char*)&hash, &vchSecret[0], &vchSig[0], &nSigLen))
+        {
+            vchSig.resize(nSigLen);
+            if (Verify(hash, vchSig))
+                return true;
+        }
+    }
+
     unsigned int nSize = ECDSA_size(pkey);
     vchSig.resize(nSize); // Make sure it is big enough
     if (!ECDSA_sign(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], &nSize, pkey))
@@ -372,6 +391,14 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
+    if (fSet && !vchSig.empty())
+    {
+        CPubKey pubkey = GetPubKey();
+        int nRet = Secp256k1Verify((unsigned char*)&hash, &vchSig[0], vchSig.size(), &pubkey.vchPubKey[0], pubkey.vchPubKey.size());
+        if (nRet != SECP256K1_UNSUPPORTED)
+            return nRet == SECP256K1_VALID;
+    }
+
     // -1 = error, 0 = bad sig, 1 = good
     if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
         return false;
@@ -379,6 +406,37 @@ bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CPubKey::Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const
+{
+    if (vchSig.empty())
+        return false;
+    return Verify(hash, &vchSig[0], vchSig.size());
+}
+
+bool CPubKey::Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen) const
+{
+    if (vchPubKey.empty())
+        return false;
+    return Verify(hash, pchSig, nSigLen, &vchPubKey[0], vchPubKey.size());
+}
+
+bool CPubKey::Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen,
+                     const unsigned char* pchPubKey, size_t nPubKeyLen)
+{
+    if (nPubKeyLen == 0 || nSigLen == 0)
+        return false;
+
+    int nRet = Secp256k1Verify((const unsigned char*)&hash, pchSig, nSigLen, pchPubKey, nPubKeyLen);
+    if (nRet != SECP256K1_UNSUPPORTED)
+        return nRet == SECP256K1_VALID;
+
+    // Encodings the native verifier leaves alone get OpenSSL's answer
+    CKey key;
+    if (!key.SetPubKey(CPubKey(std::vector<unsigned char>(pchPubKey, pchPubKey + nPubKeyLen))))
+        return false;
+    return key.Verify(hash, std::vector<unsigned char>(pchSig, pchSig + nSigLen));
+}
+
 bool CKey::VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
     CKey key;
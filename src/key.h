@@ -96,6 +96,13 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Verify a DER signature without going through an OpenSSL key
+    bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
+    bool Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen) const;
+    // Same for the key bytes where they are, the script interpreter's stack
+    static bool Verify(const uint256& hash, const unsigned char* pchSig, size_t nSigLen,
+                       const unsigned char* pchPubKey, size_t nPubKeyLen);
 };
 
 
@@ -105,6 +112,9 @@ typedef std::vector<unsigned char, secure_allocator<unsigned char> > CPrivKey;
 // CSecret is a serialization of just the secret parameter (32 bytes)
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CSecret;
 
+// Sign with the native constant time signer instead of OpenSSL (-nativesign)
+extern bool fNativeSign;
+
 /** An encapsulated OpenSSL Elliptic Curve key (public and/or private) */
 class CKey
 {
@@ -15,6 +15,13 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
+#include <boost/atomic.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using namespace std;
 using namespace boost;
@@ -46,8 +53,8 @@ int nCoinbaseMaturity = 5;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 int64 nBestHeightTime = 0;   // WM - Keep track of timestamp of block at best height.
-CBigNum bnBestChainTrust = 0;
-CBigNum bnBestInvalidTrust = 0;
+uint256 nBestChainTrust = 0;
+uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
@@ -69,9 +76,6 @@ CScript COINBASE_FLAGS;
 
 const string strMessageMagic = "Pennies Signed Message:\n";
 
-double dHashesPerSec;
-int64 nHPSTimerStart;
-
 // Settings
 int64 nTransactionFee = MIN_TX_FEE;
 
@@ -182,6 +186,13 @@ void static SetBestChain(const CBlockLocator& loc)
         pwallet->SetBestChain(loc);
 }
 
+// notify wallets that the best chain was reorganized onto another branch
+void static BlockChainReorganized()
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->BlockChainReorganized();
+}
+
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
@@ -303,7 +314,7 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txinde
     SetNull();
     if (!txdb.ReadTxIndex(prevout.hash, txindexRet))
         return false;
-    if (!ReadFromDisk(txindexRet.pos))
+    if (!txdb.ReadDiskTx(prevout.hash, txindexRet.pos, *this))
         return false;
     if (prevout.n >= vout.size())
     {
@@ -932,22 +943,130 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Entries handed out so far fill slabs of this many bytes; a slab is never
+// returned, the block index only grows
+static const size_t BLOCKINDEX_ARENA_SLAB = 4096 * sizeof(CBlockIndex);
+static CCriticalSection cs_blockIndexArena;
+static char* pBlockIndexArena = NULL;
+static size_t nBlockIndexArenaLeft = 0;
+
+void* CBlockIndex::operator new(size_t nSize)
+{
+    // CDiskBlockIndex inherits this, keep every entry 16 byte aligned
+    nSize = (nSize + 15) & ~(size_t)15;
+
+    LOCK(cs_blockIndexArena);
+    if (nSize > nBlockIndexArenaLeft)
+    {
+        size_t nSlab = max(nSize, BLOCKINDEX_ARENA_SLAB);
+        pBlockIndexArena = (char*)malloc(nSlab);
+        if (!pBlockIndexArena)
+        {
+            nBlockIndexArenaLeft = 0;
+            throw std::bad_alloc();
+        }
+        nBlockIndexArenaLeft = nSlab;
+    }
+    void* p = pBlockIndexArena;
+    pBlockIndexArena += nSize;
+    nBlockIndexArenaLeft -= nSize;
+    return p;
+}
+
+// pennies: the best chain by height, and the blocks in it that generated a
+// stake modifier, both kept in step with pnext by UpdateBestChainIndex()
+class CStakeModifierBlock
+{
+public:
+    CBlockIndex* pindex;
+    int nHeight;
+    int64 nTimeMax; // latest block time of this and every earlier entry
+};
+
+struct CStakeModifierBlockHeightCompare
+{
+    bool operator()(int nHeight, const CStakeModifierBlock& entry) const
+    {
+        return nHeight < entry.nHeight;
+    }
+};
+
+struct CStakeModifierBlockTimeCompare
+{
+    bool operator()(const CStakeModifierBlock& entry, int64 nTime) const
+    {
+        return entry.nTimeMax < nTime;
+    }
+};
+
+static vector<CBlockIndex*> vBestChain;
+static vector<CStakeModifierBlock> vStakeModifierBlocks;
+
+void UpdateBestChainIndex(CBlockIndex* pindexNew)
+{
+    // Walk back to the fork with the chain indexed so far
+    vector<CBlockIndex*> vConnect;
+    CBlockIndex* pindex = pindexNew;
+    while (pindex && !(pindex->nHeight < (int)vBestChain.size() && vBestChain[pindex->nHeight] == pindex))
+    {
+        vConnect.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+    int nForkHeight = pindex ? pindex->nHeight : -1;
+
+    if (nForkHeight + 1 < (int)vBestChain.size())
+    {
+        StakeModifierCacheReorganize(nForkHeight);
+        BlockChainReorganized();
+    }
+    vBestChain.resize(nForkHeight + 1);
+    while (!vStakeModifierBlocks.empty() && vStakeModifierBlocks.back().nHeight > nForkHeight)
+        vStakeModifierBlocks.pop_back();
+
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindexConnect, vConnect)
+    {
+        vBestChain.push_back(pindexConnect);
+        if (pindexConnect->GeneratedStakeModifier())
+        {
+            CStakeModifierBlock entry;
+            entry.pindex = pindexConnect;
+            entry.nHeight = pindexConnect->nHeight;
+            entry.nTimeMax = pindexConnect->GetBlockTime();
+            if (!vStakeModifierBlocks.empty())
+                entry.nTimeMax = max(entry.nTimeMax, vStakeModifierBlocks.back().nTimeMax);
+            vStakeModifierBlocks.push_back(entry);
+        }
+    }
+}
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBestChain.size())
+        return NULL;
+    return vBestChain[nHeight];
+}
+
+const CBlockIndex* FindStakeModifierBlock(const CBlockIndex* pindexFrom, int64 nTime)
+{
+    const vector<CStakeModifierBlock>& vBlocks = vStakeModifierBlocks;
+    vector<CStakeModifierBlock>::const_iterator it = upper_bound(vBlocks.begin(), vBlocks.end(), pindexFrom->nHeight, CStakeModifierBlockHeightCompare());
+    if (it == vBlocks.end())
+        return NULL;
+
+    // The running maximum only finds the first block at or after nTime if no
+    // block below pindexFrom already got there, otherwise go one by one
+    if (it != vBlocks.begin() && (it - 1)->nTimeMax >= nTime)
+    {
+        for (; it != vBlocks.end(); ++it)
+            if (it->pindex->GetBlockTime() >= nTime)
+                return it->pindex;
+        return NULL;
+    }
+
+    it = lower_bound(it, vBlocks.end(), nTime, CStakeModifierBlockTimeCompare());
+    if (it == vBlocks.end())
+        return NULL;
+    return it->pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1162,19 +1281,19 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainTrust > bnBestInvalidTrust)
+    if (pindexNew->nChainTrust > nBestInvalidTrust)
     {
-        bnBestInvalidTrust = pindexNew->bnChainTrust;
-        CTxDB().WriteBestInvalidTrust(bnBestInvalidTrust);
+        nBestInvalidTrust = pindexNew->nChainTrust;
+        CTxDB().WriteBestInvalidTrust(CBigNum(nBestInvalidTrust));
         uiInterface.NotifyBlocksChanged();
     }
 
     printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s  date=%s\n",
       pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
+      CBigNum(pindexNew->nChainTrust).ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
       pindexNew->GetBlockTime()).c_str());
     printf("InvalidChainFound:  current best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 }
 
@@ -1279,8 +1398,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            // Get prev tx from disk, or the txdb cache
+            if (!txdb.ReadDiskTx(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
@@ -1348,7 +1467,8 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1387,6 +1507,9 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        // pennies: the inputs of a transaction share the serialized parts of
+        // their signature hashes
+        boost::shared_ptr<const CSignatureHasher> phasher;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1406,11 +1529,21 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                // pennies: signatures seen in the memory pool are still cached
+                // when the block comes, those of a block are not needed again
+                if (!phasher && vin.size() > 1)
+                    phasher.reset(new CSignatureHasher(*this));
+                CScriptCheck check(txPrev, *this, i, fStrictPayToScriptHash, 0, !fBlock, phasher);
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (check.FailsOnlyP2SH())
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1547,6 +1680,196 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+//
+// pennies: the input scripts of the block being connected are verified on
+// -par threads next to the thread connecting it
+//
+
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+// Most checks a thread takes from the queue at once
+static const unsigned int MAX_SCRIPTCHECK_BATCH = 128;
+
+static boost::mutex mutexScriptCheckControl;
+static boost::mutex mutexScriptCheck;
+static boost::condition_variable condScriptCheckWorker;
+static boost::condition_variable condScriptCheckMaster;
+static vector<CScriptCheck> vScriptCheckQueue;
+static unsigned int nScriptCheckTodo = 0; // queued or being run
+static bool fScriptCheckAllOk = true;
+static bool fScriptCheckDoS = false; // a failed check is not P2SH-only
+static int nScriptCheckThreads = 0;
+
+bool CScriptCheck::operator()() const
+{
+    if (!VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, fStrictPayToScriptHash, nHashType, fCacheStore, phasher.get()))
+        return error("CScriptCheck() : %s input %u VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+    return true;
+}
+
+bool CScriptCheck::FailsOnlyP2SH() const
+{
+    return fStrictPayToScriptHash && VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, false, nHashType, false, phasher.get());
+}
+
+// Run queued checks. Workers only return on shutdown, the master returns once
+// everything queued has been run, with whether it all passed and in pfDoS
+// whether a failure deserves a DoS score.
+static bool ScriptCheckLoop(bool fMaster, bool* pfDoS = NULL)
+{
+    vector<CScriptCheck> vChecks;
+    vChecks.reserve(MAX_SCRIPTCHECK_BATCH);
+    unsigned int nNow = 0;
+    bool fOk = true;
+    bool fDoS = false;
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutexScriptCheck);
+            if (nNow)
+            {
+                fScriptCheckAllOk &= fOk;
+                fScriptCheckDoS |= fDoS;
+                nScriptCheckTodo -= nNow;
+                if (nScriptCheckTodo == 0 && !fMaster)
+                    condScriptCheckMaster.notify_one();
+            }
+            while (vScriptCheckQueue.empty())
+            {
+                if (fMaster && nScriptCheckTodo == 0)
+                {
+                    bool fRet = fScriptCheckAllOk;
+                    if (pfDoS)
+                        *pfDoS = fScriptCheckDoS;
+                    fScriptCheckAllOk = true;
+                    fScriptCheckDoS = false;
+                    return fRet;
+                }
+                if (!fMaster && fShutdown)
+                    return true;
+                if (fMaster)
+                    condScriptCheckMaster.wait(lock);
+                else
+                {
+                    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+                    condScriptCheckWorker.timed_wait(lock, boost::posix_time::seconds(1));
+                    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+                }
+            }
+            // Share what is left between all threads so they finish together
+            nNow = max(1u, min(MAX_SCRIPTCHECK_BATCH, (unsigned int)vScriptCheckQueue.size() / (nScriptCheckThreads + 1)));
+            vChecks.resize(nNow);
+            for (unsigned int i = 0; i < nNow; i++)
+            {
+                vChecks[i].swap(vScriptCheckQueue.back());
+                vScriptCheckQueue.pop_back();
+            }
+            fOk = fScriptCheckAllOk;
+            fDoS = false;
+        }
+        // Once a check has failed the block is invalid, skip the rest
+        for (unsigned int i = 0; i < nNow && fOk; i++)
+        {
+            fOk = vChecks[i]();
+            // As in ConnectInputs, failing only strict P2SH is not punished
+            if (!fOk)
+                fDoS = !vChecks[i].FailsOnlyP2SH();
+        }
+    }
+}
+
+/** Script checks of one block. Wait() helps the threads run them. */
+class CScriptCheckControl
+{
+private:
+    boost::mutex::scoped_lock lock;
+    bool fDone;
+
+public:
+    CScriptCheckControl() : lock(mutexScriptCheckControl), fDone(false) {}
+
+    ~CScriptCheckControl()
+    {
+        // Returning early, drop what is still queued
+        if (!fDone)
+        {
+            {
+                boost::mutex::scoped_lock lock(mutexScriptCheck);
+                fScriptCheckAllOk = false;
+            }
+            Wait();
+        }
+    }
+
+    void Add(vector<CScriptCheck>& vChecks)
+    {
+        if (vChecks.empty())
+            return;
+        {
+            boost::mutex::scoped_lock lock(mutexScriptCheck);
+            BOOST_FOREACH(CScriptCheck& check, vChecks)
+            {
+                vScriptCheckQueue.push_back(CScriptCheck());
+                check.swap(vScriptCheckQueue.back());
+            }
+            nScriptCheckTodo += vChecks.size();
+        }
+        if (vChecks.size() == 1)
+            condScriptCheckWorker.notify_one();
+        else
+            condScriptCheckWorker.notify_all();
+        vChecks.clear();
+    }
+
+    bool HasFailed(bool& fDoS)
+    {
+        boost::mutex::scoped_lock lock(mutexScriptCheck);
+        fDoS = fScriptCheckDoS;
+        return !fScriptCheckAllOk;
+    }
+
+    bool Wait(bool* pfDoS = NULL)
+    {
+        fDone = true;
+        return ScriptCheckLoop(true, pfDoS);
+    }
+};
+
+static void ThreadScriptCheck(void* parg)
+{
+    // Make this thread recognisable as a script verification thread
+    RenameThread("pennies-scriptch");
+
+    try
+    {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+        ScriptCheckLoop(false);
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(&e, "ThreadScriptCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(NULL, "ThreadScriptCheck()");
+    }
+    printf("ThreadScriptCheck exited\n");
+}
+
+void StartScriptCheckThreads(int nThreads)
+{
+    nThreads = min(nThreads, MAX_SCRIPTCHECK_THREADS);
+    for (int i = 0; i < nThreads; i++)
+    {
+        if (!NewThread(ThreadScriptCheck, NULL))
+        {
+            printf("Error: NewThread(ThreadScriptCheck) failed\n");
+            break;
+        }
+        nScriptCheckThreads++;
+    }
+    printf("Verifying block scripts on %d additional threads\n", nScriptCheckThreads);
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in
@@ -1577,6 +1900,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Without script check threads the checks run in ConnectInputs as before
+    CScriptCheckControl control;
+    vector<CScriptCheck> vChecks;
+    vector<CScriptCheck>* pvChecks = nScriptCheckThreads ? &vChecks : NULL;
+    bool fScriptDoS = false;
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64 nFees = 0;
     int64 nValueIn = 0;
@@ -1629,13 +1958,21 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash, pvChecks))
                 return false;
+            control.Add(vChecks);
+            if (pvChecks && control.HasFailed(fScriptDoS))
+                return fScriptDoS ? DoS(100, error("ConnectBlock() : script verification failed"))
+                                  : error("ConnectBlock() : P2SH script verification failed");
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    if (!control.Wait(&fScriptDoS))
+        return fScriptDoS ? DoS(100, error("ConnectBlock() : script verification failed"))
+                          : error("ConnectBlock() : P2SH script verification failed");
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1657,6 +1994,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // pennies: outputs are mostly spent soon after they are created, keep
+    // the new transactions around for the blocks that follow
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        txdb.CacheTx(tx);
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1825,7 +2167,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainTrust > pindexBest->bnChainTrust)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainTrust > pindexBest->nChainTrust)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -1872,14 +2214,14 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    UpdateBestChainIndex(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestHeightTime = pindexBest->GetBlockTime();   // WM - Record timestamp of new best block.
-    bnBestChainTrust = pindexNew->bnChainTrust;
+    nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
     printf("SetBestChain: new best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
     // Check the version of the last 100 blocks to see if we need to upgrade:
@@ -1999,7 +2341,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     }
 
     // ppcoin: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : uint256(0)) + pindexNew->GetBlockTrust();
 
     // ppcoin: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit(pindexNew->nHeight)))
@@ -2038,7 +2380,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->bnChainTrust > bnBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2068,14 +2410,15 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
 
+    // Check timestamp, before the proof of work: a header from too far
+    // ahead is at an Nfactor that isn't hashed yet (scrypt_nfactor_max)
+    if (GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
+        return error("CheckBlock() : block timestamp too far in the future");
+
     // Check proof of work matches claimed amount
     if (fCheckPOW && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
         return DoS(50, error("CheckBlock() : proof of work failed"));
 
-    // Check timestamp
-    if (GetBlockTime() > GetAdjustedTime() + nMaxClockDrift)
-        return error("CheckBlock() : block timestamp too far in the future");
-
     // First transaction must be coinbase, the rest must not be
     if (vtx.empty() || !vtx[0].IsCoinBase())
         return DoS(100, error("CheckBlock() : first tx is not coinbase"));
@@ -2701,6 +3044,69 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// pennies: block files stay mapped read-only once touched, so transaction
+// and block reads cost no open/seek/close. Readers keep a reference to the
+// view they deserialize from, a view replaced after the file grew is only
+// unmapped when the last of them lets go.
+static CCriticalSection cs_blockFileViews;
+static map<unsigned int, boost::shared_ptr<CBlockFileView> > mapBlockFileViews;
+static map<unsigned int, unsigned int> mapBlockFileWritten;
+
+CBlockFileView::~CBlockFileView()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+static boost::shared_ptr<CBlockFileView> MapBlockFile(unsigned int nFile)
+{
+    boost::shared_ptr<CBlockFileView> view;
+#ifndef WIN32
+    // Whole files of up to 2GB each need a 64-bit address space
+    if (sizeof(void*) < 8)
+        return view;
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return view;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+            view.reset(new CBlockFileView((const char*)p, st.st_size));
+        else
+            printf("MapBlockFile() : mmap of blk%04u.dat failed, errno %d\n", nFile, errno);
+    }
+    close(fd);
+#endif
+    return view;
+}
+
+boost::shared_ptr<CBlockFileView> GetBlockFileView(unsigned int nFile, unsigned int nPos)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return boost::shared_ptr<CBlockFileView>();
+
+    LOCK(cs_blockFileViews);
+    boost::shared_ptr<CBlockFileView>& view = mapBlockFileViews[nFile];
+    // Remap when nPos is past the view, or a block written since could run
+    // past its end
+    if (!view || nPos >= view->nSize ||
+        (nPos + MAX_BLOCK_SIZE + 256 > view->nSize && mapBlockFileWritten[nFile] > view->nSize))
+        view = MapBlockFile(nFile);
+    if (view && nPos >= view->nSize)
+        return boost::shared_ptr<CBlockFileView>();
+    return view;
+}
+
+void BlockFileWritten(unsigned int nFile, unsigned int nEnd)
+{
+    LOCK(cs_blockFileViews);
+    unsigned int& nWritten = mapBlockFileWritten[nFile];
+    nWritten = max(nWritten, nEnd);
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -3789,6 +4195,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 				*pLightWalletBlock = cLightWalletBlock;
 				mapBlockHeaders.insert(std::pair<int, CLightWalletBlock*>(nTempHeight,
 											pLightWalletBlock));
+				// pennies: hash it while the block itself is downloaded
+				scrypt_prehash((const block_header*)&pLightWalletBlock->nVersion, GetNfactor(pLightWalletBlock->nTime));
 				nTempHeight++;
 			}
 			else
@@ -4153,11 +4561,49 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// pennies: queue the headers of complete "block" messages waiting in vRecv
+// for the prehash workers, so their hashes are ready by the time each block
+// reaches ProcessBlock. nScanned skips the messages seen on earlier calls and
+// is left at the first message that is not complete yet.
+static void PrehashBlockMessages(CDataStream& vRecv, unsigned int& nScanned)
+{
+    int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
+    // A message start cut off at the end may still be completed
+    unsigned int nTail = min((unsigned int)vRecv.size(), (unsigned int)sizeof(pchMessageStart) - 1);
+    CDataStream::iterator pstart = vRecv.begin() + min(nScanned, (unsigned int)vRecv.size());
+    loop
+    {
+        pstart = search(pstart, vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
+        if (pstart == vRecv.end())
+        {
+            nScanned = vRecv.size() - nTail;
+            break;
+        }
+        nScanned = pstart - vRecv.begin();
+        if (vRecv.end() - pstart < nHeaderSize)
+            break;
+        CMessageHeader hdr;
+        CDataStream(pstart, pstart + nHeaderSize, vRecv.nType, vRecv.nVersion) >> hdr;
+        if (!hdr.IsValid() || hdr.nMessageSize > MAX_SIZE || vRecv.end() - pstart - nHeaderSize < (int64)hdr.nMessageSize)
+            break;
+        pstart += nHeaderSize;
+        if (hdr.GetCommand() == "block" && hdr.nMessageSize >= sizeof(block_header))
+        {
+            block_header header;
+            memcpy(&header, &pstart[0], sizeof(header));
+            scrypt_prehash(&header, GetNfactor(header.timestamp));
+        }
+        pstart += hdr.nMessageSize;
+    }
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     CDataStream& vRecv = pfrom->vRecv;
     if (vRecv.empty())
         return true;
+    unsigned int nRecvSize = vRecv.size();
+    PrehashBlockMessages(vRecv, pfrom->nRecvPrehashed);
     //if (fDebug)
     //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
 
@@ -4270,6 +4716,10 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
+    // Whatever was taken off the front had been scanned already
+    unsigned int nConsumed = nRecvSize - vRecv.size();
+    pfrom->nRecvPrehashed = pfrom->nRecvPrehashed > nConsumed ? pfrom->nRecvPrehashed - nConsumed : 0;
+
     vRecv.Compact();
     return true;
 }
@@ -4840,6 +5290,15 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
 }
 
 
+static void SetExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -4850,11 +5309,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
-
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
 }
 
 
@@ -4947,9 +5402,267 @@ static bool fGenerateBitcoins = false;
 static bool fLimitProcessors = false;
 static int nLimitProcessors = -1;
 
-void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
+bool fMinerAffinity = false;
+static CCriticalSection cs_mapMinerCpus;
+static std::map<int, int> mapMinerCpus; // pinned cpu -> numa node
+
+// Pin the calling miner thread to the lowest free cpu the process is allowed
+// on, -1 if none takes it. Its scratchpad is first touched after this, so the
+// kernel's first-touch policy places it on the thread's local numa node.
+static int PinMinerThread()
+{
+    std::vector<int> vCpus = GetAllowedCpus();
+    LOCK(cs_mapMinerCpus);
+    BOOST_FOREACH(int nCpu, vCpus)
+    {
+        if (mapMinerCpus.count(nCpu))
+            continue;
+        if (!SetThreadAffinity(nCpu))
+        {
+            printf("PinMinerThread() : cpu %d refused, trying the next one\n", nCpu);
+            continue;
+        }
+        mapMinerCpus[nCpu] = GetCpuNumaNode(nCpu);
+        return nCpu;
+    }
+    return -1;
+}
+
+static void UnpinMinerThread(int nCpu)
 {
-    void *scratchbuf = scrypt_buffer_alloc();
+    LOCK(cs_mapMinerCpus);
+    mapMinerCpus.erase(nCpu);
+}
+
+std::map<int, int> GetMinerCpus()
+{
+    LOCK(cs_mapMinerCpus);
+    return mapMinerCpus;
+}
+
+// pennies: proof-of-work miner threads share one block template. The first
+// thread to find it stale rebuilds it; every thread then hashes its own copy
+// under an extra nonce no other thread holds, so the nonce ranges never overlap.
+static CCriticalSection cs_minerTemplate;
+static auto_ptr<CBlock> pblockMinerTemplate;
+static CBlockIndex* pindexMinerTemplate = NULL;
+static unsigned int nMinerTemplateTransactionsUpdated = 0;
+static int64 nMinerTemplateStart = 0;
+static unsigned int nMinerTemplateId = 0;
+static unsigned int nMinerExtraNonce = 0;
+
+// Nonces hashed between checks for a stale template
+static const unsigned int nMinerNonceSlice = 0x100;
+
+// Caller must hold cs_minerTemplate
+static bool MinerTemplateStale()
+{
+    return !pblockMinerTemplate.get() ||
+           pindexMinerTemplate != pindexBest ||
+           (nTransactionsUpdated != nMinerTemplateTransactionsUpdated && GetTime() - nMinerTemplateStart > 60);
+}
+
+// Copy of the current template with a fresh extra nonce, NULL if no block
+// could be created. nTemplateId identifies the template for MinerWorkStale.
+static CBlock* GetMinerWork(CWallet* pwallet, unsigned int& nTemplateId, CBlockIndex*& pindexPrev)
+{
+    LOCK(cs_minerTemplate);
+    if (MinerTemplateStale())
+    {
+        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
+        CBlockIndex* pindexPrevNew = pindexBest;
+
+        CBlock* pblockNew = CreateNewBlock(pwallet, false);
+        if (!pblockNew)
+            return NULL;
+        if (pindexPrevNew != pindexMinerTemplate)
+            nMinerExtraNonce = 0;
+
+        pblockMinerTemplate.reset(pblockNew);
+        pindexMinerTemplate = pindexPrevNew;
+        nMinerTemplateTransactionsUpdated = nTransactionsUpdatedLast;
+        nMinerTemplateStart = GetTime();
+        nMinerTemplateId++;
+    }
+
+    CBlock* pblock = new CBlock(*pblockMinerTemplate);
+    SetExtraNonce(pblock, pindexMinerTemplate, ++nMinerExtraNonce);
+    nTemplateId = nMinerTemplateId;
+    pindexPrev = pindexMinerTemplate;
+    return pblock;
+}
+
+static bool MinerWorkStale(unsigned int nTemplateId)
+{
+    LOCK(cs_minerTemplate);
+    return nTemplateId != nMinerTemplateId || MinerTemplateStale();
+}
+
+// Force a rebuild of the template the caller was working on
+static void InvalidateMinerWork(unsigned int nTemplateId)
+{
+    LOCK(cs_minerTemplate);
+    if (nTemplateId == nMinerTemplateId)
+        pblockMinerTemplate.reset();
+}
+
+// pennies: hashmeter. Each miner thread owns a slot and only adds to its own
+// counters, so hashing takes no lock; readers sum the slots and compare them
+// with samples taken every nHashMeterSampleMillis. Slots are padded to two
+// cache lines so no two threads' counters ever share one.
+class CMinerCounters
+{
+public:
+    boost::atomic<uint64> nHashes;
+    boost::atomic<int64> nScratchAllocMicros;
+    boost::atomic<int> nCpu;
+    boost::atomic<bool> fActive;
+};
+
+class CMinerSlot : public CMinerCounters
+{
+    char pad[128 - sizeof(CMinerCounters) % 128];
+};
+
+class CHashMeterSample
+{
+public:
+    int64 nTime;
+    std::vector<uint64> vHashes; // per slot
+};
+
+// The last slot is shared by any threads beyond the others
+static const int MAX_MINER_SLOTS = 256;
+static const int64 nHashMeterSampleMillis = 5 * 1000;
+static const int64 nHashMeterHistoryMillis = 15 * 60 * 1000;
+
+static CMinerSlot vMinerSlots[MAX_MINER_SLOTS];
+static boost::atomic<int> nMinerSlotsUsed(0);
+static boost::atomic<int64> nHashMeterNextSample(0);
+static CCriticalSection cs_hashMeter;
+static std::deque<CHashMeterSample> dequeHashMeter;
+
+static int ClaimMinerSlot(int nCpu)
+{
+    LOCK(cs_hashMeter);
+    int nSlot = 0;
+    while (nSlot < MAX_MINER_SLOTS - 1 && vMinerSlots[nSlot].fActive)
+        nSlot++;
+    vMinerSlots[nSlot].nCpu = nCpu;
+    vMinerSlots[nSlot].fActive = true;
+    if (nSlot >= nMinerSlotsUsed)
+        nMinerSlotsUsed = nSlot + 1;
+    return nSlot;
+}
+
+static void ReleaseMinerSlot(int nSlot)
+{
+    LOCK(cs_hashMeter);
+    if (nSlot < MAX_MINER_SLOTS - 1 || vnThreadsRunning[THREAD_MINER] == 0)
+        vMinerSlots[nSlot].fActive = false;
+}
+
+// Caller must hold cs_hashMeter
+static void SampleHashMeter(int64 nNow)
+{
+    CHashMeterSample sample;
+    sample.nTime = nNow;
+    for (int nSlot = 0; nSlot < nMinerSlotsUsed; nSlot++)
+        sample.vHashes.push_back(vMinerSlots[nSlot].nHashes.load(boost::memory_order_relaxed));
+    dequeHashMeter.push_back(sample);
+    while (nNow - dequeHashMeter.front().nTime > nHashMeterHistoryMillis + nHashMeterSampleMillis)
+        dequeHashMeter.pop_front();
+    nHashMeterNextSample = nNow + nHashMeterSampleMillis;
+}
+
+static void MeterHashes(int nSlot, uint64 nHashes, void *scratchbuf)
+{
+    vMinerSlots[nSlot].nHashes.fetch_add(nHashes, boost::memory_order_relaxed);
+
+    int64 nNow = GetTimeMillis();
+    if (nNow < nHashMeterNextSample.load(boost::memory_order_relaxed))
+        return;
+
+    TRY_LOCK(cs_hashMeter, lockMeter);
+    if (!lockMeter || nNow < nHashMeterNextSample)
+        return;
+    SampleHashMeter(nNow);
+
+    static int64 nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        printf("hashmeter %3d CPUs %.0f hash/s, %s pages\n", vnThreadsRunning[THREAD_MINER], GetHashesPerSec(), scrypt_buffer_pages(scratchbuf));
+    }
+}
+
+// Oldest sample no older than nWindow, NULL if there is none. Caller must hold cs_hashMeter
+static const CHashMeterSample* HashMeterSince(int64 nNow, int64 nWindow)
+{
+    BOOST_FOREACH(const CHashMeterSample& sample, dequeHashMeter)
+        if (nNow - sample.nTime <= nWindow)
+            return &sample;
+    return NULL;
+}
+
+static double HashMeterRate(const CHashMeterSample* pfrom, int64 nNow, uint64 nHashesNow, int nSlot = -1)
+{
+    if (!pfrom || nNow <= pfrom->nTime)
+        return 0;
+    uint64 nHashesFrom = 0;
+    for (unsigned int i = 0; i < pfrom->vHashes.size(); i++)
+        if (nSlot < 0 || (int)i == nSlot)
+            nHashesFrom += pfrom->vHashes[i];
+    return 1000.0 * (nHashesNow - nHashesFrom) / (nNow - pfrom->nTime);
+}
+
+void GetMinerStats(CMinerStats& stats)
+{
+    LOCK(cs_hashMeter);
+    int64 nNow = GetTimeMillis();
+    if (nNow >= nHashMeterNextSample)
+        SampleHashMeter(nNow);
+
+    std::vector<uint64> vHashes;
+    stats.nHashes = 0;
+    for (int nSlot = 0; nSlot < nMinerSlotsUsed; nSlot++)
+    {
+        vHashes.push_back(vMinerSlots[nSlot].nHashes.load(boost::memory_order_relaxed));
+        stats.nHashes += vHashes.back();
+    }
+
+    stats.dHashesPerSec10s = HashMeterRate(HashMeterSince(nNow, 10 * 1000), nNow, stats.nHashes);
+    stats.dHashesPerSec1m = HashMeterRate(HashMeterSince(nNow, 60 * 1000), nNow, stats.nHashes);
+    stats.dHashesPerSec15m = HashMeterRate(HashMeterSince(nNow, nHashMeterHistoryMillis), nNow, stats.nHashes);
+
+    // Per-thread rates are over the last minute
+    const CHashMeterSample* pfrom = HashMeterSince(nNow, 60 * 1000);
+    stats.vThreads.clear();
+    for (int nSlot = 0; nSlot < (int)vHashes.size(); nSlot++)
+    {
+        if (!vMinerSlots[nSlot].fActive)
+            continue;
+        CMinerThreadStats thread;
+        thread.nThread = nSlot;
+        thread.nCpu = vMinerSlots[nSlot].nCpu;
+        thread.nHashes = vHashes[nSlot];
+        thread.dHashesPerSec = HashMeterRate(pfrom, nNow, vHashes[nSlot], nSlot);
+        thread.nScratchAllocMicros = vMinerSlots[nSlot].nScratchAllocMicros;
+        stats.vThreads.push_back(thread);
+    }
+}
+
+double GetHashesPerSec()
+{
+    CMinerStats stats;
+    GetMinerStats(stats);
+    return stats.dHashesPerSec1m;
+}
+
+void BitcoinMiner(CWallet *pwallet, bool fProofOfStake, int nMinerSlot)
+{
+    // Per-thread scratchpad, shared with the GetHash() calls made from here
+    void *scratchbuf = scrypt_buffer_thread();
 
     printf("CPUMiner started for proof-of-%s\n", fProofOfStake? "stake" : "work");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -4957,7 +5670,7 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
     // Make this thread recognisable as the mining thread
     RenameThread("bitcoin-miner");
 
-    // Each thread has its own key and counter
+    // Each thread has its own key, extra nonces come from the shared template
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
@@ -4982,19 +5695,18 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         }
         strMintWarning = "";
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
-        if (!pblock.get())
-            return;
-        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
-
         if (fProofOfStake)
         {
+            //
+            // Create new block
+            //
+            CBlockIndex* pindexPrev = pindexBest;
+
+            auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, fProofOfStake));
+            if (!pblock.get())
+                return;
+            IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+
             // ppcoin: if proof-of-stake block found then process block
             if (pblock->IsProofOfStake())
             {
@@ -5013,26 +5725,22 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
             continue;
         }
 
-        printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-
         //
-        // Pre-build hash buffers
+        // Take work from the shared template
         //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+        unsigned int nTemplateId;
+        CBlockIndex* pindexPrev;
 
-        FormatHashBuffers(pblock.get(), pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
+        auto_ptr<CBlock> pblock(GetMinerWork(pwallet, nTemplateId, pindexPrev));
+        if (!pblock.get())
+            return;
 
+        printf("Running BitcoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
+               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
         //
         // Search
         //
-        int64 nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
         unsigned int max_nonce = 0xffff0000;
@@ -5044,9 +5752,12 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
             unsigned int nHashesDone = 0;
             unsigned int nNonceFound;
 
+            vMinerSlots[nMinerSlot].nScratchAllocMicros += scrypt_buffer_reserve(scratchbuf, GetNfactor(pblock->nTime));
+
             nNonceFound = scanhash_scrypt(
                         (block_header *)&pblock->nVersion,
-                        max_nonce,
+                        scratchbuf,
+                        min(pblock->nNonce + nMinerNonceSlice, max_nonce),
                         nHashesDone,
                         UBEGIN(result),
                         &res_header,
@@ -5073,38 +5784,13 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
                     break;
                 }
+                pblock->nNonce = nNonceFound + 1;
             }
+            else
+                pblock->nNonce += nHashesDone;
 
             // Meter hashes/sec
-            static int64 nHashCounter;
-
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-                
-            if (GetTimeMillis() - nHPSTimerStart > 30000)
-            {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 30000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64 nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            printf("hashmeter %3d CPUs %.0f hash/s\n", vnThreadsRunning[THREAD_MINER], dHashesPerSec );
-                        }
-                    }
-                }
-            }
+            MeterHashes(nMinerSlot, nHashesDone, scratchbuf);
 
             // Check for stop or if block needs to be rebuilt
             if (fShutdown)
@@ -5115,34 +5801,42 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 return;
             if (vNodes.empty())
                 break;
-            if (nBlockNonce >= 0xffff0000)
-                break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            if (pblock->nNonce >= max_nonce)
                 break;
-            if (pindexPrev != pindexBest)
+            if (MinerWorkStale(nTemplateId))
                 break;
 
             // Update nTime every few seconds
             pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, pblock->GetMaxTransactionTime());
             pblock->nTime = max(pblock->GetBlockTime(), pindexPrev->GetBlockTime() - nMaxClockDrift);
             pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
 
             if (pblock->GetBlockTime() >= (int64)pblock->vtx[0].nTime + nMaxClockDrift)
+            {
+                InvalidateMinerWork(nTemplateId);
                 break;  // need to update coinbase timestamp
+            }
         }
     }
-
-    scrypt_buffer_free(scratchbuf);
 }
 
 void static ThreadBitcoinMiner(void* parg)
 {
     CWallet* pwallet = (CWallet*)parg;
+    int nCpu = -1;
+    if (fMinerAffinity)
+    {
+        nCpu = PinMinerThread();
+        if (nCpu >= 0)
+            printf("ThreadBitcoinMiner pinned to cpu %d (numa node %d)\n", nCpu, GetCpuNumaNode(nCpu));
+        else
+            printf("ThreadBitcoinMiner could not be pinned, running unpinned\n");
+    }
+    int nMinerSlot = ClaimMinerSlot(nCpu);
     try
     {
         vnThreadsRunning[THREAD_MINER]++;
-        BitcoinMiner(pwallet, false);
+        BitcoinMiner(pwallet, false, nMinerSlot);
         vnThreadsRunning[THREAD_MINER]--;
     }
     catch (std::exception& e) {
@@ -5152,9 +5846,9 @@ void static ThreadBitcoinMiner(void* parg)
         vnThreadsRunning[THREAD_MINER]--;
         PrintException(NULL, "ThreadBitcoinMiner()");
     }
-    nHPSTimerStart = 0;
-    if (vnThreadsRunning[THREAD_MINER] == 0)
-        dHashesPerSec = 0;
+    ReleaseMinerSlot(nMinerSlot);
+    if (nCpu >= 0)
+        UnpinMinerThread(nCpu);
     printf("ThreadBitcoinMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_MINER]);
 }
 
@@ -5166,6 +5860,7 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
     if (nLimitProcessors == 0)
         fGenerateBitcoins = false;
     fLimitProcessors = (nLimitProcessors != -1);
+    fMinerAffinity = GetBoolArg("-mineraffinity");
 
     if (fGenerate)
     {
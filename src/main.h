@@ -21,6 +21,7 @@ class CBloomFilter;
 class CKeyItem;
 class CReserveKey;
 class COutPoint;
+class CMinerStats;
 
 class CAddress;
 class CInv;
@@ -82,8 +83,8 @@ extern unsigned int nStakeMinAge;
 extern int nCoinbaseMaturity;
 extern int nBestHeight;
 extern int64 nBestHeightTime;
-extern CBigNum bnBestChainTrust;
-extern CBigNum bnBestInvalidTrust;
+extern uint256 nBestChainTrust;
+extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
@@ -91,8 +92,7 @@ extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
 extern int64 nLastCoinStakeSearchInterval;
 extern const std::string strMessageMagic;
-extern double dHashesPerSec;
-extern int64 nHPSTimerStart;
+extern bool fMinerAffinity;
 extern int64 nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
@@ -109,6 +109,7 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
@@ -117,13 +118,39 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** Read-only mapping of a whole blkNNNN.dat file */
+class CBlockFileView
+{
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CBlockFileView(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CBlockFileView();
+};
+/** Mapping of block file nFile covering nPos, empty when the file can't be mapped */
+boost::shared_ptr<CBlockFileView> GetBlockFileView(unsigned int nFile, unsigned int nPos);
+/** Record that block file nFile has been written up to nEnd */
+void BlockFileWritten(unsigned int nFile, unsigned int nEnd);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+/** Move the height index of the best chain to end at pindexNew */
+void UpdateBestChainIndex(CBlockIndex* pindexNew);
+/** Block of the best chain at nHeight, NULL past the best block */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** First block of the best chain above pindexFrom that generated a stake modifier with a time at or after nTime, NULL if there is none yet */
+const CBlockIndex* FindStakeModifierBlock(const CBlockIndex* pindexFrom, int64 nTime);
+/** Start the threads that verify block scripts alongside the thread connecting the block */
+void StartScriptCheckThreads(int nThreads);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
+/** Cpus the proof-of-work miner threads are pinned to, mapped to their numa node */
+std::map<int, int> GetMinerCpus();
+void GetMinerStats(CMinerStats& stats);
+/** Proof-of-work hash rate of all miner threads over the last minute */
+double GetHashesPerSec();
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
@@ -138,7 +165,7 @@ std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
-void BitcoinMiner(CWallet *pwallet, bool fProofOfStake);
+void BitcoinMiner(CWallet *pwallet, bool fProofOfStake, int nMinerSlot = 0);
 void ResendWalletTransactions();
 
 // pennies: calculate Nfactor using timestamp
@@ -518,6 +545,15 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+protected:
+    // pennies: hash and serialized size, set once when the transaction is read
+    // (nSizeCached == 0 if not set). Code that changes a transaction it read
+    // must call InvalidateHash() first; with -debug GetHash() asserts that the
+    // cached hash is still the transaction's.
+    uint256 hashCached;
+    unsigned int nSizeCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -525,12 +561,19 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
-        READWRITE(this->nVersion);
-        nVersion = this->nVersion;
-        READWRITE(nTime);
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
+        if (fGetSize && nSizeCached)
+            nSerSize = nSizeCached;
+        else
+        {
+            READWRITE(this->nVersion);
+            nVersion = this->nVersion;
+            READWRITE(nTime);
+            READWRITE(vin);
+            READWRITE(vout);
+            READWRITE(nLockTime);
+        }
+        if (fRead)
+            const_cast<CTransaction*>(this)->UpdateHash();
     )
 
     void SetNull()
@@ -541,6 +584,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        InvalidateHash();
     }
 
     bool IsNull() const
@@ -550,9 +594,31 @@ public:
 
     uint256 GetHash() const
     {
+        if (nSizeCached)
+        {
+            assert(!fDebug || hashCached == SerializeHash(*this));
+            return hashCached;
+        }
         return SerializeHash(*this);
     }
 
+    // Serialize once to fill in the hash and size. Only safe before the
+    // transaction is shared with other threads.
+    void UpdateHash()
+    {
+        InvalidateHash();
+        CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << *this;
+        hashCached = Hash(ss.begin(), ss.end());
+        nSizeCached = ss.size();
+    }
+
+    void InvalidateHash()
+    {
+        hashCached = 0;
+        nSizeCached = 0;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -672,6 +738,19 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        // pennies: deserialize straight from the mapped block file
+        boost::shared_ptr<CBlockFileView> view;
+        if (!pfileRet && (view = GetBlockFileView(pos.nFile, pos.nTxPos)))
+        {
+            try {
+                CBufferReader(view->pbegin + pos.nTxPos, view->pbegin + view->nSize, SER_DISK, CLIENT_VERSION) >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -770,11 +849,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pvChecks	if set, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       std::vector<CScriptCheck>* pvChecks=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -784,6 +865,44 @@ protected:
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
 };
 
+/** Verification of one input script, queued by ConnectBlock to run on the
+ * script check threads. The spending transaction must outlive it.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    bool fStrictPayToScriptHash;
+    int nHashType;
+    bool fCacheStore;
+    // Shared by the checks of all inputs of ptxTo
+    boost::shared_ptr<const CSignatureHasher> phasher;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fStrictPayToScriptHash(false), nHashType(0), fCacheStore(false) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fStrictPayToScriptHashIn, int nHashTypeIn, bool fCacheStoreIn,
+                 const boost::shared_ptr<const CSignatureHasher>& phasherIn = boost::shared_ptr<const CSignatureHasher>()) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), nHashType(nHashTypeIn), fCacheStore(fCacheStoreIn), phasher(phasherIn) {}
+
+    bool operator()() const;
+    // Whether a failed check passes without strict P2SH, which is not punished
+    bool FailsOnlyP2SH() const;
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+        std::swap(fCacheStore, check.fCacheStore);
+        phasher.swap(check.phasher);
+    }
+};
+
 
 
 
@@ -1116,14 +1235,21 @@ public:
 
     uint256 GetHash() const
     {
-        //void * scratchbuff = scrypt_buffer_alloc();
+        // pennies: scrypt_hash reuses the calling thread's scratchpad, and
+        // headers queued by scrypt_prehash are usually hashed already
         if(uhash == uint256(0))
 		{
-       	 	scrypt_hash(CVOIDBEGIN(nVersion), sizeof(block_header), UINTBEGIN(uhash), GetNfactor(nTime));
+            uint256 hash;
+            if (!scrypt_prehash_lookup((const block_header*)&nVersion, GetNfactor(nTime), UINTBEGIN(hash)) &&
+                !scrypt_hash(CVOIDBEGIN(nVersion), sizeof(block_header), UINTBEGIN(hash), GetNfactor(nTime)))
+            {
+                // Timestamped too far ahead to be hashed yet: nothing is
+                // cached, so it hashes for real once the time has come
+                return ~uint256(0);
+            }
+            const_cast<CBlock*>(this)->uhash = hash;
         }
 
-        //scrypt_buffer_free(scratchbuff);
-
         return uhash;
     }
 
@@ -1255,6 +1381,9 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
+        long fileOutEnd = ftell(fileout);
+        if (fileOutEnd > 0)
+            BlockFileWritten(nFileRet, fileOutEnd);
         if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
             FileCommit(fileout);
 
@@ -1265,22 +1394,37 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        int nType = SER_DISK;
         if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
+            nType |= SER_BLOCKHEADERONLY;
 		if(fScryptHash)
-			filein.nType |= SER_SCRYPTHASH;
+			nType |= SER_SCRYPTHASH;
 
-        // Read block
-        try {
-            filein >> *this;
+        // pennies: deserialize straight from the mapped block file
+        boost::shared_ptr<CBlockFileView> view = GetBlockFileView(nFile, nBlockPos);
+        if (view)
+        {
+            try {
+                CBufferReader(view->pbegin + nBlockPos, view->pbegin + view->nSize, nType, CLIENT_VERSION) >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        else
+        {
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
         }
 
         // Check the header
@@ -1344,17 +1488,11 @@ private:
 class CBlockIndex
 {
 public:
-    const uint256* phashBlock;
+    // pennies: fields read while walking the chain come first so a step
+    // through pprev touches one or two cache lines
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    CBigNum bnChainTrust; // ppcoin: trust score of block chain
     int nHeight;
-
-    int64 nMint;
-    int64 nMoneySupply;
-
     unsigned int nFlags;  // ppcoin: block index flags
     enum  
     {
@@ -1362,8 +1500,18 @@ public:
         BLOCK_STAKE_ENTROPY  = (1 << 1), // entropy bit for stake modifier
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
-
+    unsigned int nTime;
+    unsigned int nBits;
     uint64 nStakeModifier; // hash modifier for proof-of-stake
+    const uint256* phashBlock;
+    uint256 nChainTrust; // ppcoin: trust score of block chain
+
+    unsigned int nFile;
+    unsigned int nBlockPos;
+
+    int64 nMint;
+    int64 nMoneySupply;
+
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
 
     // proof-of-stake specific fields
@@ -1374,10 +1522,13 @@ public:
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
     unsigned int nNonce;
 
+    // pennies: entries are carved out of large slabs and live until exit, so
+    // the index is a few contiguous runs of memory instead of one heap block each
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p) {}
+
     CBlockIndex()
     {
         phashBlock = NULL;
@@ -1386,7 +1537,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1411,7 +1562,7 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1463,13 +1614,15 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockTrust() const
+    uint256 GetBlockTrust() const
     {
         CBigNum bnTarget;
         bnTarget.SetCompact(nBits);
         if (bnTarget <= 0)
             return 0;
-        return (IsProofOfStake()? (CBigNum(1)<<256) / (bnTarget+1) : 1);
+        if (!IsProofOfStake())
+            return 1;
+        return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
     }
 
     bool IsInMainChain() const
@@ -1966,4 +2119,27 @@ public:
 
 extern CTxMemPool mempool;
 
+
+/** Hash rate of one proof-of-work miner thread */
+class CMinerThreadStats
+{
+public:
+    int nThread;
+    int nCpu;
+    uint64 nHashes;
+    double dHashesPerSec;
+    int64 nScratchAllocMicros;
+};
+
+/** Hash rates of the proof-of-work miner over rolling windows */
+class CMinerStats
+{
+public:
+    uint64 nHashes;
+    double dHashesPerSec10s;
+    double dHashesPerSec1m;
+    double dHashesPerSec15m;
+    std::vector<CMinerThreadStats> vThreads;
+};
+
 #endif
@@ -115,6 +115,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_MINTER,
+    THREAD_SCRYPTHASH,
+    THREAD_SCRIPTCHECK,
 
     THREAD_MAX
 };
@@ -173,6 +175,8 @@ public:
     SOCKET hSocket;
     CDataStream vSend;
     CDataStream vRecv;
+    // Bytes at the front of vRecv already scanned for headers to prehash
+    unsigned int nRecvPrehashed;
 	size_t nSendSize; 
     CCriticalSection cs_vSend;
     std::deque<CInv> vRecvGetData;
@@ -258,6 +262,7 @@ public:
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nRecvPrehashed = 0;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
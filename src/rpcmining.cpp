@@ -91,11 +91,41 @@ Value gethashespersec(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gethashespersec\n"
-            "Returns a recent hashes per second performance measurement averaged over 30 seconds while generating.");
+            "Returns a recent hashes per second performance measurement averaged over 1 minute while generating.");
 
-    if (GetTimeMillis() - nHPSTimerStart > 30000)
-        return (boost::int64_t)0;
-    return (boost::int64_t)dHashesPerSec;
+    return (boost::int64_t)GetHashesPerSec();
+}
+
+
+Value getminingstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getminingstats\n"
+            "Returns proof-of-work hash rates over the last 10 seconds, 1 minute and 15 minutes,\n"
+            "and for each miner thread its rate over the last minute and the time spent allocating scratchpads.");
+
+    CMinerStats stats;
+    GetMinerStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hashes",          (uint64_t)stats.nHashes));
+    obj.push_back(Pair("hashespersec10s", stats.dHashesPerSec10s));
+    obj.push_back(Pair("hashespersec1m",  stats.dHashesPerSec1m));
+    obj.push_back(Pair("hashespersec15m", stats.dHashesPerSec15m));
+    Array threads;
+    BOOST_FOREACH(const CMinerThreadStats& thread, stats.vThreads)
+    {
+        Object entry;
+        entry.push_back(Pair("thread",            thread.nThread));
+        entry.push_back(Pair("cpu",               thread.nCpu));
+        entry.push_back(Pair("hashes",            (uint64_t)thread.nHashes));
+        entry.push_back(Pair("hashespersec",      thread.dHashesPerSec));
+        entry.push_back(Pair("scratchallocmsecs", thread.nScratchAllocMicros / 1000.0));
+        threads.push_back(entry);
+    }
+    obj.push_back(Pair("threads",         threads));
+    return obj;
 }
 
 
@@ -117,6 +147,16 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
+    obj.push_back(Pair("mineraffinity", fMinerAffinity));
+    Array minercpus;
+    BOOST_FOREACH(const PAIRTYPE(int, int)& item, GetMinerCpus())
+    {
+        Object cpu;
+        cpu.push_back(Pair("cpu", item.first));
+        cpu.push_back(Pair("numanode", item.second));
+        minercpus.push_back(cpu);
+    }
+    obj.push_back(Pair("minercpus",     minercpus));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
@@ -333,6 +333,7 @@ Value signrawtransaction(const Array& params, bool fHelp)
     // mergedTx will end up with all the signatures; it
     // starts as a clone of the rawtx:
     CTransaction mergedTx(txVariants[0]);
+    mergedTx.InvalidateHash();
     bool fComplete = true;
 
     // Fetch previous transactions (inputs):
@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <openssl/rand.h>
 
 using namespace std;
 using namespace boost;
@@ -16,27 +18,50 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const CScriptValue& vchSig, const CScriptValue& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore=true,
+              const CSignatureHasher* phasher=NULL);
 
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
 static const size_t nMaxNumSize = 4;
 
 
-CBigNum CastToBigNum(const valtype& vch)
+// pennies: numbers are read and written in the encoding of CBigNum::getvch,
+// little endian with the sign in the top bit of the last byte, but computed
+// as int64. Operands are at most nMaxNumSize bytes so no enabled opcode can
+// overflow.
+int64 CastToInt64(const CScriptValue& vch)
 {
     if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+        throw runtime_error("CastToInt64() : overflow");
+    if (vch.empty())
+        return 0;
+    int64 n = 0;
+    for (unsigned int i = 0; i < vch.size(); i++)
+        n |= (int64)vch[i] << (8 * i);
+    if (vch.back() & 0x80)
+        return -(n & ~((int64)0x80 << (8 * (vch.size() - 1))));
+    return n;
 }
 
-bool CastToBool(const valtype& vch)
+static void SetScriptNum(CScriptValue& vch, int64 n)
+{
+    vch.clear();
+    if (n == 0)
+        return;
+    bool fNegative = n < 0;
+    uint64 nAbs = fNegative ? -n : n;
+    while (nAbs)
+    {
+        vch.push_back(nAbs & 0xff);
+        nAbs >>= 8;
+    }
+    // The top bit is the sign, add a byte if the magnitude needs it
+    if (vch.back() & 0x80)
+        vch.push_back(fNegative ? 0x80 : 0);
+    else if (fNegative)
+        vch.back() |= 0x80;
+}
+
+bool CastToBool(const CScriptValue& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -51,32 +76,6 @@ bool CastToBool(const valtype& vch)
     return false;
 }
 
-//
-// WARNING: This does not work as expected for signed integers; the sign-bit
-// is left in place as the integer is zero-extended. The correct behavior
-// would be to move the most significant bit of the last byte during the
-// resize process. MakeSameSize() is currently only used by the disabled
-// opcodes OP_AND, OP_OR, and OP_XOR.
-//
-void MakeSameSize(valtype& vch1, valtype& vch2)
-{
-    // Lengthen the shorter one
-    if (vch1.size() < vch2.size())
-        // PATCH:
-        // +unsigned char msb = vch1[vch1.size()-1];
-        // +vch1[vch1.size()-1] &= 0x7f;
-        //  vch1.resize(vch2.size(), 0);
-        // +vch1[vch1.size()-1] = msb;
-        vch1.resize(vch2.size(), 0);
-    if (vch2.size() < vch1.size())
-        // PATCH:
-        // +unsigned char msb = vch2[vch2.size()-1];
-        // +vch2[vch2.size()-1] &= 0x7f;
-        //  vch2.resize(vch1.size(), 0);
-        // +vch2[vch2.size()-1] = msb;
-        vch2.resize(vch1.size(), 0);
-}
-
 
 
 //
@@ -85,13 +84,25 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
     stack.pop_back();
 }
 
+static inline void pushnum(CScriptStack& stack, int64 n)
+{
+    stack.push_back(CScriptValue());
+    SetScriptNum(stack.back(), n);
+}
+
+static inline void pushbool(CScriptStack& stack, bool fValue)
+{
+    stack.push_back(CScriptValue());
+    if (fValue)
+        stack.back().push_back(1);
+}
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -250,16 +261,20 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+// pennies: the interpreter runs on CScriptStack, whose elements and the stack
+// itself stay inline for standard scripts, and does its arithmetic in int64.
+// The disabled opcodes are rejected before the switch and have no cases.
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore,
+                const CSignatureHasher* phasher)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
-    valtype vchPushValue;
-    vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScript::const_iterator pdata;
+    unsigned int nDataSize;
+    smallvector<bool, 16> vfExec;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -274,9 +289,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
             //
             // Read instruction
             //
-            if (!script.GetOp(pc, opcode, vchPushValue))
+            if (!script.GetOp(pc, opcode, pdata, nDataSize))
                 return false;
-            if (vchPushValue.size() > 520)
+            if (nDataSize > 520)
                 return false;
             if (opcode > OP_16 && ++nOpCount > 201)
                 return false;
@@ -299,7 +314,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 return false;
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+            {
+                stack.push_back(CScriptValue());
+                stack.back().assign(pdata, pdata + nDataSize);
+            }
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -325,8 +343,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, (int)opcode - (int)(OP_1 - 1));
                 }
                 break;
 
@@ -348,7 +365,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CScriptValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -431,10 +448,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-2));
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -443,12 +458,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
                 }
                 break;
 
@@ -457,10 +469,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-4));
+                    stack.push_back(stacktop(-4));
                 }
                 break;
 
@@ -469,11 +479,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-6));
+                    stack.push_back(stacktop(-6));
+                    stack.erase(stack.end()-8, stack.end()-6);
                 }
                 break;
 
@@ -492,17 +500,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        stack.push_back(stacktop(-1));
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, stack.size());
                 }
                 break;
 
@@ -520,8 +526,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -539,8 +544,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -551,14 +555,13 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = (int)CastToInt64(stacktop(-1));
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    stack.push_back(stacktop(-n-1));
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                        stack.erase(stack.end()-n-2);
                 }
                 break;
 
@@ -588,8 +591,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    stack.insert(stack.end()-2, stacktop(-1));
                 }
                 break;
 
@@ -597,68 +599,12 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Splice ops
                 //
-                case OP_CAT:
-                {
-                    // (x1 x2 -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
-                    popstack(stack);
-                    if (stacktop(-1).size() > 520)
-                        return false;
-                }
-                break;
-
-                case OP_SUBSTR:
-                {
-                    // (in begin size -- out)
-                    if (stack.size() < 3)
-                        return false;
-                    valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
-                    if (nBegin < 0 || nEnd < nBegin)
-                        return false;
-                    if (nBegin > (int)vch.size())
-                        nBegin = vch.size();
-                    if (nEnd > (int)vch.size())
-                        nEnd = vch.size();
-                    vch.erase(vch.begin() + nEnd, vch.end());
-                    vch.erase(vch.begin(), vch.begin() + nBegin);
-                    popstack(stack);
-                    popstack(stack);
-                }
-                break;
-
-                case OP_LEFT:
-                case OP_RIGHT:
-                {
-                    // (in size -- out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
-                    if (nSize < 0)
-                        return false;
-                    if (nSize > (int)vch.size())
-                        nSize = vch.size();
-                    if (opcode == OP_LEFT)
-                        vch.erase(vch.begin() + nSize, vch.end());
-                    else
-                        vch.erase(vch.begin(), vch.end() - nSize);
-                    popstack(stack);
-                }
-                break;
-
                 case OP_SIZE:
                 {
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, stacktop(-1).size());
                 }
                 break;
 
@@ -666,51 +612,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Bitwise logic
                 //
-                case OP_INVERT:
-                {
-                    // (in - out)
-                    if (stack.size() < 1)
-                        return false;
-                    valtype& vch = stacktop(-1);
-                    for (unsigned int i = 0; i < vch.size(); i++)
-                        vch[i] = ~vch[i];
-                }
-                break;
-
-                //
-                // WARNING: These disabled opcodes exhibit unexpected behavior
-                // when used on signed integers due to a bug in MakeSameSize()
-                // [see definition of MakeSameSize() above].
-                //
-                case OP_AND:
-                case OP_OR:
-                case OP_XOR:
-                {
-                    // (x1 x2 - out)
-                    if (stack.size() < 2)
-                        return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    MakeSameSize(vch1, vch2); // <-- NOT SAFE FOR SIGNED VALUES
-                    if (opcode == OP_AND)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] &= vch2[i];
-                    }
-                    else if (opcode == OP_OR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] |= vch2[i];
-                    }
-                    else if (opcode == OP_XOR)
-                    {
-                        for (unsigned int i = 0; i < vch1.size(); i++)
-                            vch1[i] ^= vch2[i];
-                    }
-                    popstack(stack);
-                }
-                break;
-
                 case OP_EQUAL:
                 case OP_EQUALVERIFY:
                 //case OP_NOTEQUAL: // use OP_NUMNOTEQUAL
@@ -718,8 +619,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CScriptValue& vch1 = stacktop(-2);
+                    CScriptValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -728,7 +629,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //    fEqual = !fEqual;
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    pushbool(stack, fEqual);
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
@@ -745,8 +646,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -755,31 +654,23 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n = CastToInt64(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    SetScriptNum(stacktop(-1), n);
                 }
                 break;
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -795,62 +686,28 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    int64 n1 = CastToInt64(stacktop(-2));
+                    int64 n2 = CastToInt64(stacktop(-1));
+                    int64 n;
                     switch (opcode)
                     {
-                    case OP_ADD:
-                        bn = bn1 + bn2;
-                        break;
-
-                    case OP_SUB:
-                        bn = bn1 - bn2;
-                        break;
-
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
-                    default:                     assert(!"invalid opcode"); break;
+                    case OP_ADD:                 n = n1 + n2; break;
+                    case OP_SUB:                 n = n1 - n2; break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
+                    default:                     assert(!"invalid opcode"); n = 0; break;
                     }
                     popstack(stack);
-                    popstack(stack);
-                    stack.push_back(bn.getvch());
+                    SetScriptNum(stacktop(-1), n);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -867,14 +724,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    int64 n1 = CastToInt64(stacktop(-3));
+                    int64 n2 = CastToInt64(stacktop(-2));
+                    int64 n3 = CastToInt64(stacktop(-1));
+                    bool fValue = (n2 <= n1 && n1 < n3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    pushbool(stack, fValue);
                 }
                 break;
 
@@ -891,26 +748,27 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CScriptValue& vch = stacktop(-1);
+                    unsigned char pchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint256 hash;
+                        SHA256(vch.begin(), vch.size(), (unsigned char*)&hash);
+                        RIPEMD160((unsigned char*)&hash, sizeof(hash), pchHash);
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    vch.assign(pchHash, pchHash + nHashSize);
                 }
                 break;
 
@@ -928,24 +786,31 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    const CScriptValue& vchSig = stacktop(-2);
+                    const CScriptValue& vchPubKey = stacktop(-1);
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
                     //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signature since there's no way for a signature
+                    // to sign itself. Usually that is the whole script, used in
+                    // place rather than copied.
+                    CScript scriptCodeCopy;
+                    bool fCopy = pbegincodehash != script.begin() || script.HasPush(vchSig.begin(), vchSig.size());
+                    if (fCopy)
+                    {
+                        scriptCodeCopy = CScript(pbegincodehash, pend);
+                        scriptCodeCopy.FindAndDelete(CScript(valtype(vchSig.begin(), vchSig.end())));
+                    }
+                    const CScript& scriptCode = fCopy ? scriptCodeCopy : script;
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, fCacheStore, phasher);
 
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    pushbool(stack, fSuccess);
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
@@ -965,7 +830,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = (int)CastToInt64(stacktop(-i));
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -976,7 +841,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = (int)CastToInt64(stacktop(-i));
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -984,24 +849,32 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signatures, since there's no way for a signature to sign itself
-                    for (int k = 0; k < nSigsCount; k++)
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signatures, copied only when that is not the
+                    // whole script
+                    CScript scriptCodeCopy;
+                    bool fCopy = pbegincodehash != script.begin();
+                    for (int k = 0; k < nSigsCount && !fCopy; k++)
+                        fCopy = script.HasPush(stacktop(-isig-k).begin(), stacktop(-isig-k).size());
+                    if (fCopy)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        scriptCodeCopy = CScript(pbegincodehash, pend);
+                        for (int k = 0; k < nSigsCount; k++)
+                        {
+                            CScriptValue& vchSig = stacktop(-isig-k);
+                            scriptCodeCopy.FindAndDelete(CScript(valtype(vchSig.begin(), vchSig.end())));
+                        }
                     }
+                    const CScript& scriptCode = fCopy ? scriptCodeCopy : script;
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        const CScriptValue& vchSig = stacktop(-isig);
+                        const CScriptValue& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, fCacheStore, phasher))
                         {
                             isig++;
                             nSigsCount--;
@@ -1017,7 +890,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     while (i-- > 0)
                         popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    pushbool(stack, fSuccess);
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
@@ -1050,6 +923,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore,
+                const CSignatureHasher* phasher)
+{
+    CScriptStack stackEval;
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackEval.push_back(CScriptValue(vch.begin(), vch.end()));
+    bool fRet = EvalScript(stackEval, script, txTo, nIn, nHashType, fCacheStore, phasher);
+    stack.clear();
+    BOOST_FOREACH(const CScriptValue& vch, stackEval)
+        stack.push_back(valtype(vch.begin(), vch.end()));
+    return fRet;
+}
+
 
 
 
@@ -1066,6 +952,7 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         return 1;
     }
     CTransaction txTmp(txTo);
+    txTmp.InvalidateHash();
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
@@ -1121,64 +1008,169 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
+CSignatureHasher::CSignatureHasher(const CTransaction& txToIn) : txTo(txToIn)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    vMidstate.resize(txTo.vin.size());
+    vSuffixPos.resize(txTo.vin.size() + 1);
+    ss.clear();
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate[i] = ctx;
+        vSuffixPos[i] = ss.size();
+        unsigned int nStart = ss.size();
+        ss << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        SHA256_Update(&ctx, &ss[nStart], ss.size() - nStart);
+    }
+    vSuffixPos[txTo.vin.size()] = ss.size();
+    ss << txTo.vout << txTo.nLockTime;
+    vchSuffix.assign(ss.begin(), ss.end());
+}
+
+uint256 CSignatureHasher::GetHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= txTo.vin.size() || (nHashType & SIGHASH_ANYONECANPAY) ||
+        (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return SignatureHash(scriptCode, txTo, nIn, nHashType);
+
+    // Only a script with codeseparators is copied to drop them
+    CScript scriptCodeCopy;
+    bool fCopy = scriptCode.Find(OP_CODESEPARATOR) > 0;
+    if (fCopy)
+    {
+        scriptCodeCopy = scriptCode;
+        scriptCodeCopy.FindAndDelete(CScript(OP_CODESEPARATOR));
+    }
+
+    // The inputs before nIn are in the midstate, this one carries the script
+    // and the rest are taken as they were serialized
+    CHashWriter ss(SER_GETHASH, 0, vMidstate[nIn]);
+    ss << txTo.vin[nIn].prevout << (fCopy ? scriptCodeCopy : scriptCode) << txTo.vin[nIn].nSequence;
+    ss.write((const char*)&vchSuffix[vSuffixPos[nIn + 1]], vchSuffix.size() - vSuffixPos[nIn + 1]);
+    ss << nHashType;
+    return ss.GetHash();
+}
+
+
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// pennies: an entry is a salted SHA-256 of (signature hash, signature, public
+// key) in a table of fixed size, -sigcache megabytes, or room for the older
+// -maxsigcachesize entries when only that is given. The table is split in
+// shards behind their own reader/writer locks so the script check threads
+// look up in parallel. Each entry has a bucket of SIGCACHE_WAYS slots; when
+// they are full the entry's own bits pick the one to evict, which peers
+// can't steer without knowing the salt.
+
+static const unsigned int SIGCACHE_SHARDS = 16;
+static const unsigned int SIGCACHE_WAYS = 4;
+static const int64 MAX_SIGCACHE_MEGABYTES = 4096;
+static const int64 MAX_SIGCACHE_ENTRIES = MAX_SIGCACHE_MEGABYTES * 1048576 / sizeof(uint256);
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    class CShard
+    {
+    public:
+        boost::shared_mutex mutex;
+        std::vector<uint256> vSlots;
+    };
+
+    unsigned char pchSalt[32];
+    CShard shards[SIGCACHE_SHARDS];
+    unsigned int nBuckets; // per shard
+
+    CShard& GetShard(const uint256& entry)
+    {
+        return shards[entry.Get64(0) % SIGCACHE_SHARDS];
+    }
+
+    unsigned int GetBucket(const uint256& entry) const
+    {
+        return (unsigned int)(entry.Get64(1) % nBuckets) * SIGCACHE_WAYS;
+    }
 
 public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    CSignatureCache()
     {
-        LOCK(cs_sigcache);
+        // A predictable salt would let peers pick which entries evict which
+        if (RAND_bytes(pchSalt, sizeof(pchSalt)) != 1)
+        {
+            RandAddSeedPerfmon();
+            if (RAND_bytes(pchSalt, sizeof(pchSalt)) != 1)
+                throw std::runtime_error("CSignatureCache() : RAND_bytes failed");
+        }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+        int64 nEntries;
+        if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcache"))
+            nEntries = min(max(GetArg("-maxsigcachesize", 50000), (int64)0), MAX_SIGCACHE_ENTRIES);
+        else
+            nEntries = min(max(GetArg("-sigcache", 32), (int64)0), MAX_SIGCACHE_MEGABYTES) * 1048576 / sizeof(uint256);
+        nBuckets = (unsigned int)((nEntries + SIGCACHE_SHARDS * SIGCACHE_WAYS - 1) / (SIGCACHE_SHARDS * SIGCACHE_WAYS));
+        BOOST_FOREACH(CShard& shard, shards)
+            shard.vSlots.resize(nBuckets * SIGCACHE_WAYS);
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    uint256 GetEntry(const uint256& hash, const unsigned char* pchSig, unsigned int nSigSize, const unsigned char* pchPubKey, unsigned int nPubKeySize) const
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        // The signature length keeps (sig, pubkey) splits of the same bytes apart
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, pchSalt, sizeof(pchSalt));
+        SHA256_Update(&ctx, BEGIN(hash), sizeof(hash));
+        SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+        SHA256_Update(&ctx, pchSig, nSigSize);
+        SHA256_Update(&ctx, pchPubKey, nPubKeySize);
+        SHA256_Final(entry.begin(), &ctx);
+        return entry;
+    }
 
-        LOCK(cs_sigcache);
+    bool Get(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return false;
+        CShard& shard = GetShard(entry);
+        const uint256* pslot = &shard.vSlots[GetBucket(entry)];
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
+            if (pslot[i] == entry)
+                return true;
+        return false;
+    }
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+    void Set(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return;
+        CShard& shard = GetShard(entry);
+        uint256* pslot = &shard.vSlots[GetBucket(entry)];
+        boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (pslot[i] == entry)
+                return;
+            if (pslot[i] == 0)
+            {
+                pslot[i] = entry;
+                return;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        pslot[entry.Get64(2) % SIGCACHE_WAYS] = entry;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool CheckSig(const CScriptValue& vchSig, const CScriptValue& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore, const CSignatureHasher* phasher)
 {
     static CSignatureCache signatureCache;
 
@@ -1189,21 +1181,21 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
+    unsigned int nSigSize = vchSig.size() - 1;
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = phasher ? phasher->GetHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+    uint256 entry = signatureCache.GetEntry(sighash, vchSig.begin(), nSigSize, vchPubKey.begin(), vchPubKey.size());
+    if (signatureCache.Get(entry))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey::Verify(sighash, vchSig.begin(), nSigSize, vchPubKey.begin(), vchPubKey.size()))
         return false;
 
-    signatureCache.Set(sighash, vchSig, vchPubKey);
+    // Signatures checked while connecting a block won't be checked again,
+    // keep the room for those of the memory pool
+    if (fCacheStore)
+        signatureCache.Set(entry);
     return true;
 }
 
@@ -1569,14 +1561,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+                  bool fValidatePayToScriptHash, int nHashType, bool fCacheStore, const CSignatureHasher* phasher)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    CScriptStack stack, stackCopy;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, fCacheStore, phasher))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, fCacheStore, phasher))
         return false;
     if (stack.empty())
         return false;
@@ -1590,11 +1582,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CScriptValue& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, fCacheStore, phasher))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1609,6 +1601,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
+    txTo.InvalidateHash();
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
@@ -1703,7 +1696,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(CScriptValue(sig.begin(), sig.end()), CScriptValue(pubkey.begin(), pubkey.end()), scriptPubKey, txTo, nIn, 0))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -13,9 +13,15 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "smallvector.h"
 
 typedef std::vector<unsigned char> valtype;
 
+/** Stack of the script interpreter. Elements up to the size of a signature or
+ * an uncompressed public key, and stacks of standard scripts, need no heap. */
+typedef smallvector<unsigned char, 80> CScriptValue;
+typedef smallvector<CScriptValue, 8> CScriptStack;
+
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
@@ -417,9 +423,23 @@ public:
 
     bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
     {
-        opcodeRet = OP_INVALIDOPCODE;
         if (pvchRet)
             pvchRet->clear();
+        const_iterator pdata;
+        unsigned int nSize;
+        if (!GetOp(pc, opcodeRet, pdata, nSize))
+            return false;
+        if (pvchRet)
+            pvchRet->assign(pdata, pdata + nSize);
+        return true;
+    }
+
+    // Pushed data is returned as the nSizeRet bytes at pdataRet, without a copy
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, const_iterator& pdataRet, unsigned int& nSizeRet) const
+    {
+        opcodeRet = OP_INVALIDOPCODE;
+        pdataRet = pc;
+        nSizeRet = 0;
         if (pc >= end())
             return false;
 
@@ -459,8 +479,8 @@ public:
             }
             if (end() - pc < 0 || (unsigned int)(end() - pc) < nSize)
                 return false;
-            if (pvchRet)
-                pvchRet->assign(pc, pc + nSize);
+            pdataRet = pc;
+            nSizeRet = nSize;
             pc += nSize;
         }
 
@@ -502,6 +522,47 @@ public:
         while (GetOp(pc, opcode));
         return nFound;
     }
+    // Whether FindAndDelete(CScript(vch)) would find the push of these bytes,
+    // without building that script
+    bool HasPush(const unsigned char* pch, unsigned int nSize) const
+    {
+        unsigned char pchOp[5];
+        unsigned int nOpSize;
+        if (nSize < OP_PUSHDATA1)
+        {
+            pchOp[0] = (unsigned char)nSize;
+            nOpSize = 1;
+        }
+        else if (nSize <= 0xff)
+        {
+            pchOp[0] = OP_PUSHDATA1;
+            pchOp[1] = (unsigned char)nSize;
+            nOpSize = 2;
+        }
+        else if (nSize <= 0xffff)
+        {
+            pchOp[0] = OP_PUSHDATA2;
+            unsigned short nShort = nSize;
+            memcpy(&pchOp[1], &nShort, sizeof(nShort));
+            nOpSize = 3;
+        }
+        else
+        {
+            pchOp[0] = OP_PUSHDATA4;
+            memcpy(&pchOp[1], &nSize, sizeof(nSize));
+            nOpSize = 5;
+        }
+        const_iterator pc = begin();
+        opcodetype opcode;
+        do
+        {
+            if ((unsigned int)(end() - pc) >= nOpSize + nSize &&
+                memcmp(&pc[0], pchOp, nOpSize) == 0 && memcmp(&pc[nOpSize], pch, nSize) == 0)
+                return true;
+        }
+        while (GetOp(pc, opcode));
+        return false;
+    }
     int Find(opcodetype op) const
     {
         int nFound = 0;
@@ -588,7 +649,36 @@ public:
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** Signature hashes of the inputs of one transaction. SignatureHash copies and
+ * hashes the whole transaction for every input; for SIGHASH_ALL this keeps the
+ * transaction serialized with blank input scripts and the SHA-256 state before
+ * each input, so an input only hashes its own script and what follows it.
+ * Other hash types go through SignatureHash. The transaction must outlive the
+ * hasher and not change while it is used.
+ */
+class CSignatureHasher
+{
+private:
+    const CTransaction& txTo;
+    // State after everything before blank input i
+    std::vector<SHA256_CTX> vMidstate;
+    // Blank inputs, then outputs and lock time
+    std::vector<unsigned char> vchSuffix;
+    // Start of blank input i in vchSuffix, and of the outputs at the end
+    std::vector<unsigned int> vSuffixPos;
+
+public:
+    explicit CSignatureHasher(const CTransaction& txToIn);
+
+    uint256 GetHash(const CScript& scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+/** fCacheStore: remember valid signatures for a later check of the same transaction
+ * phasher: precomputed signature hashes of txTo, optional */
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore=true,
+                const CSignatureHasher* phasher=NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore=true,
+                const CSignatureHasher* phasher=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -599,7 +689,7 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType);
+                  bool fValidatePayToScriptHash, int nHashType, bool fCacheStore=true, const CSignatureHasher* phasher=NULL);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
@@ -15,6 +15,7 @@ typedef uint32_t scrypt_mix_word_t;
 #include "scrypt-jane-mix_chacha-ssse3.h"
 #include "scrypt-jane-mix_chacha-sse2.h"
 #include "scrypt-jane-mix_chacha.h"
+#include "scrypt-jane-mix_chacha-lanes.h"
 
 #if defined(SCRYPT_CHACHA_AVX)
 	#define SCRYPT_CHUNKMIX_FN scrypt_ChunkMix_avx
@@ -52,9 +53,7 @@ typedef uint32_t scrypt_mix_word_t;
 
 #if !defined(SCRYPT_CHOOSE_COMPILETIME)
 static scrypt_ROMixfn
-scrypt_getROMix() {
-	size_t cpuflags = detect_cpu();
-
+scrypt_getROMix(size_t cpuflags) {
 #if defined(SCRYPT_CHACHA_AVX)
 	if (cpuflags & cpu_avx)
 		return scrypt_ROMix_avx;
@@ -75,10 +74,76 @@ scrypt_getROMix() {
 
 	return scrypt_ROMix_basic;
 }
+
+/* description of the mix scrypt_getROMix picks for these flags */
+static const char *
+scrypt_getROMixName(size_t cpuflags) {
+#if defined(SCRYPT_CHACHA_AVX)
+	if (cpuflags & cpu_avx)
+		return "ChaCha/8-AVX";
+	else
+#endif
+
+#if defined(SCRYPT_CHACHA_SSSE3)
+	if (cpuflags & cpu_ssse3)
+		return "ChaCha/8-SSSE3";
+	else
+#endif
+
+#if defined(SCRYPT_CHACHA_SSE2)
+	if (cpuflags & cpu_sse2)
+		return "ChaCha/8-SSE2";
+	else
+#endif
+
+	return "ChaCha20/8 Ref";
+}
+#endif
+
+
+#if defined(SCRYPT_CHACHA_LANES)
+/* lane counts are only handed out for cpus able to run them */
+static scrypt_ROMixLanesfn
+scrypt_getROMixLanes(size_t lanes) {
+	size_t cpuflags = detect_cpu();
+
+#if defined(SCRYPT_CHACHA_AVX512_LANES)
+	if ((cpuflags & cpu_avx512) && (lanes == 8))
+		return scrypt_ROMix_avx512_x8;
+	if ((cpuflags & cpu_avx512) && (lanes == 4))
+		return scrypt_ROMix_avx512_x4;
+#endif
+
+#if defined(SCRYPT_CHACHA_AVX2_LANES)
+	if ((cpuflags & cpu_avx2) && (lanes == 4))
+		return scrypt_ROMix_avx2_x4;
+	if ((cpuflags & cpu_avx2) && (lanes == 2))
+		return scrypt_ROMix_avx2_x2;
+#endif
+
+	return NULL;
+}
+
+static size_t
+scrypt_getLanesMax() {
+	size_t cpuflags = detect_cpu();
+
+#if defined(SCRYPT_CHACHA_AVX512_LANES)
+	if (cpuflags & cpu_avx512)
+		return 8;
+#endif
+
+#if defined(SCRYPT_CHACHA_AVX2_LANES)
+	if (cpuflags & cpu_avx2)
+		return 4;
+#endif
+
+	return 1;
+}
 #endif
 
 
-#if defined(SCRYPT_TEST_SPEED)
+#if !defined(SCRYPT_CHOOSE_COMPILETIME) || defined(SCRYPT_TEST_SPEED)
 static size_t
 available_implementations() {
 	size_t cpuflags = detect_cpu();
@@ -127,6 +192,20 @@ scrypt_test_mix() {
 		ret &= scrypt_test_mix_instance(scrypt_ChunkMix_sse2, scrypt_romix_nop, scrypt_romix_nop, expected);
 #endif
 
+#if defined(SCRYPT_CHACHA_AVX512_LANES)
+	if (cpuflags & cpu_avx512) {
+		ret &= scrypt_test_mix_lanes_instance(scrypt_ChunkMix_avx512_x8, 8, expected);
+		ret &= scrypt_test_mix_lanes_instance(scrypt_ChunkMix_avx512_x4, 4, expected);
+	}
+#endif
+
+#if defined(SCRYPT_CHACHA_AVX2_LANES)
+	if (cpuflags & cpu_avx2) {
+		ret &= scrypt_test_mix_lanes_instance(scrypt_ChunkMix_avx2_x4, 4, expected);
+		ret &= scrypt_test_mix_lanes_instance(scrypt_ChunkMix_avx2_x2, 2, expected);
+	}
+#endif
+
 #if defined(SCRYPT_CHACHA_BASIC)
 	ret &= scrypt_test_mix_instance(scrypt_ChunkMix_basic, scrypt_romix_convert_endian, scrypt_romix_convert_endian, expected);
 #endif
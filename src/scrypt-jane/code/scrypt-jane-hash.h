@@ -10,6 +10,7 @@
 #include "scrypt-jane-hash_skein512.h"
 #elif defined(SCRYPT_KECCAK512) || defined(SCRYPT_KECCAK256)
 #include "scrypt-jane-hash_keccak.h"
+#include "scrypt-jane-hash_keccak-lanes.h"
 #else
 	#define SCRYPT_HASH "ERROR"
 	#define SCRYPT_HASH_BLOCK_SIZE 64
@@ -24,6 +25,7 @@
 #endif
 
 #include "scrypt-jane-pbkdf2.h"
+#include "scrypt-jane-pbkdf2-lanes.h"
 
 #define SCRYPT_TEST_HASH_LEN 257 /* (2 * largest block size) + 1 */
 
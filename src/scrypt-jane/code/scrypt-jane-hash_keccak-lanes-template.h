@@ -0,0 +1,84 @@
+/*
+	keccak-f over several interleaved states, see keccak_block. one 64 bit word
+	of every lane per register, the lanes start at column `lane` of S
+
+	expects:
+		KECCAK_LANES_FN: name to generate
+		SCRYPT_LANES_TARGET: function attribute enabling the isa
+		klanes_vec: register type, klanes_load(p), klanes_store(p, v), klanes_set1(x)
+		klanes_xor(a, b), klanes_andnot(a, b) = ~a & b, klanes_rotl(a, bits)
+*/
+
+static void NOINLINE SCRYPT_LANES_TARGET
+KECCAK_LANES_FN(uint64_t (*S)[SCRYPT_HASH_MAX_LANES], size_t lane) {
+	klanes_vec s[25], t[5], u[5], v, w;
+	size_t i;
+
+	for (i = 0; i < 25; i++)
+		s[i] = klanes_load(&S[i][lane]);
+
+	for (i = 0; i < 24; i++) {
+		/* theta: c = a[0,i] ^ a[1,i] ^ .. a[4,i] */
+		t[0] = klanes_xor(klanes_xor(klanes_xor(s[0], s[5]), klanes_xor(s[10], s[15])), s[20]);
+		t[1] = klanes_xor(klanes_xor(klanes_xor(s[1], s[6]), klanes_xor(s[11], s[16])), s[21]);
+		t[2] = klanes_xor(klanes_xor(klanes_xor(s[2], s[7]), klanes_xor(s[12], s[17])), s[22]);
+		t[3] = klanes_xor(klanes_xor(klanes_xor(s[3], s[8]), klanes_xor(s[13], s[18])), s[23]);
+		t[4] = klanes_xor(klanes_xor(klanes_xor(s[4], s[9]), klanes_xor(s[14], s[19])), s[24]);
+
+		/* theta: d[i] = c[i+4] ^ rotl(c[i+1],1) */
+		u[0] = klanes_xor(t[4], klanes_rotl(t[1], 1));
+		u[1] = klanes_xor(t[0], klanes_rotl(t[2], 1));
+		u[2] = klanes_xor(t[1], klanes_rotl(t[3], 1));
+		u[3] = klanes_xor(t[2], klanes_rotl(t[4], 1));
+		u[4] = klanes_xor(t[3], klanes_rotl(t[0], 1));
+
+		/* theta: a[0,i], a[1,i], .. a[4,i] ^= d[i] */
+		s[0] = klanes_xor(s[0], u[0]); s[5] = klanes_xor(s[5], u[0]); s[10] = klanes_xor(s[10], u[0]); s[15] = klanes_xor(s[15], u[0]); s[20] = klanes_xor(s[20], u[0]);
+		s[1] = klanes_xor(s[1], u[1]); s[6] = klanes_xor(s[6], u[1]); s[11] = klanes_xor(s[11], u[1]); s[16] = klanes_xor(s[16], u[1]); s[21] = klanes_xor(s[21], u[1]);
+		s[2] = klanes_xor(s[2], u[2]); s[7] = klanes_xor(s[7], u[2]); s[12] = klanes_xor(s[12], u[2]); s[17] = klanes_xor(s[17], u[2]); s[22] = klanes_xor(s[22], u[2]);
+		s[3] = klanes_xor(s[3], u[3]); s[8] = klanes_xor(s[8], u[3]); s[13] = klanes_xor(s[13], u[3]); s[18] = klanes_xor(s[18], u[3]); s[23] = klanes_xor(s[23], u[3]);
+		s[4] = klanes_xor(s[4], u[4]); s[9] = klanes_xor(s[9], u[4]); s[14] = klanes_xor(s[14], u[4]); s[19] = klanes_xor(s[19], u[4]); s[24] = klanes_xor(s[24], u[4]);
+
+		/* rho pi: b[..] = rotl(a[..], ..) */
+		v = s[ 1];
+		s[ 1] = klanes_rotl(s[ 6], 44);
+		s[ 6] = klanes_rotl(s[ 9], 20);
+		s[ 9] = klanes_rotl(s[22], 61);
+		s[22] = klanes_rotl(s[14], 39);
+		s[14] = klanes_rotl(s[20], 18);
+		s[20] = klanes_rotl(s[ 2], 62);
+		s[ 2] = klanes_rotl(s[12], 43);
+		s[12] = klanes_rotl(s[13], 25);
+		s[13] = klanes_rotl(s[19],  8);
+		s[19] = klanes_rotl(s[23], 56);
+		s[23] = klanes_rotl(s[15], 41);
+		s[15] = klanes_rotl(s[ 4], 27);
+		s[ 4] = klanes_rotl(s[24], 14);
+		s[24] = klanes_rotl(s[21],  2);
+		s[21] = klanes_rotl(s[ 8], 55);
+		s[ 8] = klanes_rotl(s[16], 45);
+		s[16] = klanes_rotl(s[ 5], 36);
+		s[ 5] = klanes_rotl(s[ 3], 28);
+		s[ 3] = klanes_rotl(s[18], 21);
+		s[18] = klanes_rotl(s[17], 15);
+		s[17] = klanes_rotl(s[11], 10);
+		s[11] = klanes_rotl(s[ 7],  6);
+		s[ 7] = klanes_rotl(s[10],  3);
+		s[10] = klanes_rotl(    v,  1);
+
+		/* chi: a[i,j] ^= ~b[i,j+1] & b[i,j+2] */
+		v = s[ 0]; w = s[ 1]; s[ 0] = klanes_xor(s[ 0], klanes_andnot(w, s[ 2])); s[ 1] = klanes_xor(s[ 1], klanes_andnot(s[ 2], s[ 3])); s[ 2] = klanes_xor(s[ 2], klanes_andnot(s[ 3], s[ 4])); s[ 3] = klanes_xor(s[ 3], klanes_andnot(s[ 4], v)); s[ 4] = klanes_xor(s[ 4], klanes_andnot(v, w));
+		v = s[ 5]; w = s[ 6]; s[ 5] = klanes_xor(s[ 5], klanes_andnot(w, s[ 7])); s[ 6] = klanes_xor(s[ 6], klanes_andnot(s[ 7], s[ 8])); s[ 7] = klanes_xor(s[ 7], klanes_andnot(s[ 8], s[ 9])); s[ 8] = klanes_xor(s[ 8], klanes_andnot(s[ 9], v)); s[ 9] = klanes_xor(s[ 9], klanes_andnot(v, w));
+		v = s[10]; w = s[11]; s[10] = klanes_xor(s[10], klanes_andnot(w, s[12])); s[11] = klanes_xor(s[11], klanes_andnot(s[12], s[13])); s[12] = klanes_xor(s[12], klanes_andnot(s[13], s[14])); s[13] = klanes_xor(s[13], klanes_andnot(s[14], v)); s[14] = klanes_xor(s[14], klanes_andnot(v, w));
+		v = s[15]; w = s[16]; s[15] = klanes_xor(s[15], klanes_andnot(w, s[17])); s[16] = klanes_xor(s[16], klanes_andnot(s[17], s[18])); s[17] = klanes_xor(s[17], klanes_andnot(s[18], s[19])); s[18] = klanes_xor(s[18], klanes_andnot(s[19], v)); s[19] = klanes_xor(s[19], klanes_andnot(v, w));
+		v = s[20]; w = s[21]; s[20] = klanes_xor(s[20], klanes_andnot(w, s[22])); s[21] = klanes_xor(s[21], klanes_andnot(s[22], s[23])); s[22] = klanes_xor(s[22], klanes_andnot(s[23], s[24])); s[23] = klanes_xor(s[23], klanes_andnot(s[24], v)); s[24] = klanes_xor(s[24], klanes_andnot(v, w));
+
+		/* iota: a[0,0] ^= round constant */
+		s[0] = klanes_xor(s[0], klanes_set1(keccak_round_constants[i]));
+	}
+
+	for (i = 0; i < 25; i++)
+		klanes_store(&S[i][lane], s[i]);
+}
+
+#undef KECCAK_LANES_FN
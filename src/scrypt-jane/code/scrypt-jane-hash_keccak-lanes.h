@@ -0,0 +1,191 @@
+/*
+	multi-buffer keccak: up to SCRYPT_HASH_MAX_LANES messages of the same length
+	hashed in lockstep, 4 lanes per ymm permutation or 8 per zmm. the states are
+	interleaved as state[word][lane] so a word of every lane loads at once.
+	like the lane mixes these are always selected at runtime
+*/
+
+#if defined(X86_TARGET_AVX2) || defined(X86_TARGET_AVX512)
+	#include <immintrin.h>
+#endif
+
+#define SCRYPT_HASH_MAX_LANES 8
+
+/* avx2 */
+#if defined(X86_TARGET_AVX2)
+
+#define SCRYPT_KECCAK_AVX2_LANES
+
+#define SCRYPT_LANES_TARGET __attribute__((target("avx2")))
+#define klanes_vec __m256i
+#define klanes_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define klanes_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define klanes_set1(x) _mm256_set1_epi64x((long long)(x))
+#define klanes_xor(a, b) _mm256_xor_si256(a, b)
+#define klanes_andnot(a, b) _mm256_andnot_si256(a, b)
+#define klanes_rotl(a, bits) _mm256_or_si256(_mm256_slli_epi64(a, bits), _mm256_srli_epi64(a, 64 - (bits)))
+
+#define KECCAK_LANES_FN keccak_f_avx2_x4
+#include "scrypt-jane-hash_keccak-lanes-template.h"
+
+#undef SCRYPT_LANES_TARGET
+#undef klanes_vec
+#undef klanes_load
+#undef klanes_store
+#undef klanes_set1
+#undef klanes_xor
+#undef klanes_andnot
+#undef klanes_rotl
+
+#endif
+
+/* avx-512 */
+#if defined(X86_TARGET_AVX512)
+
+#define SCRYPT_KECCAK_AVX512_LANES
+
+#define SCRYPT_LANES_TARGET __attribute__((target("avx512f")))
+#define klanes_vec __m512i
+#define klanes_load(p) _mm512_loadu_si512((const void *)(p))
+#define klanes_store(p, v) _mm512_storeu_si512((void *)(p), v)
+#define klanes_set1(x) _mm512_set1_epi64((long long)(x))
+#define klanes_xor(a, b) _mm512_xor_si512(a, b)
+#define klanes_andnot(a, b) _mm512_andnot_si512(a, b)
+#define klanes_rotl(a, bits) _mm512_rol_epi64(a, bits)
+
+#define KECCAK_LANES_FN keccak_f_avx512_x8
+#include "scrypt-jane-hash_keccak-lanes-template.h"
+
+#undef SCRYPT_LANES_TARGET
+#undef klanes_vec
+#undef klanes_load
+#undef klanes_store
+#undef klanes_set1
+#undef klanes_xor
+#undef klanes_andnot
+#undef klanes_rotl
+
+#endif
+
+#if defined(SCRYPT_KECCAK_AVX2_LANES) || defined(SCRYPT_KECCAK_AVX512_LANES)
+
+#define SCRYPT_HASH_LANES
+
+/* permutes `width` lanes of S starting at column `lane` */
+typedef void (*scrypt_hash_lanesfn)(uint64_t (*S)[SCRYPT_HASH_MAX_LANES], size_t lane);
+
+typedef struct scrypt_hash_lanes_state_t {
+	uint64_t state[SCRYPT_KECCAK_F / 64][SCRYPT_HASH_MAX_LANES];
+	scrypt_hash_lanesfn permute;
+	size_t width, lanes;
+	uint32_t leftover;
+	uint8_t buffer[SCRYPT_HASH_MAX_LANES][SCRYPT_HASH_BLOCK_SIZE];
+} scrypt_hash_lanes_state;
+
+/* widest permutation the cpu runs and its lane count, NULL if none */
+static scrypt_hash_lanesfn
+scrypt_getHashLanes(size_t *width) {
+	size_t cpuflags = detect_cpu();
+
+#if defined(SCRYPT_KECCAK_AVX512_LANES)
+	if (cpuflags & cpu_avx512) {
+		*width = 8;
+		return keccak_f_avx512_x8;
+	}
+#endif
+
+#if defined(SCRYPT_KECCAK_AVX2_LANES)
+	if (cpuflags & cpu_avx2) {
+		*width = 4;
+		return keccak_f_avx2_x4;
+	}
+#endif
+
+	*width = 1;
+	return NULL;
+}
+
+static void
+keccak_block_lanes(scrypt_hash_lanes_state *S, const uint8_t *const *in, size_t offset) {
+	size_t i, l;
+
+	/* absorb input */
+	for (l = 0; l < S->lanes; l++) {
+		for (i = 0; i < SCRYPT_HASH_BLOCK_SIZE / 8; i++)
+			S->state[i][l] ^= U8TO64_LE(in[l] + offset + (i * 8));
+	}
+
+	for (l = 0; l < S->lanes; l += S->width)
+		S->permute(S->state, l);
+}
+
+static void
+keccak_buffer_lanes(scrypt_hash_lanes_state *S) {
+	const uint8_t *buffer[SCRYPT_HASH_MAX_LANES];
+	size_t l;
+
+	for (l = 0; l < S->lanes; l++)
+		buffer[l] = S->buffer[l];
+	keccak_block_lanes(S, buffer, 0);
+}
+
+static void
+scrypt_hash_lanes_init(scrypt_hash_lanes_state *S, size_t lanes, scrypt_hash_lanesfn permute, size_t width) {
+	memset(S, 0, sizeof(*S));
+	S->permute = permute;
+	S->width = width;
+	S->lanes = lanes;
+}
+
+static void
+scrypt_hash_lanes_update(scrypt_hash_lanes_state *S, const uint8_t *const *in, size_t inlen) {
+	size_t want, offset = 0, l;
+
+	/* handle the previous data */
+	if (S->leftover) {
+		want = (SCRYPT_HASH_BLOCK_SIZE - S->leftover);
+		want = (want < inlen) ? want : inlen;
+		for (l = 0; l < S->lanes; l++)
+			memcpy(S->buffer[l] + S->leftover, in[l], want);
+		S->leftover += (uint32_t)want;
+		if (S->leftover < SCRYPT_HASH_BLOCK_SIZE)
+			return;
+		offset += want;
+		inlen -= want;
+		keccak_buffer_lanes(S);
+	}
+
+	/* handle the current data */
+	while (inlen >= SCRYPT_HASH_BLOCK_SIZE) {
+		keccak_block_lanes(S, in, offset);
+		offset += SCRYPT_HASH_BLOCK_SIZE;
+		inlen -= SCRYPT_HASH_BLOCK_SIZE;
+	}
+
+	/* handle leftover data */
+	S->leftover = (uint32_t)inlen;
+	if (S->leftover) {
+		for (l = 0; l < S->lanes; l++)
+			memcpy(S->buffer[l], in[l] + offset, S->leftover);
+	}
+}
+
+static void
+scrypt_hash_lanes_finish(scrypt_hash_lanes_state *S, uint8_t *const *hash) {
+	size_t i, l;
+
+	for (l = 0; l < S->lanes; l++) {
+		S->buffer[l][S->leftover] = 0x01;
+		memset(S->buffer[l] + (S->leftover + 1), 0, SCRYPT_HASH_BLOCK_SIZE - (S->leftover + 1));
+		S->buffer[l][SCRYPT_HASH_BLOCK_SIZE - 1] |= 0x80;
+	}
+	keccak_buffer_lanes(S);
+
+	for (l = 0; l < S->lanes; l++) {
+		for (i = 0; i < SCRYPT_HASH_DIGEST_SIZE; i += 8) {
+			U64TO8_LE(&hash[l][i], S->state[i / 8][l]);
+		}
+	}
+}
+
+#endif
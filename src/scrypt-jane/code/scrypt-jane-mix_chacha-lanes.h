@@ -0,0 +1,144 @@
+/*
+	multi-lane chacha mixes: several independent chunks per call, one 128 bit
+	row of every lane per register (2 lanes in ymm, 4 lanes in zmm). these are
+	always selected at runtime, so they are built with a per-function target
+	and never depend on the -m flags or SCRYPT_CHOOSE_COMPILETIME
+*/
+
+#if defined(X86_TARGET_AVX2) || defined(X86_TARGET_AVX512)
+	#include <immintrin.h>
+#endif
+
+/* avx2 */
+#if defined(X86_TARGET_AVX2)
+
+#define SCRYPT_CHACHA_AVX2_LANES
+
+#define SCRYPT_LANES_TARGET __attribute__((target("avx2")))
+#define lanes_vec __m256i
+#define lanes_load(B, l, w) \
+	_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *)(B[(l) + 0] + (w)))), \
+	                        _mm_load_si128((const __m128i *)(B[(l) + 1] + (w))), 1)
+#define lanes_store(B, l, w, v) \
+	_mm_store_si128((__m128i *)(B[(l) + 0] + (w)), _mm256_castsi256_si128(v)); \
+	_mm_store_si128((__m128i *)(B[(l) + 1] + (w)), _mm256_extracti128_si256(v, 1))
+#define lanes_add(a, b) _mm256_add_epi32(a, b)
+#define lanes_xor(a, b) _mm256_xor_si256(a, b)
+#define lanes_shuffle(a, imm) _mm256_shuffle_epi32(a, imm)
+/* 16 and 8 are whole byte rotates, a pshufb is cheaper than the shift pair */
+#define lanes_rotl(a, bits) \
+	(((bits) == 16) ? _mm256_shuffle_epi8(a, _mm256_set_epi8(13,12,15,14,9,8,11,10,5,4,7,6,1,0,3,2,13,12,15,14,9,8,11,10,5,4,7,6,1,0,3,2)) : \
+	 ((bits) ==  8) ? _mm256_shuffle_epi8(a, _mm256_set_epi8(14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3,14,13,12,15,10,9,8,11,6,5,4,7,2,1,0,3)) : \
+	 _mm256_or_si256(_mm256_slli_epi32(a, bits), _mm256_srli_epi32(a, 32 - (bits))))
+
+#define SCRYPT_LANES_ROMIX_FN scrypt_ROMix_avx2_x2
+#define SCRYPT_LANES_CHUNKMIX_FN scrypt_ChunkMix_avx2_x2
+#define SCRYPT_LANES 2
+#define SCRYPT_LANES_SETS 1
+#include "scrypt-jane-romix-lanes-template.h"
+
+#define SCRYPT_LANES_ROMIX_FN scrypt_ROMix_avx2_x4
+#define SCRYPT_LANES_CHUNKMIX_FN scrypt_ChunkMix_avx2_x4
+#define SCRYPT_LANES 4
+#define SCRYPT_LANES_SETS 2
+#include "scrypt-jane-romix-lanes-template.h"
+
+#undef SCRYPT_LANES_TARGET
+#undef lanes_vec
+#undef lanes_load
+#undef lanes_store
+#undef lanes_add
+#undef lanes_xor
+#undef lanes_shuffle
+#undef lanes_rotl
+
+#endif
+
+/* avx-512 */
+#if defined(X86_TARGET_AVX512)
+
+#define SCRYPT_CHACHA_AVX512_LANES
+
+#define SCRYPT_LANES_TARGET __attribute__((target("avx512f")))
+#define lanes_vec __m512i
+#define lanes_load(B, l, w) \
+	_mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512( \
+		_mm_load_si128((const __m128i *)(B[(l) + 0] + (w)))), \
+		_mm_load_si128((const __m128i *)(B[(l) + 1] + (w))), 1), \
+		_mm_load_si128((const __m128i *)(B[(l) + 2] + (w))), 2), \
+		_mm_load_si128((const __m128i *)(B[(l) + 3] + (w))), 3)
+#define lanes_store(B, l, w, v) \
+	_mm_store_si128((__m128i *)(B[(l) + 0] + (w)), _mm512_castsi512_si128(v)); \
+	_mm_store_si128((__m128i *)(B[(l) + 1] + (w)), _mm512_extracti32x4_epi32(v, 1)); \
+	_mm_store_si128((__m128i *)(B[(l) + 2] + (w)), _mm512_extracti32x4_epi32(v, 2)); \
+	_mm_store_si128((__m128i *)(B[(l) + 3] + (w)), _mm512_extracti32x4_epi32(v, 3))
+#define lanes_add(a, b) _mm512_add_epi32(a, b)
+#define lanes_xor(a, b) _mm512_xor_si512(a, b)
+#define lanes_shuffle(a, imm) _mm512_shuffle_epi32(a, (_MM_PERM_ENUM)(imm))
+#define lanes_rotl(a, bits) _mm512_rol_epi32(a, bits)
+
+#define SCRYPT_LANES_ROMIX_FN scrypt_ROMix_avx512_x4
+#define SCRYPT_LANES_CHUNKMIX_FN scrypt_ChunkMix_avx512_x4
+#define SCRYPT_LANES 4
+#define SCRYPT_LANES_SETS 1
+#include "scrypt-jane-romix-lanes-template.h"
+
+#define SCRYPT_LANES_ROMIX_FN scrypt_ROMix_avx512_x8
+#define SCRYPT_LANES_CHUNKMIX_FN scrypt_ChunkMix_avx512_x8
+#define SCRYPT_LANES 8
+#define SCRYPT_LANES_SETS 2
+#include "scrypt-jane-romix-lanes-template.h"
+
+#undef SCRYPT_LANES_TARGET
+#undef lanes_vec
+#undef lanes_load
+#undef lanes_store
+#undef lanes_add
+#undef lanes_xor
+#undef lanes_shuffle
+#undef lanes_rotl
+
+#endif
+
+#if defined(SCRYPT_CHACHA_AVX2_LANES) || defined(SCRYPT_CHACHA_AVX512_LANES)
+	#define SCRYPT_CHACHA_LANES
+#endif
+
+#if defined(SCRYPT_CHACHA_LANES)
+/* function types for the lane mixes, used with cpu detection */
+typedef void (*scrypt_ROMixLanesfn)(scrypt_mix_word_t **X/*[lanes][chunkWords]*/, scrypt_mix_word_t **Y/*[lanes][chunkWords]*/, scrypt_mix_word_t **V/*[lanes][N * chunkWords]*/, uint32_t N, uint32_t r);
+typedef void (*chunkmixlanesfn)(uint32_t **Bout/*[lanes][chunkWords]*/, uint32_t **Bin/*[lanes][chunkWords]*/, uint32_t **Bxor/*[lanes][chunkWords]*/, uint32_t r);
+
+/* every lane is fed the scrypt_test_mix_instance chunk and must produce the same output */
+static int
+scrypt_test_mix_lanes_instance(chunkmixlanesfn mixfn, size_t lanes, const uint8_t expected[16]) {
+	const uint32_t r = 2, blocks = 2 * r, words = blocks * SCRYPT_BLOCK_WORDS;
+	scrypt_mix_word_t MM16 chunk[8][2][4 * SCRYPT_BLOCK_WORDS], v, *in[8], *out[8];
+	uint8_t final[16];
+	size_t i, l;
+	int ret = 1;
+
+	for (l = 0; l < lanes; l++) {
+		for (i = 0; i < words; i++) {
+			v = (scrypt_mix_word_t)i;
+			v = (v << 8) | v;
+			v = (v << 16) | v;
+			chunk[l][0][i] = v;
+		}
+		in[l] = chunk[l][0];
+		out[l] = chunk[l][1];
+	}
+
+	mixfn(out, in, NULL, r);
+
+	for (l = 0; l < lanes; l++) {
+		/* grab the last 16 bytes of the final block */
+		for (i = 0; i < 16; i += sizeof(scrypt_mix_word_t)) {
+			SCRYPT_WORDTO8_LE(final + i, chunk[l][1][words - (16 / sizeof(scrypt_mix_word_t)) + (i / sizeof(scrypt_mix_word_t))]);
+		}
+		ret &= scrypt_verify(expected, final, 16);
+	}
+
+	return ret;
+}
+#endif
@@ -0,0 +1,207 @@
+/*
+	pbkdf2 over several password/salt pairs of the same lengths at once, for
+	the pre and post passes of the multi-lane mixes. without a multi-buffer
+	hash for this cpu the lanes run through scrypt_pbkdf2 one after another
+*/
+
+#if defined(SCRYPT_HASH_LANES)
+
+typedef struct scrypt_hmac_lanes_state_t {
+	scrypt_hash_lanes_state inner, outer;
+} scrypt_hmac_lanes_state;
+
+static void
+scrypt_hmac_lanes_init(scrypt_hmac_lanes_state *st, const uint8_t *const *key, size_t keylen, size_t lanes, scrypt_hash_lanesfn permute, size_t width) {
+	uint8_t pad[SCRYPT_HASH_MAX_LANES][SCRYPT_HASH_BLOCK_SIZE] = {{0}};
+	uint8_t *padp[SCRYPT_HASH_MAX_LANES];
+	size_t i, l;
+
+	scrypt_hash_lanes_init(&st->inner, lanes, permute, width);
+	scrypt_hash_lanes_init(&st->outer, lanes, permute, width);
+
+	for (l = 0; l < lanes; l++)
+		padp[l] = pad[l];
+
+	if (keylen <= SCRYPT_HASH_BLOCK_SIZE) {
+		/* use the key directly if it's <= blocksize bytes */
+		for (l = 0; l < lanes; l++)
+			memcpy(pad[l], key[l], keylen);
+	} else {
+		/* if it's > blocksize bytes, hash it */
+		scrypt_hash_lanes_update(&st->inner, key, keylen);
+		scrypt_hash_lanes_finish(&st->inner, padp);
+		scrypt_hash_lanes_init(&st->inner, lanes, permute, width);
+	}
+
+	/* inner = (key ^ 0x36) */
+	/* h(inner || ...) */
+	for (l = 0; l < lanes; l++) {
+		for (i = 0; i < SCRYPT_HASH_BLOCK_SIZE; i++)
+			pad[l][i] ^= 0x36;
+	}
+	scrypt_hash_lanes_update(&st->inner, (const uint8_t *const *)padp, SCRYPT_HASH_BLOCK_SIZE);
+
+	/* outer = (key ^ 0x5c) */
+	/* h(outer || ...) */
+	for (l = 0; l < lanes; l++) {
+		for (i = 0; i < SCRYPT_HASH_BLOCK_SIZE; i++)
+			pad[l][i] ^= (0x5c ^ 0x36);
+	}
+	scrypt_hash_lanes_update(&st->outer, (const uint8_t *const *)padp, SCRYPT_HASH_BLOCK_SIZE);
+
+	scrypt_ensure_zero(pad, sizeof(pad));
+}
+
+static void
+scrypt_hmac_lanes_update(scrypt_hmac_lanes_state *st, const uint8_t *const *m, size_t mlen) {
+	/* h(inner || m...) */
+	scrypt_hash_lanes_update(&st->inner, m, mlen);
+}
+
+static void
+scrypt_hmac_lanes_finish(scrypt_hmac_lanes_state *st, uint8_t *const *mac) {
+	/* h(inner || m) */
+	scrypt_hash_digest innerhash[SCRYPT_HASH_MAX_LANES];
+	uint8_t *innerp[SCRYPT_HASH_MAX_LANES];
+	size_t l;
+
+	for (l = 0; l < st->inner.lanes; l++)
+		innerp[l] = innerhash[l];
+	scrypt_hash_lanes_finish(&st->inner, innerp);
+
+	/* h(outer || h(inner || m)) */
+	scrypt_hash_lanes_update(&st->outer, (const uint8_t *const *)innerp, sizeof(innerhash[0]));
+	scrypt_hash_lanes_finish(&st->outer, mac);
+
+	scrypt_ensure_zero(innerhash, sizeof(innerhash));
+	scrypt_ensure_zero(st, sizeof(*st));
+}
+
+static void
+scrypt_pbkdf2_lanes(const uint8_t *const *password, size_t password_len, const uint8_t *const *salt, size_t salt_len, uint64_t N, uint8_t *const *out, size_t bytes, size_t lanes) {
+	scrypt_hmac_lanes_state hmac_pw, hmac_pw_salt, work;
+	scrypt_hash_digest ti[SCRYPT_HASH_MAX_LANES], u[SCRYPT_HASH_MAX_LANES];
+	uint8_t *tip[SCRYPT_HASH_MAX_LANES], *up[SCRYPT_HASH_MAX_LANES];
+	const uint8_t *bep[SCRYPT_HASH_MAX_LANES];
+	scrypt_hash_lanesfn permute;
+	uint8_t be[4];
+	uint32_t i, j, blocks;
+	size_t l, width, offset;
+	uint64_t c;
+
+	permute = scrypt_getHashLanes(&width);
+	if (!permute || (lanes < 2) || (lanes > SCRYPT_HASH_MAX_LANES)) {
+		for (l = 0; l < lanes; l++)
+			scrypt_pbkdf2(password[l], password_len, salt[l], salt_len, N, out[l], bytes);
+		return;
+	}
+
+	for (l = 0; l < lanes; l++) {
+		tip[l] = ti[l];
+		up[l] = u[l];
+		bep[l] = be;
+	}
+
+	/* hmac(password, ...) */
+	scrypt_hmac_lanes_init(&hmac_pw, password, password_len, lanes, permute, width);
+
+	/* hmac(password, salt...) */
+	hmac_pw_salt = hmac_pw;
+	scrypt_hmac_lanes_update(&hmac_pw_salt, salt, salt_len);
+
+	blocks = ((uint32_t)bytes + (SCRYPT_HASH_DIGEST_SIZE - 1)) / SCRYPT_HASH_DIGEST_SIZE;
+	for (i = 1, offset = 0; i <= blocks; i++, offset += SCRYPT_HASH_DIGEST_SIZE) {
+		/* U1 = hmac(password, salt || be(i)) */
+		U32TO8_BE(be, i);
+		work = hmac_pw_salt;
+		scrypt_hmac_lanes_update(&work, bep, 4);
+		scrypt_hmac_lanes_finish(&work, tip);
+		memcpy(u, ti, sizeof(u));
+
+		/* T[i] = U1 ^ U2 ^ U3... */
+		for (c = 0; c < N - 1; c++) {
+			/* UX = hmac(password, U{X-1}) */
+			work = hmac_pw;
+			scrypt_hmac_lanes_update(&work, (const uint8_t *const *)up, SCRYPT_HASH_DIGEST_SIZE);
+			scrypt_hmac_lanes_finish(&work, up);
+
+			/* T[i] ^= UX */
+			for (l = 0; l < lanes; l++) {
+				for (j = 0; j < sizeof(u[0]); j++)
+					ti[l][j] ^= u[l][j];
+			}
+		}
+
+		for (l = 0; l < lanes; l++)
+			memcpy(out[l] + offset, ti[l], (bytes > SCRYPT_HASH_DIGEST_SIZE) ? SCRYPT_HASH_DIGEST_SIZE : bytes);
+		bytes -= SCRYPT_HASH_DIGEST_SIZE;
+	}
+
+	scrypt_ensure_zero(ti, sizeof(ti));
+	scrypt_ensure_zero(u, sizeof(u));
+	scrypt_ensure_zero(&hmac_pw, sizeof(hmac_pw));
+	scrypt_ensure_zero(&hmac_pw_salt, sizeof(hmac_pw_salt));
+}
+
+#define SCRYPT_TEST_HASH_LANES_LEN 257 /* (2 * largest block size) + 1 */
+
+/* every lane count, with a different message in each lane, against scrypt_hash */
+static int
+scrypt_test_hash_lanes() {
+	scrypt_hash_lanes_state st;
+	scrypt_hash_lanesfn permute;
+	scrypt_hash_digest hash[SCRYPT_HASH_MAX_LANES], expected;
+	uint8_t msg[SCRYPT_HASH_MAX_LANES][SCRYPT_TEST_HASH_LANES_LEN], *hashp[SCRYPT_HASH_MAX_LANES];
+	const uint8_t *msgp[SCRYPT_HASH_MAX_LANES];
+	size_t i, l, lanes, width, len;
+	int ret = 1;
+
+	permute = scrypt_getHashLanes(&width);
+	if (!permute)
+		return 1;
+
+	for (l = 0; l < SCRYPT_HASH_MAX_LANES; l++) {
+		for (i = 0; i < SCRYPT_TEST_HASH_LANES_LEN; i++)
+			msg[l][i] = (uint8_t)(i + (l * 31));
+		msgp[l] = msg[l];
+		hashp[l] = hash[l];
+	}
+
+	for (lanes = 2; lanes <= SCRYPT_HASH_MAX_LANES; lanes++) {
+		for (len = 0; len <= SCRYPT_TEST_HASH_LANES_LEN; len += 7) {
+			/* split the update so the leftover path is covered too */
+			scrypt_hash_lanes_init(&st, lanes, permute, width);
+			scrypt_hash_lanes_update(&st, msgp, len / 3);
+			for (l = 0; l < lanes; l++)
+				msgp[l] += len / 3;
+			scrypt_hash_lanes_update(&st, msgp, len - (len / 3));
+			for (l = 0; l < lanes; l++)
+				msgp[l] = msg[l];
+			scrypt_hash_lanes_finish(&st, hashp);
+
+			for (l = 0; l < lanes; l++) {
+				scrypt_hash(expected, msg[l], len);
+				ret &= scrypt_verify(expected, hash[l], SCRYPT_HASH_DIGEST_SIZE);
+			}
+		}
+	}
+
+	return ret;
+}
+
+#else
+
+static void
+scrypt_pbkdf2_lanes(const uint8_t *const *password, size_t password_len, const uint8_t *const *salt, size_t salt_len, uint64_t N, uint8_t *const *out, size_t bytes, size_t lanes) {
+	size_t l;
+
+	for (l = 0; l < lanes; l++)
+		scrypt_pbkdf2(password[l], password_len, salt[l], salt_len, N, out[l], bytes);
+}
+
+static int
+scrypt_test_hash_lanes() {
+	return 1;
+}
+
+#endif
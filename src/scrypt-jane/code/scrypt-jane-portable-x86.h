@@ -45,6 +45,12 @@
 	#define X86_64USE_INTRINSIC
 #endif
 
+/* per-function isa targets, independent of the -m flags the file is built with */
+#if defined(COMPILER_GCC) && (COMPILER_GCC >= 40900) && (defined(CPU_X86) || defined(CPU_X86_64))
+	#define X86_TARGET_AVX2
+	#define X86_TARGET_AVX512
+#endif
+
 #if defined(COMPILER_GCC) && defined(CPU_X86_FORCE_INTRINSICS)
 	#define X86_INTRINSIC
 	#if defined(__SSE__)
@@ -201,7 +207,9 @@ typedef enum cpu_flags_x86_t {
 	cpu_ssse3 = 1 << 4,
 	cpu_sse4_1 = 1 << 5,
 	cpu_sse4_2 = 1 << 6,
-	cpu_avx = 1 << 7
+	cpu_avx = 1 << 7,
+	cpu_avx2 = 1 << 8,
+	cpu_avx512 = 1 << 9
 } cpu_flags_x86;
 
 typedef enum cpu_vendors_x86_t {
@@ -248,13 +256,14 @@ get_cpuid(x86_regs *regs, uint32_t flags) {
 
 	asm_gcc()
 		a1(push cpuid_bx)
+		a2(xor ecx, ecx)
 		a1(cpuid)
 		a2(mov [%1 + 0], eax)
 		a2(mov [%1 + 4], ebx)
 		a2(mov [%1 + 8], ecx)
 		a2(mov [%1 + 12], edx)
 		a1(pop cpuid_bx)
-		asm_gcc_parms() : "+a"(flags) : "S"(regs)  : "%ecx", "%edx", "cc"
+		asm_gcc_parms() : "+a"(flags) : "S"(regs)  : "%ecx", "%edx", "cc", "memory"
 	asm_gcc_end()
 #endif
 }
@@ -275,19 +284,16 @@ get_xgetbv(uint32_t flags) {
 }
 #endif // AVX support
 
-#if defined(SCRYPT_TEST_SPEED)
-size_t cpu_detect_mask = (size_t)-1;
-#endif
+/* features detect_cpu reports, see scrypt_set_cpu_mask */
+static size_t cpu_detect_mask = (size_t)-1;
 
 static size_t
 detect_cpu(void) {
-	union { uint8_t s[12]; uint32_t i[3]; } vendor_string;
-	cpu_vendors_x86 vendor = cpu_nobody;
 	x86_regs regs;
 	uint32_t max_level;
 	size_t cpu_flags = 0;
 #if defined(X86ASM_AVX) || defined(X86_64ASM_AVX)
-	uint64_t xgetbv_flags;
+	uint64_t xgetbv_flags = 0;
 #endif
 
 #if defined(CPU_X86)
@@ -297,15 +303,7 @@ detect_cpu(void) {
 
 	get_cpuid(&regs, 0);
 	max_level = regs.eax;
-	vendor_string.i[0] = regs.ebx;
-	vendor_string.i[1] = regs.edx;
-	vendor_string.i[2] = regs.ecx;
-
-	if (scrypt_verify(vendor_string.s, (const uint8_t *)"GenuineIntel", 12))
-		vendor = cpu_intel;
-	else if (scrypt_verify(vendor_string.s, (const uint8_t *)"AuthenticAMD", 12))
-		vendor = cpu_amd;
-	
+
 	if (max_level & 0x00000500) {
 		/* "Intel P5 pre-B0" */
 		cpu_flags |= cpu_mmx;
@@ -330,10 +328,17 @@ detect_cpu(void) {
 	if (regs.edx & (1 << 26)) cpu_flags |= cpu_sse2;
 	if (regs.edx & (1 << 25)) cpu_flags |= cpu_sse;
 	if (regs.edx & (1 << 23)) cpu_flags |= cpu_mmx;
+
+#if defined(X86ASM_AVX) || defined(X86_64ASM_AVX)
+	/* structured extended features, the os must also save ymm (and opmask/zmm) state */
+	if ((cpu_flags & cpu_avx) && (max_level >= 7)) {
+		get_cpuid(&regs, 7);
+		if ((regs.ebx & (1 <<  5)) && ((xgetbv_flags & 0x06) == 0x06)) cpu_flags |= cpu_avx2;
+		if ((regs.ebx & (1 << 16)) && ((xgetbv_flags & 0xe6) == 0xe6)) cpu_flags |= cpu_avx512;
+	}
+#endif
 	
-#if defined(SCRYPT_TEST_SPEED)
 	cpu_flags &= cpu_detect_mask;
-#endif
 
 	return cpu_flags;
 }
@@ -341,7 +346,9 @@ detect_cpu(void) {
 #if defined(SCRYPT_TEST_SPEED)
 static const char *
 get_top_cpuflag_desc(size_t flag) {
-	if (flag & cpu_avx) return "AVX";
+	if (flag & cpu_avx512) return "AVX-512";
+	else if (flag & cpu_avx2) return "AVX2";
+	else if (flag & cpu_avx) return "AVX";
 	else if (flag & cpu_sse4_2) return "SSE4.2";
 	else if (flag & cpu_sse4_1) return "SSE4.1";
 	else if (flag & cpu_ssse3) return "SSSE3";
@@ -0,0 +1,132 @@
+/*
+	ROMix over SCRYPT_LANES independent chunks at once
+
+	Every lane keeps its own X, Y and V in the usual layout, only the chacha
+	rows of the lanes are packed side by side into one register, so each lane
+	still indexes its own V_j. SCRYPT_LANES_SETS register sets are mixed
+	together to hide the latency of the round dependencies.
+
+	expects:
+		SCRYPT_LANES_ROMIX_FN, SCRYPT_LANES_CHUNKMIX_FN: names to generate
+		SCRYPT_LANES: number of lanes, SCRYPT_LANES_SETS: register sets
+		SCRYPT_LANES_TARGET: function attribute enabling the isa
+		lanes_vec: register type, lanes_load/lanes_store(B, lane, word)
+		lanes_add/lanes_xor(a, b), lanes_rotl(a, bits), lanes_shuffle(a, imm)
+*/
+
+#define SCRYPT_LANES_VEC (SCRYPT_LANES / SCRYPT_LANES_SETS)
+
+static void NOINLINE SCRYPT_LANES_TARGET
+SCRYPT_LANES_CHUNKMIX_FN(uint32_t **Bout/*[lanes][chunkWords]*/, uint32_t **Bin/*[lanes][chunkWords]*/, uint32_t **Bxor/*[lanes][chunkWords]*/, uint32_t r) {
+	uint32_t i, s, k, w, blocksPerChunk = r * 2, half = 0;
+	lanes_vec x[SCRYPT_LANES_SETS][4], t[SCRYPT_LANES_SETS][4];
+	size_t rounds;
+
+	/* 1: X = B_{2r - 1} */
+	w = (blocksPerChunk - 1) * SCRYPT_BLOCK_WORDS;
+	for (s = 0; s < SCRYPT_LANES_SETS; s++) {
+		for (k = 0; k < 4; k++) {
+			x[s][k] = lanes_load(Bin, s * SCRYPT_LANES_VEC, w + (k * 4));
+			if (Bxor)
+				x[s][k] = lanes_xor(x[s][k], lanes_load(Bxor, s * SCRYPT_LANES_VEC, w + (k * 4)));
+		}
+	}
+
+	/* 2: for i = 0 to 2r - 1 do */
+	for (i = 0; i < blocksPerChunk; i++, half ^= r) {
+		/* 3: X = H(X ^ B_i) */
+		w = i * SCRYPT_BLOCK_WORDS;
+		for (s = 0; s < SCRYPT_LANES_SETS; s++) {
+			for (k = 0; k < 4; k++) {
+				x[s][k] = lanes_xor(x[s][k], lanes_load(Bin, s * SCRYPT_LANES_VEC, w + (k * 4)));
+				if (Bxor)
+					x[s][k] = lanes_xor(x[s][k], lanes_load(Bxor, s * SCRYPT_LANES_VEC, w + (k * 4)));
+				t[s][k] = x[s][k];
+			}
+		}
+
+		for (rounds = 8; rounds; rounds -= 2) {
+			for (s = 0; s < SCRYPT_LANES_SETS; s++) {
+				x[s][0] = lanes_add(x[s][0], x[s][1]); x[s][3] = lanes_rotl(lanes_xor(x[s][3], x[s][0]), 16);
+				x[s][2] = lanes_add(x[s][2], x[s][3]); x[s][1] = lanes_rotl(lanes_xor(x[s][1], x[s][2]), 12);
+				x[s][0] = lanes_add(x[s][0], x[s][1]); x[s][3] = lanes_rotl(lanes_xor(x[s][3], x[s][0]), 8);
+				x[s][2] = lanes_add(x[s][2], x[s][3]); x[s][1] = lanes_rotl(lanes_xor(x[s][1], x[s][2]), 7);
+				x[s][0] = lanes_shuffle(x[s][0], 0x93);
+				x[s][3] = lanes_shuffle(x[s][3], 0x4e);
+				x[s][2] = lanes_shuffle(x[s][2], 0x39);
+				x[s][0] = lanes_add(x[s][0], x[s][1]); x[s][3] = lanes_rotl(lanes_xor(x[s][3], x[s][0]), 16);
+				x[s][2] = lanes_add(x[s][2], x[s][3]); x[s][1] = lanes_rotl(lanes_xor(x[s][1], x[s][2]), 12);
+				x[s][0] = lanes_add(x[s][0], x[s][1]); x[s][3] = lanes_rotl(lanes_xor(x[s][3], x[s][0]), 8);
+				x[s][2] = lanes_add(x[s][2], x[s][3]); x[s][1] = lanes_rotl(lanes_xor(x[s][1], x[s][2]), 7);
+				x[s][0] = lanes_shuffle(x[s][0], 0x39);
+				x[s][3] = lanes_shuffle(x[s][3], 0x4e);
+				x[s][2] = lanes_shuffle(x[s][2], 0x93);
+			}
+		}
+
+		/* 4: Y_i = X */
+		/* 6: B'[0..r-1] = Y_even */
+		/* 6: B'[r..2r-1] = Y_odd */
+		w = ((i / 2) + half) * SCRYPT_BLOCK_WORDS;
+		for (s = 0; s < SCRYPT_LANES_SETS; s++) {
+			for (k = 0; k < 4; k++) {
+				x[s][k] = lanes_add(x[s][k], t[s][k]);
+				lanes_store(Bout, s * SCRYPT_LANES_VEC, w + (k * 4), x[s][k]);
+			}
+		}
+	}
+}
+
+/*
+	X[l] = ROMix(X[l]) for every lane l, see SCRYPT_ROMIX_FN
+*/
+static void NOINLINE SCRYPT_LANES_TARGET
+SCRYPT_LANES_ROMIX_FN(scrypt_mix_word_t **X/*[lanes][chunkWords]*/, scrypt_mix_word_t **Y/*[lanes][chunkWords]*/, scrypt_mix_word_t **V/*[lanes][N * chunkWords]*/, uint32_t N, uint32_t r) {
+	uint32_t i, l, chunkWords = SCRYPT_BLOCK_WORDS * r * 2;
+	scrypt_mix_word_t *block[SCRYPT_LANES], *next[SCRYPT_LANES];
+
+	/* 1: X = B */
+	/* implicit */
+
+	/* 2: for i = 0 to N - 1 do */
+	for (l = 0; l < SCRYPT_LANES; l++) {
+		block[l] = V[l];
+		memcpy(block[l], X[l], chunkWords * sizeof(scrypt_mix_word_t));
+	}
+	for (i = 0; i < N - 1; i++) {
+		/* 3: V_i = X */
+		/* 4: X = H(X) */
+		for (l = 0; l < SCRYPT_LANES; l++)
+			next[l] = block[l] + chunkWords;
+		SCRYPT_LANES_CHUNKMIX_FN(next, block, NULL, r);
+		for (l = 0; l < SCRYPT_LANES; l++)
+			block[l] = next[l];
+	}
+	SCRYPT_LANES_CHUNKMIX_FN(X, block, NULL, r);
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 7: j = Integerify(X) % N */
+		for (l = 0; l < SCRYPT_LANES; l++)
+			block[l] = scrypt_item(V[l], X[l][chunkWords - SCRYPT_BLOCK_WORDS] & (N - 1), chunkWords);
+
+		/* 8: X = H(Y ^ V_j) */
+		SCRYPT_LANES_CHUNKMIX_FN(Y, X, block, r);
+
+		/* 7: j = Integerify(Y) % N */
+		for (l = 0; l < SCRYPT_LANES; l++)
+			block[l] = scrypt_item(V[l], Y[l][chunkWords - SCRYPT_BLOCK_WORDS] & (N - 1), chunkWords);
+
+		/* 8: X = H(Y ^ V_j) */
+		SCRYPT_LANES_CHUNKMIX_FN(X, Y, block, r);
+	}
+
+	/* 10: B' = X */
+	/* implicit */
+}
+
+#undef SCRYPT_LANES_VEC
+#undef SCRYPT_LANES_ROMIX_FN
+#undef SCRYPT_LANES_CHUNKMIX_FN
+#undef SCRYPT_LANES
+#undef SCRYPT_LANES_SETS
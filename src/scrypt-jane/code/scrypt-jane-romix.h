@@ -13,7 +13,9 @@
 	#define SCRYPT_BLOCK_WORDS (SCRYPT_BLOCK_BYTES / sizeof(scrypt_mix_word_t))
 	#if !defined(SCRYPT_CHOOSE_COMPILETIME)
 		static void FASTCALL scrypt_ROMix_error(scrypt_mix_word_t *X/*[chunkWords]*/, scrypt_mix_word_t *Y/*[chunkWords]*/, scrypt_mix_word_t *V/*[chunkWords * N]*/, uint32_t N, uint32_t r) {}
-		static scrypt_ROMixfn scrypt_getROMix() { return scrypt_ROMix_error; }
+		static scrypt_ROMixfn scrypt_getROMix(size_t cpuflags) { return scrypt_ROMix_error; }
+		static const char *scrypt_getROMixName(size_t cpuflags) { return SCRYPT_MIX_BASE; }
+		static size_t available_implementations() { return 0; }
 	#else
 		static void FASTCALL scrypt_ROMix(scrypt_mix_word_t *X, scrypt_mix_word_t *Y, scrypt_mix_word_t *V, uint32_t N, uint32_t r) {}
 	#endif
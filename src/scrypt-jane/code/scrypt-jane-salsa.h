@@ -41,9 +41,7 @@ typedef uint32_t scrypt_mix_word_t;
 
 #if !defined(SCRYPT_CHOOSE_COMPILETIME)
 static scrypt_ROMixfn
-scrypt_getROMix() {
-	size_t cpuflags = detect_cpu();
-
+scrypt_getROMix(size_t cpuflags) {
 #if defined(SCRYPT_SALSA_AVX)
 	if (cpuflags & cpu_avx)
 		return scrypt_ROMix_avx;
@@ -58,10 +56,28 @@ scrypt_getROMix() {
 
 	return scrypt_ROMix_basic;
 }
+
+/* description of the mix scrypt_getROMix picks for these flags */
+static const char *
+scrypt_getROMixName(size_t cpuflags) {
+#if defined(SCRYPT_SALSA_AVX)
+	if (cpuflags & cpu_avx)
+		return "Salsa/8-AVX";
+	else
+#endif
+
+#if defined(SCRYPT_SALSA_SSE2)
+	if (cpuflags & cpu_sse2)
+		return "Salsa/8-SSE2";
+	else
+#endif
+
+	return "Salsa20/8 Ref";
+}
 #endif
 
 
-#if defined(SCRYPT_TEST_SPEED)
+#if !defined(SCRYPT_CHOOSE_COMPILETIME) || defined(SCRYPT_TEST_SPEED)
 static size_t
 available_implementations() {
 	size_t cpuflags = detect_cpu();
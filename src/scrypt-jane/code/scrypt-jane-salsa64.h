@@ -49,9 +49,7 @@ typedef uint64_t scrypt_mix_word_t;
 
 #if !defined(SCRYPT_CHOOSE_COMPILETIME)
 static scrypt_ROMixfn
-scrypt_getROMix() {
-	size_t cpuflags = detect_cpu();
-
+scrypt_getROMix(size_t cpuflags) {
 #if defined(SCRYPT_SALSA64_AVX)
 	if (cpuflags & cpu_avx)
 		return scrypt_ROMix_avx;
@@ -72,10 +70,34 @@ scrypt_getROMix() {
 
 	return scrypt_ROMix_basic;
 }
+
+/* description of the mix scrypt_getROMix picks for these flags */
+static const char *
+scrypt_getROMixName(size_t cpuflags) {
+#if defined(SCRYPT_SALSA64_AVX)
+	if (cpuflags & cpu_avx)
+		return "Salsa64/8-AVX";
+	else
+#endif
+
+#if defined(SCRYPT_SALSA64_SSSE3)
+	if (cpuflags & cpu_ssse3)
+		return "Salsa64/8-SSSE3";
+	else
+#endif
+
+#if defined(SCRYPT_SALSA64_SSE2)
+	if (cpuflags & cpu_sse2)
+		return "Salsa64/8-SSE2";
+	else
+#endif
+
+	return "Salsa64/8 Ref";
+}
 #endif
 
 
-#if defined(SCRYPT_TEST_SPEED)
+#if !defined(SCRYPT_CHOOSE_COMPILETIME) || defined(SCRYPT_TEST_SPEED)
 static size_t
 available_implementations() {
 	size_t cpuflags = detect_cpu();
@@ -8,6 +8,14 @@
 #include <stdio.h>
 #include <malloc.h>
 
+#if defined(__linux__)
+	#include <sys/mman.h>
+	#define SCRYPT_HUGEPAGES
+	#if !defined(MAP_HUGE_1GB)
+		#define MAP_HUGE_1GB (30 << 26)
+	#endif
+#endif
+
 #include "scrypt-jane.h"
 #include "code/scrypt-jane-portable.h"
 #include "code/scrypt-jane-hash.h"
@@ -45,12 +53,71 @@ scrypt_set_fatal_error_default(scrypt_fatal_errorfn fn) {
 	scrypt_fatal_error = fn;
 }
 
+/* scrypt with an explicit mix, so the self test can reach every variant */
+static void
+scrypt_romix(scrypt_ROMixfn romix, const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len, uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor, uint8_t *out, size_t bytes, scrypt_scratchpad *sp) {
+	uint8_t *V, *X, *Y;
+	uint32_t N, r, p, chunk_bytes, i;
+
+	scrypt_scratchpad_reserve(sp, scrypt_scratchpad_bytes(Nfactor, rfactor, pfactor));
+
+	N = (1 << (Nfactor + 1));
+	r = (1 << rfactor);
+	p = (1 << pfactor);
+
+	chunk_bytes = SCRYPT_BLOCK_BYTES * r * 2;
+	V = sp->ptr;
+	Y = V + ((size_t)N * chunk_bytes);
+	X = Y + chunk_bytes;
+
+	/* 1: X = PBKDF2(password, salt) */
+	scrypt_pbkdf2(password, password_len, salt, salt_len, 1, X, chunk_bytes * p);
+
+	/* 2: X = ROMix(X) */
+	for (i = 0; i < p; i++)
+		romix((scrypt_mix_word_t *)(X + (chunk_bytes * i)), (scrypt_mix_word_t *)Y, (scrypt_mix_word_t *)V, N, r);
+
+	/* 3: Out = PBKDF2(password, X) */
+	scrypt_pbkdf2(password, password_len, X, chunk_bytes * p, 1, out, bytes);
+
+	scrypt_ensure_zero(Y, (p + 1) * chunk_bytes);
+}
+
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+static int
+scrypt_test_romix(scrypt_ROMixfn romix) {
+	const scrypt_test_setting *t;
+	uint8_t test_digest[64];
+	scrypt_scratchpad sp;
+	uint32_t i;
+	int scrypt_valid;
+
+	scrypt_scratchpad_init(&sp);
+	for (i = 0, scrypt_valid = 1; post_settings[i].pw; i++) {
+		t = post_settings + i;
+		scrypt_romix(romix, (uint8_t *)t->pw, strlen(t->pw), (uint8_t *)t->salt, strlen(t->salt), t->Nfactor, t->rfactor, t->pfactor, test_digest, sizeof(test_digest), &sp);
+		scrypt_valid &= scrypt_verify(post_vectors[i], test_digest, sizeof(test_digest));
+	}
+	scrypt_scratchpad_free(&sp);
+	return scrypt_valid;
+}
+#endif
+
 static int
 scrypt_power_on_self_test() {
 	const scrypt_test_setting *t;
 	uint8_t test_digest[64];
 	uint32_t i;
 	int res = 7, scrypt_valid;
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	size_t variants, variant;
+#endif
+#if defined(SCRYPT_CHACHA_LANES)
+	uint8_t lanes_digest[SCRYPT_MAX_LANES][64], *out[SCRYPT_MAX_LANES];
+	const uint8_t *pw[SCRYPT_MAX_LANES], *salt[SCRYPT_MAX_LANES];
+	scrypt_scratchpad sp;
+	size_t lanes, l;
+#endif
 
 	if (!scrypt_test_mix()) {
 #if !defined(SCRYPT_TEST)
@@ -59,7 +126,7 @@ scrypt_power_on_self_test() {
 		res &= ~1;
 	}
 
-	if (!scrypt_test_hash()) {
+	if (!scrypt_test_hash() || !scrypt_test_hash_lanes()) {
 #if !defined(SCRYPT_TEST)
 		scrypt_fatal_error("scrypt: hash function power-on-self-test failed");
 #endif
@@ -71,7 +138,36 @@ scrypt_power_on_self_test() {
 		scrypt((uint8_t *)t->pw, strlen(t->pw), (uint8_t *)t->salt, strlen(t->salt), t->Nfactor, t->rfactor, t->pfactor, test_digest, sizeof(test_digest));
 		scrypt_valid &= scrypt_verify(post_vectors[i], test_digest, sizeof(test_digest));
 	}
-	
+
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	/* every variant the cpu runs, not only the one scrypt_getROMix prefers */
+	scrypt_valid &= scrypt_test_romix(scrypt_getROMix(0));
+	variants = available_implementations();
+	for (variant = 1; variant && (variant <= variants); variant <<= 1) {
+		if (variants & variant)
+			scrypt_valid &= scrypt_test_romix(scrypt_getROMix(variant));
+	}
+#endif
+
+#if defined(SCRYPT_CHACHA_LANES)
+	/* every lane count the cpu runs, with the same vector in each lane */
+	for (lanes = scrypt_getLanesMax(); lanes > 1; lanes /= 2) {
+		scrypt_scratchpad_init(&sp);
+		for (i = 0; post_settings[i].pw; i++) {
+			t = post_settings + i;
+			for (l = 0; l < lanes; l++) {
+				pw[l] = (const uint8_t *)t->pw;
+				salt[l] = (const uint8_t *)t->salt;
+				out[l] = lanes_digest[l];
+			}
+			scrypt_scratch_lanes(pw, strlen(t->pw), salt, strlen(t->salt), t->Nfactor, t->rfactor, t->pfactor, out, sizeof(lanes_digest[0]), lanes, &sp);
+			for (l = 0; l < lanes; l++)
+				scrypt_valid &= scrypt_verify(post_vectors[i], lanes_digest[l], sizeof(lanes_digest[0]));
+		}
+		scrypt_scratchpad_free(&sp);
+	}
+#endif
+
 	if (!scrypt_valid) {
 #if !defined(SCRYPT_TEST)
 		scrypt_fatal_error("scrypt: scrypt power-on-self-test failed");
@@ -82,75 +178,153 @@ scrypt_power_on_self_test() {
 	return res;
 }
 
-typedef struct scrypt_aligned_alloc_t {
-	uint8_t *mem, *ptr;
-} scrypt_aligned_alloc;
-
-#if defined(SCRYPT_TEST_SPEED)
-static uint8_t *mem_base = (uint8_t *)0;
-static size_t mem_bump = 0;
-
-/* allocations are assumed to be multiples of 64 bytes and total allocations not to exceed ~1.01gb */
-static scrypt_aligned_alloc
-scrypt_alloc(uint64_t size) {
-	scrypt_aligned_alloc aa;
-	if (!mem_base) {
-		mem_base = (uint8_t *)malloc((1024 * 1024 * 1024) + (1024 * 1024) + (SCRYPT_BLOCK_BYTES - 1));
-		if (!mem_base)
-			scrypt_fatal_error("scrypt: out of memory");
-		mem_base = (uint8_t *)(((size_t)mem_base + (SCRYPT_BLOCK_BYTES - 1)) & ~(SCRYPT_BLOCK_BYTES - 1));
+static void
+scrypt_check_power_on_self_test() {
+#if !defined(SCRYPT_TEST)
+	static int power_on_self_test = 0;
+	if (!power_on_self_test) {
+		power_on_self_test = 1;
+		if (!scrypt_power_on_self_test())
+			scrypt_fatal_error("scrypt: power on self test failed");
 	}
-	aa.mem = mem_base + mem_bump;
-	aa.ptr = aa.mem;
-	mem_bump += (size_t)size;
-	return aa;
+#endif
 }
 
-static void
-scrypt_free(scrypt_aligned_alloc *aa) {
-	mem_bump = 0;
+/*
+	mix and lane counts picked for this cpu, resolved once after the power on
+	self test so hashing does not run cpuid every time. scrypt_set_cpu_mask
+	drops the choice, the next hash resolves it again
+*/
+typedef struct scrypt_choice_t {
+	int resolved;
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	scrypt_ROMixfn romix;
+	const char *name;
+#endif
+#if defined(SCRYPT_CHACHA_LANES)
+	size_t lanes_max;
+	scrypt_ROMixLanesfn romix_lanes[SCRYPT_MAX_LANES + 1];
+#endif
+} scrypt_choice;
+
+static scrypt_choice scrypt_chosen;
+
+static const scrypt_choice *
+scrypt_get_choice() {
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	size_t cpuflags;
+#endif
+#if defined(SCRYPT_CHACHA_LANES)
+	size_t lanes;
+#endif
+
+	scrypt_check_power_on_self_test();
+	if (scrypt_chosen.resolved)
+		return &scrypt_chosen;
+
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	cpuflags = detect_cpu();
+	scrypt_chosen.romix = scrypt_getROMix(cpuflags);
+	scrypt_chosen.name = scrypt_getROMixName(cpuflags);
+#endif
+#if defined(SCRYPT_CHACHA_LANES)
+	scrypt_chosen.lanes_max = scrypt_getLanesMax();
+	for (lanes = 0; lanes <= SCRYPT_MAX_LANES; lanes++)
+		scrypt_chosen.romix_lanes[lanes] = scrypt_getROMixLanes(lanes);
+#endif
+	scrypt_chosen.resolved = 1;
+	return &scrypt_chosen;
 }
-#else
-static scrypt_aligned_alloc
-scrypt_alloc(uint64_t size) {
-	static const size_t max_alloc = (size_t)-1;
-	scrypt_aligned_alloc aa;
-	size += (SCRYPT_BLOCK_BYTES - 1);
-	if (size > max_alloc)
-		scrypt_fatal_error("scrypt: not enough address space on this CPU to allocate required memory");
-	aa.mem = (uint8_t *)malloc((size_t)size);
-	aa.ptr = (uint8_t *)(((size_t)aa.mem + (SCRYPT_BLOCK_BYTES - 1)) & ~(SCRYPT_BLOCK_BYTES - 1));
-	if (!aa.mem)
-		scrypt_fatal_error("scrypt: out of memory");
-	return aa;
+
+static int scrypt_hugepages = 0;
+
+void
+scrypt_set_hugepages(int enable) {
+	scrypt_hugepages = enable;
 }
 
-static void
-scrypt_free(scrypt_aligned_alloc *aa) {
-	free(aa->mem);
+void
+scrypt_scratchpad_init(scrypt_scratchpad *sp) {
+	sp->mem = sp->ptr = (uint8_t *)0;
+	sp->size = 0;
+	sp->mapped = 0;
+	sp->pages = SCRYPT_PAGES_DEFAULT;
 }
+
+void
+scrypt_scratchpad_free(scrypt_scratchpad *sp) {
+#if defined(SCRYPT_HUGEPAGES)
+	if (sp->mapped)
+		munmap(sp->mem, sp->mapped);
+	else
 #endif
+	free(sp->mem);
+	scrypt_scratchpad_init(sp);
+}
 
+#if defined(SCRYPT_HUGEPAGES)
+/*
+	V is indexed at random, so with 4k pages nearly every lookup is a tlb miss.
+	try reserved 1gb/default size huge pages, then a transparent huge page
+	advised mapping, and leave anything that fails to the malloc path
+*/
+static int
+scrypt_scratchpad_map(scrypt_scratchpad *sp, size_t bytes) {
+	static const size_t huge_2mb = (size_t)1 << 21, huge_1gb = (size_t)1 << 30;
+	size_t len = 0;
+	void *mem = MAP_FAILED;
+	int pages = SCRYPT_PAGES_DEFAULT;
+
+	/* nothing to gain below a single huge page */
+	if (bytes < huge_2mb)
+		return 0;
+
+	if (bytes >= huge_1gb) {
+		len = (bytes + (huge_1gb - 1)) & ~(huge_1gb - 1);
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+		pages = SCRYPT_PAGES_HUGE_1GB;
+	}
 
-void
-scrypt(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len, uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor, uint8_t *out, size_t bytes) {
-	scrypt_aligned_alloc YX, V;
-	uint8_t *X, *Y;
-	uint32_t N, r, p, chunk_bytes, i;
+	if (mem == MAP_FAILED) {
+		len = (bytes + (huge_2mb - 1)) & ~(huge_2mb - 1);
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		pages = SCRYPT_PAGES_HUGETLB;
+	}
 
-#if !defined(SCRYPT_CHOOSE_COMPILETIME)
-	scrypt_ROMixfn scrypt_ROMix = scrypt_getROMix();
+	if (mem != MAP_FAILED) {
+		sp->mem = sp->ptr = (uint8_t *)mem;
+	} else {
+#if defined(MADV_HUGEPAGE)
+		/* over-map by one huge page so V can start on a huge page boundary */
+		len = ((bytes + (huge_2mb - 1)) & ~(huge_2mb - 1)) + huge_2mb;
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return 0;
+		if (madvise(mem, len, MADV_HUGEPAGE) != 0) {
+			munmap(mem, len);
+			return 0;
+		}
+		sp->mem = (uint8_t *)mem;
+		sp->ptr = (uint8_t *)(((size_t)mem + (huge_2mb - 1)) & ~(huge_2mb - 1));
+		pages = SCRYPT_PAGES_THP;
+#else
+		return 0;
 #endif
-
-#if !defined(SCRYPT_TEST)
-	static int power_on_self_test = 0;
-	if (!power_on_self_test) {
-		power_on_self_test = 1;
-		if (!scrypt_power_on_self_test())
-			scrypt_fatal_error("scrypt: power on self test failed");
 	}
+
+	sp->size = bytes;
+	sp->mapped = len;
+	sp->pages = pages;
+	return 1;
+}
 #endif
 
+/* bytes needed for V[N] followed by YX[p + 1] */
+size_t
+scrypt_scratchpad_bytes(uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor) {
+	static const size_t max_alloc = (size_t)-1;
+	uint64_t N, r, p, chunk_bytes, size;
+
 	if (Nfactor > scrypt_maxN)
 		scrypt_fatal_error("scrypt: N out of range");
 	if (rfactor > scrypt_maxr)
@@ -158,28 +332,170 @@ scrypt(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t
 	if (pfactor > scrypt_maxp)
 		scrypt_fatal_error("scrypt: p out of range");
 
-	N = (1 << (Nfactor + 1));
-	r = (1 << rfactor);
-	p = (1 << pfactor);
+	N = ((uint64_t)1 << (Nfactor + 1));
+	r = ((uint64_t)1 << rfactor);
+	p = ((uint64_t)1 << pfactor);
 
 	chunk_bytes = SCRYPT_BLOCK_BYTES * r * 2;
-	V = scrypt_alloc((uint64_t)N * chunk_bytes);
-	YX = scrypt_alloc((p + 1) * chunk_bytes);
+	size = (N + p + 1) * chunk_bytes;
+	if (size > max_alloc - (SCRYPT_BLOCK_BYTES - 1))
+		scrypt_fatal_error("scrypt: not enough address space on this CPU to allocate required memory");
+	return (size_t)size;
+}
 
-	/* 1: X = PBKDF2(password, salt) */
-	Y = YX.ptr;
-	X = Y + chunk_bytes;
-	scrypt_pbkdf2(password, password_len, salt, salt_len, 1, X, chunk_bytes * p);
+/*
+	an already large enough scratchpad is left untouched, unless it is over
+	SCRYPT_SCRATCHPAD_SHRINK times the size asked for: one hash at a high
+	Nfactor should not pin its memory in the owner for good
+*/
+#define SCRYPT_SCRATCHPAD_SHRINK 16
 
-	/* 2: X = ROMix(X) */
-	for (i = 0; i < p; i++)
-		scrypt_ROMix((scrypt_mix_word_t *)(X + (chunk_bytes * i)), (scrypt_mix_word_t *)Y, (scrypt_mix_word_t *)V.ptr, N, r);
+void
+scrypt_scratchpad_reserve(scrypt_scratchpad *sp, size_t bytes) {
+	if (bytes <= sp->size && bytes >= sp->size / SCRYPT_SCRATCHPAD_SHRINK)
+		return;
 
-	/* 3: Out = PBKDF2(password, X) */
-	scrypt_pbkdf2(password, password_len, X, chunk_bytes * p, 1, out, bytes);
+	scrypt_scratchpad_free(sp);
+
+#if defined(SCRYPT_HUGEPAGES)
+	if (scrypt_hugepages && scrypt_scratchpad_map(sp, bytes))
+		return;
+#endif
+
+	sp->mem = (uint8_t *)malloc(bytes + (SCRYPT_BLOCK_BYTES - 1));
+	if (!sp->mem) {
+		scrypt_scratchpad_init(sp);
+		scrypt_fatal_error("scrypt: out of memory");
+	}
+	sp->ptr = (uint8_t *)(((size_t)sp->mem + (SCRYPT_BLOCK_BYTES - 1)) & ~(SCRYPT_BLOCK_BYTES - 1));
+	sp->size = bytes;
+}
+
+
+void
+scrypt_scratch(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len, uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor, uint8_t *out, size_t bytes, scrypt_scratchpad *sp) {
+#if !defined(SCRYPT_CHOOSE_COMPILETIME)
+	scrypt_ROMixfn scrypt_ROMix = scrypt_get_choice()->romix;
+#else
+	scrypt_check_power_on_self_test();
+#endif
+
+	scrypt_romix(scrypt_ROMix, password, password_len, salt, salt_len, Nfactor, rfactor, pfactor, out, bytes, sp);
+}
+
+void
+scrypt(const uint8_t *password, size_t password_len, const uint8_t *salt, size_t salt_len, uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor, uint8_t *out, size_t bytes) {
+	scrypt_scratchpad sp;
+
+	scrypt_scratchpad_init(&sp);
+	scrypt_scratch(password, password_len, salt, salt_len, Nfactor, rfactor, pfactor, out, bytes, &sp);
+	scrypt_scratchpad_free(&sp);
+}
+
+const char *
+scrypt_mix_name() {
+#if defined(SCRYPT_CHOOSE_COMPILETIME)
+	return SCRYPT_MIX;
+#else
+	return scrypt_get_choice()->name;
+#endif
+}
+
+size_t
+scrypt_lanes_max() {
+#if defined(SCRYPT_CHACHA_LANES)
+	return scrypt_get_choice()->lanes_max;
+#else
+	return 1;
+#endif
+}
 
-	scrypt_ensure_zero(YX.ptr, (p + 1) * chunk_bytes);
+void
+scrypt_scratch_lanes(const uint8_t *const *password, size_t password_len, const uint8_t *const *salt, size_t salt_len, uint8_t Nfactor, uint8_t rfactor, uint8_t pfactor, uint8_t *const *out, size_t bytes, size_t lanes, scrypt_scratchpad *sp) {
+#if defined(SCRYPT_CHACHA_LANES)
+	static const size_t max_alloc = (size_t)-1;
+	scrypt_ROMixLanesfn scrypt_ROMix_lanes = (lanes <= SCRYPT_MAX_LANES) ? scrypt_get_choice()->romix_lanes[lanes] : NULL;
+	scrypt_mix_word_t *V[SCRYPT_MAX_LANES], *X[SCRYPT_MAX_LANES], *Y[SCRYPT_MAX_LANES], *Xi[SCRYPT_MAX_LANES];
+	uint8_t *Xb[SCRYPT_MAX_LANES] = {0};
+	uint32_t N, r, p, chunk_bytes, i;
+	size_t lane_bytes;
+#endif
+	size_t l;
+
+#if defined(SCRYPT_CHACHA_LANES)
+	if (scrypt_ROMix_lanes) {
+		lane_bytes = scrypt_scratchpad_bytes(Nfactor, rfactor, pfactor);
+		if (lane_bytes > (max_alloc - (SCRYPT_BLOCK_BYTES - 1)) / lanes)
+			scrypt_fatal_error("scrypt: not enough address space on this CPU to allocate required memory");
+		scrypt_scratchpad_reserve(sp, lane_bytes * lanes);
+
+		N = (1 << (Nfactor + 1));
+		r = (1 << rfactor);
+		p = (1 << pfactor);
+
+		/* each lane gets its own V[N] followed by YX[p + 1] */
+		chunk_bytes = SCRYPT_BLOCK_BYTES * r * 2;
+		for (l = 0; l < lanes; l++) {
+			V[l] = (scrypt_mix_word_t *)(sp->ptr + (l * lane_bytes));
+			Y[l] = (scrypt_mix_word_t *)((uint8_t *)V[l] + ((size_t)N * chunk_bytes));
+			X[l] = (scrypt_mix_word_t *)((uint8_t *)Y[l] + chunk_bytes);
+			Xb[l] = (uint8_t *)X[l];
+		}
+
+		/* 1: X = PBKDF2(password, salt) */
+		scrypt_pbkdf2_lanes(password, password_len, salt, salt_len, 1, Xb, chunk_bytes * p, lanes);
+
+		/* 2: X = ROMix(X) */
+		for (i = 0; i < p; i++) {
+			for (l = 0; l < lanes; l++)
+				Xi[l] = (scrypt_mix_word_t *)((uint8_t *)X[l] + (chunk_bytes * i));
+			scrypt_ROMix_lanes(Xi, Y, V, N, r);
+		}
+
+		/* 3: Out = PBKDF2(password, X) */
+		scrypt_pbkdf2_lanes(password, password_len, (const uint8_t *const *)Xb, chunk_bytes * p, 1, out, bytes, lanes);
+
+		for (l = 0; l < lanes; l++)
+			scrypt_ensure_zero(Y[l], (p + 1) * chunk_bytes);
+		return;
+	}
+#endif
 
-	scrypt_free(&V);
-	scrypt_free(&YX);
+	/* no mix for this lane count, hash the lanes one after another */
+	for (l = 0; l < lanes; l++)
+		scrypt_scratch(password[l], password_len, salt[l], salt_len, Nfactor, rfactor, pfactor, out[l], bytes, sp);
+}
+
+void
+scrypt_set_cpu_mask(size_t mask) {
+#if defined(CPU_X86) || defined(CPU_X86_64)
+	cpu_detect_mask = mask;
+#endif
+	scrypt_chosen.resolved = 0;
+}
+
+size_t
+scrypt_cpu_masks(size_t *masks, size_t max) {
+	size_t n = 0;
+#if defined(CPU_X86) || defined(CPU_X86_64)
+	size_t mask = cpu_detect_mask, cpuflags, flag;
+
+	cpu_detect_mask = (size_t)-1;
+	cpuflags = detect_cpu();
+	cpu_detect_mask = mask;
+
+	/* a level keeps every weaker flag, the same as a cpu that tops out there */
+	for (flag = (size_t)cpu_avx512; flag && (n < max); flag >>= 1) {
+		if (cpuflags & flag)
+			masks[n++] = (flag << 1) - 1;
+	}
+#endif
+	if (n < max)
+		masks[n++] = 0;
+	return n;
+}
+
+void
+scrypt_pbkdf2_stage(const uint8_t *const *password, size_t password_len, const uint8_t *const *salt, size_t salt_len, uint8_t *const *out, size_t bytes, size_t lanes) {
+	scrypt_pbkdf2_lanes(password, password_len, salt, salt_len, 1, out, bytes, lanes);
 }
@@ -24,4 +24,61 @@ void scrypt_set_fatal_error(scrypt_fatal_errorfn fn);
 
 void scrypt(const unsigned char *password, size_t password_len, const unsigned char *salt, size_t salt_len, unsigned char Nfactor, unsigned char rfactor, unsigned char pfactor, unsigned char *out, size_t bytes);
 
+/* name of the single lane mix scrypt() runs on this cpu */
+const char *scrypt_mix_name();
+
+/*
+	Caller-owned scratch memory (V and YX) for repeated hashing. The buffer is
+	kept while it is large enough, so a long lived owner (one per thread) stops
+	paying for malloc, free and page faults on every hash. It is reallocated
+	smaller when asked for a small fraction of what it holds.
+*/
+enum {
+	SCRYPT_PAGES_DEFAULT = 0,	/* malloc */
+	SCRYPT_PAGES_THP,			/* mmap advised for transparent huge pages */
+	SCRYPT_PAGES_HUGETLB,		/* MAP_HUGETLB, default huge page size */
+	SCRYPT_PAGES_HUGE_1GB		/* MAP_HUGETLB | MAP_HUGE_1GB */
+};
+
+typedef struct scrypt_scratchpad_t {
+	unsigned char *mem, *ptr;
+	size_t size, mapped;
+	int pages;
+} scrypt_scratchpad;
+
+/*
+	Back scratchpads of 2MB and up with huge pages where the OS offers them,
+	falling back to malloc otherwise. Applies to buffers (re)allocated later.
+*/
+void scrypt_set_hugepages(int enable);
+
+void scrypt_scratchpad_init(scrypt_scratchpad *sp);
+void scrypt_scratchpad_free(scrypt_scratchpad *sp);
+size_t scrypt_scratchpad_bytes(unsigned char Nfactor, unsigned char rfactor, unsigned char pfactor);
+void scrypt_scratchpad_reserve(scrypt_scratchpad *sp, size_t bytes);
+
+void scrypt_scratch(const unsigned char *password, size_t password_len, const unsigned char *salt, size_t salt_len, unsigned char Nfactor, unsigned char rfactor, unsigned char pfactor, unsigned char *out, size_t bytes, scrypt_scratchpad *sp);
+
+/*
+	Hashes `lanes` independent password/salt pairs in one interleaved pass when
+	the cpu has a multi-lane mix for that count (see scrypt_lanes_max), and one
+	after another otherwise. The scratchpad holds a V/YX set per lane.
+*/
+#define SCRYPT_MAX_LANES 8
+
+size_t scrypt_lanes_max();
+void scrypt_scratch_lanes(const unsigned char *const *password, size_t password_len, const unsigned char *const *salt, size_t salt_len, unsigned char Nfactor, unsigned char rfactor, unsigned char pfactor, unsigned char *const *out, size_t bytes, size_t lanes, scrypt_scratchpad *sp);
+
+/*
+	Benchmark hooks. scrypt_set_cpu_mask limits the cpu features the mixes, lane
+	counts and hashes are picked from ((size_t)-1 for all, 0 for portable code).
+	scrypt_cpu_masks fills in one mask per feature level this cpu has, strongest
+	first and 0 last. Changing the mask while hashing is not thread safe.
+*/
+void scrypt_set_cpu_mask(size_t mask);
+size_t scrypt_cpu_masks(size_t *masks, size_t max);
+
+/* one PBKDF2 pass as scrypt runs it around the mix, over `lanes` inputs of the same lengths */
+void scrypt_pbkdf2_stage(const unsigned char *const *password, size_t password_len, const unsigned char *const *salt, size_t salt_len, unsigned char *const *out, size_t bytes, size_t lanes);
+
 #endif /* SCRYPT_JANE_H */
@@ -40,6 +40,7 @@ extern "C" {
 
 #include "util.h"
 #include "net.h"
+#include "main.h"
 
 extern bool fShutdown;
 extern bool fGenerateBitcoins;
@@ -48,32 +49,85 @@ extern CBlockIndex* pindexBest;
 extern uint32_t nTransactionsUpdated;
 
 
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 #if defined(__x86_64__)
 
-//#define SCRYPT_3WAY
 // pennies: using scrypt-jane instead
-#define SCRYPT_BUFFER_SIZE (3 * 131072 + 63)
 
-extern "C" int scrypt_best_throughput();
 extern "C" void scrypt_core(uint32_t *X, uint32_t *V);
-extern "C" void scrypt_core_2way(uint32_t *X, uint32_t *Y, uint32_t *V);
-extern "C" void scrypt_core_3way(uint32_t *X, uint32_t *Y, uint32_t *Z, uint32_t *V);
 
 #elif defined(__i386__)
 
-#define SCRYPT_BUFFER_SIZE (131072 + 63)
-
 extern  "C" void scrypt_core(uint32_t *X, uint32_t *V);
 
 #endif
 
+// pennies: scratchpads are scrypt-jane V/YX buffers which are reused for
+// every following hash, and given back when a much smaller one will do
 void *scrypt_buffer_alloc() {
-    return malloc(SCRYPT_BUFFER_SIZE);
+    scrypt_scratchpad *sp = new scrypt_scratchpad;
+    scrypt_scratchpad_init(sp);
+    return sp;
 }
 
 void scrypt_buffer_free(void *scratchpad)
 {
-    free(scratchpad);
+    scrypt_scratchpad *sp = (scrypt_scratchpad *)scratchpad;
+    scrypt_scratchpad_free(sp);
+    delete sp;
+}
+
+const char *scrypt_buffer_pages(void *scratchpad)
+{
+    switch (((scrypt_scratchpad *)scratchpad)->pages)
+    {
+    case SCRYPT_PAGES_THP:       return "transparent huge";
+    case SCRYPT_PAGES_HUGETLB:   return "huge";
+    case SCRYPT_PAGES_HUGE_1GB:  return "1GB huge";
+    default:                     return "4K";
+    }
+}
+
+int64 scrypt_buffer_reserve(void *scratchpad, unsigned char Nfactor)
+{
+    scrypt_scratchpad *sp = (scrypt_scratchpad *)scratchpad;
+    size_t bytes = scrypt_scratchpad_bytes(Nfactor, 0, 0) * scrypt_lanes_max();
+    size_t nHeld = sp->size;
+
+    int64 nStart = GetTimeMicros();
+    scrypt_scratchpad_reserve(sp, bytes);
+    return sp->size == nHeld ? 0 : GetTimeMicros() - nStart;
+}
+
+unsigned char scrypt_nfactor_max()
+{
+    return GetNfactor(GetAdjustedTime() + nMaxClockDrift);
+}
+
+static void scrypt_thread_buffer_free(scrypt_scratchpad *sp)
+{
+    scrypt_buffer_free(sp);
+}
+
+static boost::thread_specific_ptr<scrypt_scratchpad> scratchThread(scrypt_thread_buffer_free);
+
+void *scrypt_buffer_thread()
+{
+    scrypt_scratchpad *sp = scratchThread.get();
+    if (!sp)
+    {
+        sp = (scrypt_scratchpad *)scrypt_buffer_alloc();
+        scratchThread.reset(sp);
+    }
+    return sp;
+}
+
+void scrypt_buffer_thread_release()
+{
+    scratchThread.reset();
 }
 
 /* cpu and memory intensive function to transform a 80 byte buffer into a 32 byte output
@@ -94,125 +148,278 @@ static void scrypt(const void* input, size_t inputlen, uint32_t *res, void *scra
     PBKDF2_SHA256((const uint8_t*)input, inputlen, (uint8_t *)X, 128, 1, (uint8_t*)res, 32);
 }
 
-void scrypt_hash(const void* input, size_t inputlen, uint32_t *res, unsigned char Nfactor)
+bool scrypt_hash(const void* input, size_t inputlen, uint32_t *res, unsigned char Nfactor)
 {
-    return scrypt((const unsigned char*)input, inputlen,
-                  (const unsigned char*)input, inputlen,
-                  Nfactor, 0, 0, (unsigned char*)res, 32);
+    // No block timestamped within the allowed drift hashes at this Nfactor,
+    // so don't let whoever sent the header size the scratchpad
+    if (Nfactor > scrypt_nfactor_max())
+    {
+        printf("scrypt_hash() : Nfactor %d above %d, not hashed\n", Nfactor, scrypt_nfactor_max());
+        memset(res, 0xff, 32);
+        return false;
+    }
+
+    scrypt_scratch((const unsigned char*)input, inputlen,
+                   (const unsigned char*)input, inputlen,
+                   Nfactor, 0, 0, (unsigned char*)res, 32,
+                   (scrypt_scratchpad *)scrypt_buffer_thread());
+    return true;
 }
 
-#ifdef SCRYPT_3WAY
-static void scrypt_2way(const void *input1, const void *input2, size_t input1len, size_t input2len, uint32_t *res1, uint32_t *res2, void *scratchpad)
+// pennies: nonces are hashed scrypt_lanes_max() at a time through the
+// widest multi-lane scrypt-jane mix the cpu supports, starting at
+// pdata->nonce and stopping at max_nonce so callers can scan in slices
+unsigned int scanhash_scrypt(block_header *pdata, void *scratchbuf,
+    uint32_t max_nonce, uint32_t &hash_count,
+    void *result, block_header *res_header, unsigned char Nfactor)
 {
-    uint32_t *V;
-    uint32_t X[32], Y[32];
-    V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+    hash_count = 0;
+    size_t nLanes = scrypt_lanes_max();
+    block_header data[SCRYPT_MAX_LANES];
+    uint32_t hash[SCRYPT_MAX_LANES][8];
+    const unsigned char *input[SCRYPT_MAX_LANES];
+    unsigned char *output[SCRYPT_MAX_LANES];
+
+    for (size_t i = 0; i < nLanes; i++)
+    {
+        data[i] = *pdata;
+        input[i] = (const unsigned char *)&data[i];
+        output[i] = (unsigned char *)hash[i];
+    }
 
-    PBKDF2_SHA256((const uint8_t*)input1, input1len, (const uint8_t*)input1, input1len, 1, (uint8_t *)X, 128);
-    PBKDF2_SHA256((const uint8_t*)input2, input2len, (const uint8_t*)input2, input2len, 1, (uint8_t *)Y, 128);
+    uint32_t n = pdata->nonce;
 
-    scrypt_core_2way(X, Y, V);
+    while (true) {
 
-    PBKDF2_SHA256((const uint8_t*)input1, input1len, (uint8_t *)X, 128, 1, (uint8_t*)res1, 32);
-    PBKDF2_SHA256((const uint8_t*)input2, input2len, (uint8_t *)Y, 128, 1, (uint8_t*)res2, 32);
-}
+        for (size_t i = 0; i < nLanes; i++)
+            data[i].nonce = n++;
 
-static void scrypt_3way(const void *input1, const void *input2, const void *input3,
-   size_t input1len, size_t input2len, size_t input3len, uint32_t *res1, uint32_t *res2, uint32_t *res3,
-   void *scratchpad)
-{
-    uint32_t *V;
-    uint32_t X[32], Y[32], Z[32];
-    V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+        scrypt_scratch_lanes(input, 80, input, 80,
+                             Nfactor, 0, 0, output, 32, nLanes,
+                             (scrypt_scratchpad *)scratchbuf);
+        hash_count += nLanes;
 
-    PBKDF2_SHA256((const uint8_t*)input1, input1len, (const uint8_t*)input1, input1len, 1, (uint8_t *)X, 128);
-    PBKDF2_SHA256((const uint8_t*)input2, input2len, (const uint8_t*)input2, input2len, 1, (uint8_t *)Y, 128);
-    PBKDF2_SHA256((const uint8_t*)input3, input3len, (const uint8_t*)input3, input3len, 1, (uint8_t *)Z, 128);
+        for (size_t i = 0; i < nLanes; i++)
+        {
+            unsigned char *hashc = (unsigned char *) &hash[i];
+            if (hashc[31] == 0 && hashc[30] == 0) {
+                memcpy(result, hash[i], 32);
+                *res_header = data[i];
 
-    scrypt_core_3way(X, Y, Z, V);
+                return data[i].nonce;
+            }
+        }
 
-    PBKDF2_SHA256((const uint8_t*)input1, input1len, (uint8_t *)X, 128, 1, (uint8_t*)res1, 32);
-    PBKDF2_SHA256((const uint8_t*)input2, input2len, (uint8_t *)Y, 128, 1, (uint8_t*)res2, 32);
-    PBKDF2_SHA256((const uint8_t*)input3, input3len, (uint8_t *)Z, 128, 1, (uint8_t*)res3, 32);
-}
-#endif
+        if (n >= max_nonce)
+            break;
+    }
 
-unsigned int scanhash_scrypt(block_header *pdata,
-    uint32_t max_nonce, uint32_t &hash_count,
-    void *result, block_header *res_header, unsigned char Nfactor)
-{
-    hash_count = 0;
-    block_header data = *pdata;
-    uint32_t hash[8];
-    unsigned char *hashc = (unsigned char *) &hash;
+    return (unsigned int) -1;
+}
 
-#ifdef SCRYPT_3WAY
-    block_header data2 = *pdata;
-    uint32_t hash2[8];
-    unsigned char *hashc2 = (unsigned char *) &hash2;
+// pennies: block header hashes worked out ahead of time. Headers from the
+// "headers" sync and from "block" messages still queued behind the one being
+// processed are hashed on -scryptthreads workers, so CBlock::GetHash finds
+// most hashes ready instead of running scrypt under cs_main one at a time.
+// Entries are keyed by the SHA256d of the 80 header bytes, so a result can
+// only be picked up by a header identical to the one that was hashed.
 
-    block_header data3 = *pdata;
-    uint32_t hash3[8];
-    unsigned char *hashc3 = (unsigned char *) &hash3;
+enum
+{
+    PREHASH_QUEUED,
+    PREHASH_RUNNING,
+    PREHASH_DONE,
+};
 
-    int throughput = scrypt_best_throughput();
-#endif
+class CPrehashEntry
+{
+public:
+    int nState;
+    uint256 hash;
 
-    uint32_t n = 0;
+    CPrehashEntry() : nState(PREHASH_QUEUED), hash(0) {}
+};
 
-    while (true) {
+class CPrehashJob
+{
+public:
+    uint256 key;
+    block_header header;
+    unsigned char Nfactor;
+};
+
+static const unsigned int MAX_PREHASH_JOBS = 4096;
+// Headers are queued before any validation and their sender picks nTime, so
+// only Nfactors up to this far above the best block's are hashed ahead
+static const int PREHASH_NFACTOR_MARGIN = 1;
+static const unsigned int MAX_PREHASH_ENTRIES = 16384;
+// Workers free their scratchpad after this many seconds without work
+static const int64 PREHASH_IDLE_RELEASE = 60;
+
+static boost::mutex mutexPrehash;
+static boost::condition_variable condPrehash;
+static std::deque<CPrehashJob> dequePrehashJobs;
+static std::map<uint256, CPrehashEntry> mapPrehash;
+static std::deque<uint256> dequePrehashOrder;
+static int nPrehashThreads = 0;
+
+static uint256 scrypt_prehash_key(const block_header *pheader)
+{
+    return Hash(BEGIN(*pheader), END(*pheader));
+}
 
-        data.nonce = n++;
+static void scrypt_prehash_store(const uint256& key, const uint256& hash)
+{
+    boost::mutex::scoped_lock lock(mutexPrehash);
+    std::map<uint256, CPrehashEntry>::iterator mi = mapPrehash.find(key);
+    if (mi != mapPrehash.end())
+    {
+        mi->second.nState = PREHASH_DONE;
+        mi->second.hash = hash;
+    }
+    condPrehash.notify_all();
+}
 
-#ifdef SCRYPT_3WAY
-        if (throughput >= 2 && n < max_nonce) {
-            data2.nonce = n++;
-            if(throughput >= 3)
+static void ThreadScryptPrehash2(void* parg)
+{
+    int64 nIdleSince = GetTime();
+    bool fScratchHeld = false;
+    while (!fShutdown)
+    {
+        CPrehashJob job;
+        {
+            boost::mutex::scoped_lock lock(mutexPrehash);
+            // Skip jobs evicted meanwhile or already taken over by a lookup
+            while (!dequePrehashJobs.empty())
             {
-                data3.nonce = n++;
-                scrypt_3way(&data, &data2, &data3, 80, 80, 80, hash, hash2, hash3, scratchbuf);
-                hash_count += 3;
-
-                if (hashc3[31] == 0 && hashc3[30] == 0) {
-                    memcpy(result, hash3, 32);
-                    *res_header = data3;
-
-                    return data3.nonce;
-                }
+                std::map<uint256, CPrehashEntry>::iterator mi = mapPrehash.find(dequePrehashJobs.front().key);
+                if (mi != mapPrehash.end() && mi->second.nState == PREHASH_QUEUED)
+                    break;
+                dequePrehashJobs.pop_front();
             }
-            else
+            if (dequePrehashJobs.empty())
             {
-                scrypt_2way(&data, &data2, 80, 80, hash, hash2, scratchbuf);
-                hash_count += 2;
+                vnThreadsRunning[THREAD_SCRYPTHASH]--;
+                condPrehash.timed_wait(lock, boost::posix_time::seconds(1));
+                vnThreadsRunning[THREAD_SCRYPTHASH]++;
+                if (fScratchHeld && GetTime() - nIdleSince > PREHASH_IDLE_RELEASE)
+                {
+                    scrypt_buffer_thread_release();
+                    fScratchHeld = false;
+                }
+                continue;
             }
+            job = dequePrehashJobs.front();
+            dequePrehashJobs.pop_front();
+            mapPrehash[job.key].nState = PREHASH_RUNNING;
+        }
+
+        uint256 hash;
+        scrypt_hash(&job.header, sizeof(job.header), UINTBEGIN(hash), job.Nfactor);
+        scrypt_prehash_store(job.key, hash);
+        fScratchHeld = true;
+        nIdleSince = GetTime();
+    }
+}
 
-            if (hashc2[31] == 0 && hashc2[30] == 0) {
-                memcpy(result, hash2, 32);
+static void ThreadScryptPrehash(void* parg)
+{
+    // Make this thread recognisable as a block hashing thread
+    RenameThread("pennies-prehash");
+
+    try
+    {
+        vnThreadsRunning[THREAD_SCRYPTHASH]++;
+        ThreadScryptPrehash2(parg);
+        vnThreadsRunning[THREAD_SCRYPTHASH]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_SCRYPTHASH]--;
+        PrintException(&e, "ThreadScryptPrehash()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_SCRYPTHASH]--;
+        PrintException(NULL, "ThreadScryptPrehash()");
+    }
+    printf("ThreadScryptPrehash exited\n");
+}
 
-                return data2.nonce;
-            }
-        } else {
-            scrypt(&data, 80, hash, scratchbuf);
-            hash_count += 1;
+void scrypt_prehash_start(int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+    {
+        if (!NewThread(ThreadScryptPrehash, NULL))
+        {
+            printf("Error: NewThread(ThreadScryptPrehash) failed\n");
+            break;
         }
-#else
-        //scrypt(&data, 80, hash, scratchbuf);
-        scrypt((const unsigned char*)&data, 80,
-               (const unsigned char*)&data, 80,
-               Nfactor, 0, 0, (unsigned char*)hash, 32);
-        hash_count += 1;
-#endif
-        if (hashc[31] == 0 && hashc[30] == 0) {
-            memcpy(result, hash, 32);
+        nPrehashThreads++;
+    }
+    printf("Hashing block headers ahead on %d threads\n", nPrehashThreads);
+}
 
-            return data.nonce;
-        }
+void scrypt_prehash(const block_header *pheader, unsigned char Nfactor)
+{
+    if (nPrehashThreads == 0)
+        return;
+    if ((int64)pheader->timestamp > GetAdjustedTime() + nMaxClockDrift)
+        return;
+    if (pindexBest && Nfactor > GetNfactor(pindexBest->GetBlockTime()) + PREHASH_NFACTOR_MARGIN)
+        return;
+
+    CPrehashJob job;
+    job.key = scrypt_prehash_key(pheader);
+    job.header = *pheader;
+    job.Nfactor = Nfactor;
+
+    boost::mutex::scoped_lock lock(mutexPrehash);
+    if (mapPrehash.count(job.key) || dequePrehashJobs.size() >= MAX_PREHASH_JOBS)
+        return;
+    mapPrehash[job.key] = CPrehashEntry();
+    dequePrehashOrder.push_back(job.key);
+    // Oldest entries go first; a worker still hashing one drops its result
+    while (dequePrehashOrder.size() > MAX_PREHASH_ENTRIES)
+    {
+        mapPrehash.erase(dequePrehashOrder.front());
+        dequePrehashOrder.pop_front();
+    }
+    dequePrehashJobs.push_back(job);
+    condPrehash.notify_one();
+}
 
-        if (n >= max_nonce) {
-            hash_count = 0xffff + 1;
-            break;
+bool scrypt_prehash_lookup(const block_header *pheader, unsigned char Nfactor, uint32_t *res)
+{
+    if (nPrehashThreads == 0)
+        return false;
+
+    uint256 key = scrypt_prehash_key(pheader);
+    {
+        boost::mutex::scoped_lock lock(mutexPrehash);
+        std::map<uint256, CPrehashEntry>::iterator mi = mapPrehash.find(key);
+        if (mi == mapPrehash.end())
+            return false;
+        if (mi->second.nState == PREHASH_RUNNING)
+        {
+            // A worker is part way through it, waiting beats starting over
+            while (mi != mapPrehash.end() && mi->second.nState == PREHASH_RUNNING && !fShutdown)
+            {
+                condPrehash.timed_wait(lock, boost::posix_time::milliseconds(100));
+                mi = mapPrehash.find(key);
+            }
+            if (mi == mapPrehash.end() || mi->second.nState != PREHASH_DONE)
+                return false;
         }
+        if (mi->second.nState == PREHASH_DONE)
+        {
+            memcpy(res, mi->second.hash.begin(), 32);
+            return true;
+        }
+        // Still queued: hash it here and let the workers carry on with the rest
+        mi->second.nState = PREHASH_RUNNING;
     }
 
-    return (unsigned int) -1;
+    scrypt_hash(pheader, sizeof(*pheader), res, Nfactor);
+    uint256 hash;
+    memcpy(hash.begin(), res, 32);
+    scrypt_prehash_store(key, hash);
+    return true;
 }
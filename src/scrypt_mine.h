@@ -20,11 +20,33 @@ typedef struct
 
 void *scrypt_buffer_alloc();
 void scrypt_buffer_free(void *scratchpad);
-
-unsigned int scanhash_scrypt(block_header *pdata,
+// Scratchpad owned by the calling thread, released when the thread exits
+void *scrypt_buffer_thread();
+// Free the calling thread's scratchpad now instead of at thread exit
+void scrypt_buffer_thread_release();
+// Kind of pages currently backing a scratchpad, for the hashmeter
+const char *scrypt_buffer_pages(void *scratchpad);
+// Size a scratchpad for scanhash_scrypt at Nfactor, returns the microseconds
+// spent allocating (0 when it was kept)
+int64 scrypt_buffer_reserve(void *scratchpad, unsigned char Nfactor);
+// Largest Nfactor scrypt_hash accepts: the one of a block timestamped at the
+// furthest future time CheckBlock allows
+unsigned char scrypt_nfactor_max();
+
+unsigned int scanhash_scrypt(block_header *pdata, void *scratchbuf,
     uint32_t max_nonce, uint32_t &hash_count,
     void *result, block_header *res_header, unsigned char Nfactor);
 
-void scrypt_hash(const void* input, size_t inputlen, uint32_t *res, unsigned char Nfactor);
+// false, with an all ones hash that meets no target, above scrypt_nfactor_max()
+bool scrypt_hash(const void* input, size_t inputlen, uint32_t *res, unsigned char Nfactor);
+
+// Block header hashing ahead of time on worker threads
+void scrypt_prehash_start(int nThreads);
+// Queue a header for the workers, no-op when it is already known or queued,
+// timestamped beyond the allowed drift or above the best block's Nfactor
+void scrypt_prehash(const block_header *pheader, unsigned char Nfactor);
+// Hash of a queued header: taken from the workers, waited for while one is
+// hashing it, or computed here if still queued. false if it was never queued
+bool scrypt_prehash_lookup(const block_header *pheader, unsigned char Nfactor, uint32_t *res);
 
 #endif // SCRYPT_MINE_H
@@ -0,0 +1,1126 @@
+// Copyright (c) 2013 Pennies developers and contributors
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// ECDSA verification specialised to secp256k1: 4x64 bit field and scalar
+// elements reduced with the special form of p and n, the GLV endomorphism
+// (lambda*(x,y) = (beta*x,y)) to halve the doublings, and a table of odd
+// multiples of G built once. The point multiplication of verification is
+// variable time, it only sees public data.
+//
+// Signing uses the same field and scalar arithmetic, which is constant time,
+// a fixed-base comb for kG that reads whole table rows, and RFC 6979 nonces.
+//
+
+#include "secp256k1.h"
+#include "pbkdf2.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SIZEOF_INT128__)
+
+typedef unsigned __int128 uint128_t;
+
+// p = 2^256 - SECP_P_C, n = 2^256 - SECP_N_C
+static const uint64_t SECP_P_C = 0x1000003D1ULL;
+static const uint64_t SECP_P[4] = {0xfffffffefffffc2fULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL};
+static const uint64_t SECP_P_MINUS_2[4] = {0xfffffffefffffc2dULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL};
+static const uint64_t SECP_P_SQRT[4] = {0xffffffffbfffff0cULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0x3fffffffffffffffULL};
+static const uint64_t SECP_N[4] = {0xbfd25e8cd0364141ULL, 0xbaaedce6af48a03bULL, 0xfffffffffffffffeULL, 0xffffffffffffffffULL};
+static const uint64_t SECP_N_MINUS_2[4] = {0xbfd25e8cd036413fULL, 0xbaaedce6af48a03bULL, 0xfffffffffffffffeULL, 0xffffffffffffffffULL};
+static const uint64_t SECP_N_HALF[4] = {0xdfe92f46681b20a0ULL, 0x5d576e7357a4501dULL, 0xffffffffffffffffULL, 0x7fffffffffffffffULL};
+static const uint64_t SECP_N_C[3] = {0x402da1732fc9bebfULL, 0x4551231950b75fc4ULL, 0x0000000000000001ULL};
+static const uint64_t SECP_P_MINUS_N[4] = {0x402da1722fc9baeeULL, 0x4551231950b75fc4ULL, 0x0000000000000001ULL, 0x0000000000000000ULL};
+static const uint64_t SECP_GX[4] = {0x59f2815b16f81798ULL, 0x029bfcdb2dce28d9ULL, 0x55a06295ce870b07ULL, 0x79be667ef9dcbbacULL};
+static const uint64_t SECP_GY[4] = {0x9c47d08ffb10d4b8ULL, 0xfd17b448a6855419ULL, 0x5da4fbfc0e1108a8ULL, 0x483ada7726a3c465ULL};
+
+// Endomorphism: beta is a cube root of unity mod p, lambda the matching one
+// mod n. A scalar k splits into k1 + k2*lambda with k1, k2 of 128 bits using
+// the reduced lattice basis (a1, b1), (a2, b2) and g = round(2^384 * b / n).
+static const uint64_t SECP_BETA[4] = {0xc1396c28719501eeULL, 0x9cf0497512f58995ULL, 0x6e64479eac3434e9ULL, 0x7ae96a2b657c0710ULL};
+static const uint64_t SECP_MINUS_LAMBDA[4] = {0xe0cfc810b51283cfULL, 0xa880b9fc8ec739c2ULL, 0x5ad9e3fd77ed9ba4ULL, 0xac9c52b33fa3cf1fULL};
+static const uint64_t SECP_MINUS_B1[4] = {0x6f547fa90abfe4c3ULL, 0xe4437ed6010e8828ULL, 0x0000000000000000ULL, 0x0000000000000000ULL};
+static const uint64_t SECP_MINUS_B2[4] = {0xd765cda83db1562cULL, 0x8a280ac50774346dULL, 0xfffffffffffffffeULL, 0xffffffffffffffffULL};
+static const uint64_t SECP_G1[4] = {0xe893209a45dbb031ULL, 0x3daa8a1471e8ca7fULL, 0xe86c90e49284eb15ULL, 0x3086d221a7d46bcdULL};
+static const uint64_t SECP_G2[4] = {0x1571b4ae8ac47f71ULL, 0x221208ac9df506c6ULL, 0x6f547fa90abfe4c4ULL, 0xe4437ed6010e8828ULL};
+
+// wNAF windows: odd multiples 1..2^(w-1)-1 of the public key are computed per
+// verification, those of G once
+static const int WINDOW_A = 5;
+static const int WINDOW_G = 12;
+static const int TABLE_SIZE_A = 1 << (WINDOW_A - 2);
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+// Digits of a 128 bit scalar, with room for the carries
+static const int WNAF_MAX = 132;
+
+// r = a - b, returns the borrow
+static uint64_t LimbsSub(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t t = (uint128_t)a[i] - b[i] - borrow;
+        r[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+    return borrow;
+}
+
+// The borrow of a - b, so no early exit on the first differing limb
+static bool LimbsLess(const uint64_t* a, const uint64_t* b)
+{
+    uint64_t t[4];
+    return LimbsSub(t, a, b) != 0;
+}
+
+static bool LimbsZero(const uint64_t* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+// Zeroes secrets, through a volatile pointer so the stores are not dropped
+static void SecureClear(void* p, size_t nLen)
+{
+    volatile unsigned char* pch = (volatile unsigned char*)p;
+    while (nLen--)
+        *pch++ = 0;
+}
+
+// r = mask ? a : r, mask all ones or zero
+static void LimbsCmov(uint64_t* r, const uint64_t* a, uint64_t mask)
+{
+    for (int i = 0; i < 4; i++)
+        r[i] = (r[i] & ~mask) | (a[i] & mask);
+}
+
+static void LimbsSetB32(uint64_t* r, const unsigned char* b32)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        r[3 - i] = 0;
+        for (int j = 0; j < 8; j++)
+            r[3 - i] = (r[3 - i] << 8) | b32[i * 8 + j];
+    }
+}
+
+// r = a + b, returns the carry
+static uint64_t LimbsAdd(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+    uint128_t c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128_t)a[i] + b[i];
+        r[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    return (uint64_t)c;
+}
+
+// r += a, returns the carry, carried through every limb whatever the values
+static uint64_t LimbsAddInt(uint64_t* r, uint64_t a)
+{
+    uint128_t c = a;
+    for (int i = 0; i < 4; i++)
+    {
+        c += r[i];
+        r[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    return (uint64_t)c;
+}
+
+// r -= a, returns the borrow
+static uint64_t LimbsSubInt(uint64_t* r, uint64_t a)
+{
+    uint64_t borrow = a;
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t t = (uint128_t)r[i] - borrow;
+        r[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+    return borrow;
+}
+
+// w[0..7] = a * b
+static void LimbsMul(uint64_t* w, const uint64_t* a, const uint64_t* b)
+{
+    memset(w, 0, 8 * sizeof(uint64_t));
+    for (int i = 0; i < 4; i++)
+    {
+        uint128_t c = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            c += (uint128_t)a[i] * b[j] + w[i + j];
+            w[i + j] = (uint64_t)c;
+            c >>= 64;
+        }
+        w[i + 4] = (uint64_t)c;
+    }
+}
+
+
+//
+// Field elements mod p, kept below 2^256 but not necessarily below p. The
+// arithmetic has no branches or memory accesses that depend on the values,
+// the signer runs it on secrets.
+//
+
+struct CSecpFe
+{
+    uint64_t n[4];
+};
+
+static void FeSetLimbs(CSecpFe& r, const uint64_t* a)
+{
+    memcpy(r.n, a, sizeof(r.n));
+}
+
+static void FeSetInt(CSecpFe& r, uint64_t a)
+{
+    r.n[0] = a;
+    r.n[1] = r.n[2] = r.n[3] = 0;
+}
+
+static void FeNormalize(CSecpFe& r)
+{
+    // Below 2^256 < 2p, so at most one p to take off
+    uint64_t t[4];
+    uint64_t borrow = LimbsSub(t, r.n, SECP_P);
+    LimbsCmov(r.n, t, borrow - 1);
+}
+
+static void FeAdd(CSecpFe& r, const CSecpFe& a, const CSecpFe& b)
+{
+    // Adding 2^256 is adding SECP_P_C mod p. A wrapped 2^256 comes back as
+    // SECP_P_C; a second wrap leaves a small value that can take it without
+    // wrapping again.
+    uint64_t carry = LimbsAdd(r.n, a.n, b.n);
+    carry = LimbsAddInt(r.n, carry * SECP_P_C);
+    LimbsAddInt(r.n, carry * SECP_P_C);
+}
+
+static void FeSub(CSecpFe& r, const CSecpFe& a, const CSecpFe& b)
+{
+    uint64_t borrow = LimbsSub(r.n, a.n, b.n);
+    borrow = LimbsSubInt(r.n, borrow * SECP_P_C);
+    LimbsSubInt(r.n, borrow * SECP_P_C);
+}
+
+static void FeNegate(CSecpFe& r, const CSecpFe& a)
+{
+    CSecpFe zero;
+    FeSetInt(zero, 0);
+    FeSub(r, zero, a);
+}
+
+// r = w mod p for a 512 bit w
+static void FeReduce(CSecpFe& r, const uint64_t* w)
+{
+    uint128_t c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128_t)w[4 + i] * SECP_P_C + w[i];
+        r.n[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    c = c * SECP_P_C + r.n[0];
+    r.n[0] = (uint64_t)c;
+    c >>= 64;
+    for (int i = 1; i < 4; i++)
+    {
+        c += r.n[i];
+        r.n[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    LimbsAddInt(r.n, (uint64_t)c * SECP_P_C);
+}
+
+static void FeMul(CSecpFe& r, const CSecpFe& a, const CSecpFe& b)
+{
+    uint64_t w[8];
+    LimbsMul(w, a.n, b.n);
+    FeReduce(r, w);
+}
+
+static void FeSqr(CSecpFe& r, const CSecpFe& a)
+{
+    FeMul(r, a, a);
+}
+
+static void FeMulInt(CSecpFe& r, const CSecpFe& a, uint64_t b)
+{
+    uint64_t w[8] = {0};
+    uint128_t c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        c += (uint128_t)a.n[i] * b;
+        w[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    w[4] = (uint64_t)c;
+    FeReduce(r, w);
+}
+
+static bool FeIsZero(const CSecpFe& a)
+{
+    CSecpFe t = a;
+    FeNormalize(t);
+    return LimbsZero(t.n);
+}
+
+static bool FeEqual(const CSecpFe& a, const CSecpFe& b)
+{
+    CSecpFe t;
+    FeSub(t, a, b);
+    return FeIsZero(t);
+}
+
+// r = a^e, four exponent bits at a time
+static void FePow(CSecpFe& r, const CSecpFe& a, const uint64_t* e)
+{
+    CSecpFe table[16];
+    FeSetInt(table[0], 1);
+    table[1] = a;
+    for (int i = 2; i < 16; i++)
+        FeMul(table[i], table[i - 1], a);
+    FeSetInt(r, 1);
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            FeSqr(r, r);
+        FeMul(r, r, table[(e[i / 16] >> ((i % 16) * 4)) & 15]);
+    }
+}
+
+static void FeInv(CSecpFe& r, const CSecpFe& a)
+{
+    FePow(r, a, SECP_P_MINUS_2);
+}
+
+// False if a has no square root
+static bool FeSqrt(CSecpFe& r, const CSecpFe& a)
+{
+    CSecpFe t;
+    FePow(r, a, SECP_P_SQRT);
+    FeSqr(t, r);
+    return FeEqual(t, a);
+}
+
+
+//
+// Scalars mod n, always below n. Reduction, addition and multiplication are
+// constant time like the field arithmetic.
+//
+
+struct CSecpScalar
+{
+    uint64_t d[4];
+};
+
+// r = w mod n for w of up to 8 limbs
+static void ScalarReduce(CSecpScalar& r, uint64_t* w)
+{
+    // Fold the top half down as hi * (2^256 - n). Each fold shrinks it to
+    // below 2^130, 2^3, 2 and then 0, whatever w was.
+    for (int nFold = 0; nFold < 4; nFold++)
+    {
+        uint64_t t[8] = {0};
+        for (int i = 0; i < 4; i++)
+        {
+            uint128_t c = 0;
+            for (int j = 0; j < 3; j++)
+            {
+                c += (uint128_t)w[4 + i] * SECP_N_C[j] + t[i + j];
+                t[i + j] = (uint64_t)c;
+                c >>= 64;
+            }
+            for (int k = i + 3; k < 8; k++)
+            {
+                c += t[k];
+                t[k] = (uint64_t)c;
+                c >>= 64;
+            }
+        }
+        uint128_t c = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            c += (uint128_t)t[i] + (i < 4 ? w[i] : 0);
+            w[i] = (uint64_t)c;
+            c >>= 64;
+        }
+    }
+    // Below 2^256 < 2n
+    uint64_t t[4];
+    memcpy(r.d, w, sizeof(r.d));
+    uint64_t borrow = LimbsSub(t, r.d, SECP_N);
+    LimbsCmov(r.d, t, borrow - 1);
+}
+
+// False if b32 is not below n
+static bool ScalarSetB32(CSecpScalar& r, const unsigned char* b32)
+{
+    LimbsSetB32(r.d, b32);
+    return LimbsLess(r.d, SECP_N);
+}
+
+// b32 taken mod n, as ECDSA does with the digest
+static void ScalarSetB32Reduce(CSecpScalar& r, const unsigned char* b32)
+{
+    if (!ScalarSetB32(r, b32))
+        LimbsSub(r.d, r.d, SECP_N);
+}
+
+static void ScalarAdd(CSecpScalar& r, const CSecpScalar& a, const CSecpScalar& b)
+{
+    uint64_t t[4];
+    uint64_t carry = LimbsAdd(r.d, a.d, b.d);
+    uint64_t borrow = LimbsSub(t, r.d, SECP_N);
+    LimbsCmov(r.d, t, 0 - (carry | (borrow ^ 1)));
+}
+
+static void ScalarMul(CSecpScalar& r, const CSecpScalar& a, const CSecpScalar& b)
+{
+    uint64_t w[8];
+    LimbsMul(w, a.d, b.d);
+    ScalarReduce(r, w);
+}
+
+static void ScalarNegate(CSecpScalar& r, const CSecpScalar& a)
+{
+    if (LimbsZero(a.d))
+        r = a;
+    else
+        LimbsSub(r.d, SECP_N, a.d);
+}
+
+static bool ScalarIsHigh(const CSecpScalar& a)
+{
+    return LimbsLess(SECP_N_HALF, a.d);
+}
+
+static void ScalarInv(CSecpScalar& r, const CSecpScalar& a)
+{
+    CSecpScalar table[16];
+    memset(table[0].d, 0, sizeof(table[0].d));
+    table[0].d[0] = 1;
+    table[1] = a;
+    for (int i = 2; i < 16; i++)
+        ScalarMul(table[i], table[i - 1], a);
+    r = table[0];
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            ScalarMul(r, r, r);
+        ScalarMul(r, r, table[(SECP_N_MINUS_2[i / 16] >> ((i % 16) * 4)) & 15]);
+    }
+}
+
+// round(a * g / 2^384)
+static void ScalarMulShift384(CSecpScalar& r, const CSecpScalar& a, const uint64_t* g)
+{
+    uint64_t w[8];
+    LimbsMul(w, a.d, g);
+    uint128_t c = (uint128_t)w[6] + (w[5] >> 63);
+    r.d[0] = (uint64_t)c;
+    r.d[1] = w[7] + (uint64_t)(c >> 64);
+    r.d[2] = r.d[3] = 0;
+}
+
+// k = k1 + k2 * lambda mod n, with k1 and k2 of at most 128 bits when negated if high
+static void ScalarSplitLambda(CSecpScalar& k1, CSecpScalar& k2, const CSecpScalar& k)
+{
+    CSecpScalar c1, c2, t;
+    ScalarMulShift384(c1, k, SECP_G1);
+    ScalarMulShift384(c2, k, SECP_G2);
+    memcpy(t.d, SECP_MINUS_B1, sizeof(t.d));
+    ScalarMul(c1, c1, t);
+    memcpy(t.d, SECP_MINUS_B2, sizeof(t.d));
+    ScalarMul(c2, c2, t);
+    ScalarAdd(k2, c1, c2);
+    memcpy(t.d, SECP_MINUS_LAMBDA, sizeof(t.d));
+    ScalarMul(k1, k2, t);
+    ScalarAdd(k1, k1, k);
+}
+
+// Width w non-adjacent form of a scalar below 2^129, returns the number of digits
+static int ScalarWnaf(int* pnDigits, const CSecpScalar& a, int w)
+{
+    uint64_t k[4];
+    memcpy(k, a.d, sizeof(k));
+    int nLen = 0;
+    while (!LimbsZero(k))
+    {
+        int nDigit = 0;
+        if (k[0] & 1)
+        {
+            nDigit = (int)(k[0] & ((1 << w) - 1));
+            if (nDigit >= (1 << (w - 1)))
+                nDigit -= (1 << w);
+            // k -= nDigit clears the low w bits
+            uint64_t d[4] = {(uint64_t)(nDigit < 0 ? -nDigit : nDigit), 0, 0, 0};
+            if (nDigit < 0)
+                LimbsAdd(k, k, d);
+            else
+                LimbsSub(k, k, d);
+        }
+        pnDigits[nLen++] = nDigit;
+        for (int i = 0; i < 3; i++)
+            k[i] = (k[i] >> 1) | (k[i + 1] << 63);
+        k[3] >>= 1;
+    }
+    return nLen;
+}
+
+
+//
+// Points: affine and Jacobian (x = X/Z^2, y = Y/Z^3) on y^2 = x^3 + 7
+//
+
+struct CSecpGe
+{
+    CSecpFe x, y;
+};
+
+struct CSecpGej
+{
+    CSecpFe x, y, z;
+    bool fInfinity;
+};
+
+static void GejSetGe(CSecpGej& r, const CSecpGe& a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+static bool GeIsValid(const CSecpGe& a)
+{
+    CSecpFe y2, x3, seven;
+    FeSqr(y2, a.y);
+    FeSqr(x3, a.x);
+    FeMul(x3, x3, a.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+// dbl-2009-l
+static void GejDouble(CSecpGej& r, const CSecpGej& a)
+{
+    if (a.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    CSecpFe A, B, C, D, E, F, t;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(D, t);
+    FeSub(D, D, A);
+    FeSub(D, D, C);
+    FeAdd(D, D, D);
+    FeMulInt(E, A, 3);
+    FeSqr(F, E);
+    FeMul(r.z, a.y, a.z);
+    FeAdd(r.z, r.z, r.z);
+    FeSub(r.x, F, D);
+    FeSub(r.x, r.x, D);
+    FeSub(t, D, r.x);
+    FeMul(r.y, E, t);
+    FeMulInt(C, C, 8);
+    FeSub(r.y, r.y, C);
+    r.fInfinity = false;
+}
+
+// add-2007-bl
+static void GejAdd(CSecpGej& r, const CSecpGej& a, const CSecpGej& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+    CSecpFe z1z1, z2z2, u1, u2, s1, s2, h, i, j, rr, v, t;
+    FeSqr(z1z1, a.z);
+    FeSqr(z2z2, b.z);
+    FeMul(u1, a.x, z2z2);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s1, a.y, b.z);
+    FeMul(s1, s1, z2z2);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, u1);
+    FeSub(rr, s2, s1);
+    if (FeIsZero(h))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeAdd(rr, rr, rr);
+    FeAdd(i, h, h);
+    FeSqr(i, i);
+    FeMul(j, h, i);
+    FeMul(v, u1, i);
+    FeAdd(t, a.z, b.z);
+    FeSqr(t, t);
+    FeSub(t, t, z1z1);
+    FeSub(t, t, z2z2);
+    FeMul(r.z, t, h);
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, j);
+    FeSub(r.x, r.x, v);
+    FeSub(r.x, r.x, v);
+    FeSub(t, v, r.x);
+    FeMul(t, rr, t);
+    FeMul(s1, s1, j);
+    FeAdd(s1, s1, s1);
+    FeSub(r.y, t, s1);
+    r.fInfinity = false;
+}
+
+// madd-2007-bl, first half: h = u2 - x1 and rr = s2 - y1
+static void GejAddGeStart(CSecpFe& z1z1, CSecpFe& h, CSecpFe& rr, const CSecpGej& a, const CSecpGe& b)
+{
+    CSecpFe u2, s2;
+    FeSqr(z1z1, a.z);
+    FeMul(u2, b.x, z1z1);
+    FeMul(s2, b.y, a.z);
+    FeMul(s2, s2, z1z1);
+    FeSub(h, u2, a.x);
+    FeSub(rr, s2, a.y);
+}
+
+// madd-2007-bl, second half, for h not zero (b is not a or -a)
+static void GejAddGeFinish(CSecpGej& r, const CSecpGej& a, const CSecpFe& z1z1, const CSecpFe& h, CSecpFe& rr)
+{
+    CSecpFe hh, i, j, v, t;
+    FeAdd(rr, rr, rr);
+    FeSqr(hh, h);
+    FeMulInt(i, hh, 4);
+    FeMul(j, h, i);
+    FeMul(v, a.x, i);
+    FeAdd(t, a.z, h);
+    FeSqr(t, t);
+    FeSub(t, t, z1z1);
+    FeSub(r.z, t, hh);
+    CSecpFe y1 = a.y;
+    FeSqr(r.x, rr);
+    FeSub(r.x, r.x, j);
+    FeSub(r.x, r.x, v);
+    FeSub(r.x, r.x, v);
+    FeSub(t, v, r.x);
+    FeMul(t, rr, t);
+    FeMul(y1, y1, j);
+    FeAdd(y1, y1, y1);
+    FeSub(r.y, t, y1);
+    r.fInfinity = false;
+}
+
+static void GejAddGe(CSecpGej& r, const CSecpGej& a, const CSecpGe& b)
+{
+    if (a.fInfinity)
+    {
+        GejSetGe(r, b);
+        return;
+    }
+    CSecpFe z1z1, h, rr;
+    GejAddGeStart(z1z1, h, rr, a, b);
+    if (FeIsZero(h))
+    {
+        if (FeIsZero(rr))
+            GejDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    GejAddGeFinish(r, a, z1z1, h, rr);
+}
+
+// Without the special cases, so without branches on the points: a must not
+// be infinity, b or -b
+static void GejAddGeConst(CSecpGej& r, const CSecpGej& a, const CSecpGe& b)
+{
+    CSecpFe z1z1, h, rr;
+    GejAddGeStart(z1z1, h, rr, a, b);
+    GejAddGeFinish(r, a, z1z1, h, rr);
+}
+
+// Affine versions of points that are not infinity, sharing one inversion.
+// The running products of the z are kept in r[i].x until r[i] is written.
+static void GeSetGejBatch(CSecpGe* r, const CSecpGej* a, int nCount)
+{
+    r[0].x = a[0].z;
+    for (int i = 1; i < nCount; i++)
+        FeMul(r[i].x, r[i - 1].x, a[i].z);
+    CSecpFe inv, zi, zi2, zi3;
+    FeInv(inv, r[nCount - 1].x);
+    for (int i = nCount - 1; i >= 0; i--)
+    {
+        if (i > 0)
+        {
+            FeMul(zi, inv, r[i - 1].x);
+            FeMul(inv, inv, a[i].z);
+        }
+        else
+            zi = inv;
+        FeSqr(zi2, zi);
+        FeMul(zi3, zi2, zi);
+        FeMul(r[i].x, a[i].x, zi2);
+        FeMul(r[i].y, a[i].y, zi3);
+    }
+}
+
+// Odd multiples 1a, 3a, .. (2 * nCount - 1)a. Those of a public key fit on
+// the stack, so verification does not touch the heap.
+static void GeOddMultiples(CSecpGe* r, const CSecpGe& a, int nCount)
+{
+    CSecpGej pjSmall[TABLE_SIZE_A];
+    CSecpGej* pj = nCount <= TABLE_SIZE_A ? pjSmall : new CSecpGej[nCount];
+    CSecpGej d;
+    GejSetGe(pj[0], a);
+    GejDouble(d, pj[0]);
+    for (int i = 1; i < nCount; i++)
+        GejAdd(pj[i], pj[i - 1], d);
+    GeSetGejBatch(r, pj, nCount);
+    if (pj != pjSmall)
+        delete[] pj;
+}
+
+static const CSecpGe* GetGeneratorTable()
+{
+    static CSecpGe* ptable = NULL;
+    // Built by the first verification, function statics initialise once
+    static struct CBuild
+    {
+        CBuild()
+        {
+            CSecpGe g;
+            FeSetLimbs(g.x, SECP_GX);
+            FeSetLimbs(g.y, SECP_GY);
+            ptable = new CSecpGe[TABLE_SIZE_G];
+            GeOddMultiples(ptable, g, TABLE_SIZE_G);
+        }
+    } build;
+    return ptable;
+}
+
+// Add digit * (lambda * table), negated if fNegate
+static void AddWnafDigit(CSecpGej& r, int nDigit, const CSecpGe* ptable, bool fNegate, bool fLambda)
+{
+    if (nDigit == 0)
+        return;
+    CSecpGe p = ptable[((nDigit < 0 ? -nDigit : nDigit) - 1) / 2];
+    if ((nDigit < 0) != fNegate)
+        FeNegate(p.y, p.y);
+    if (fLambda)
+    {
+        CSecpFe beta;
+        FeSetLimbs(beta, SECP_BETA);
+        FeMul(p.x, p.x, beta);
+    }
+    GejAddGe(r, r, p);
+}
+
+// r = na * a + ng * G
+static void Ecmult(CSecpGej& r, const CSecpGe& a, const CSecpScalar& na, const CSecpScalar& ng)
+{
+    const CSecpGe* ptableG = GetGeneratorTable();
+    CSecpGe tableA[TABLE_SIZE_A];
+    GeOddMultiples(tableA, a, TABLE_SIZE_A);
+
+    // na*a + ng*G = a1*a + a2*(lambda*a) + g1*G + g2*(lambda*G)
+    CSecpScalar k[4];
+    ScalarSplitLambda(k[0], k[1], na);
+    ScalarSplitLambda(k[2], k[3], ng);
+    int wnaf[4][WNAF_MAX];
+    int nLen[4];
+    bool fNegate[4];
+    int nMax = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        fNegate[i] = ScalarIsHigh(k[i]);
+        if (fNegate[i])
+            ScalarNegate(k[i], k[i]);
+        nLen[i] = ScalarWnaf(wnaf[i], k[i], i < 2 ? WINDOW_A : WINDOW_G);
+        if (nLen[i] > nMax)
+            nMax = nLen[i];
+    }
+
+    r.fInfinity = true;
+    for (int n = nMax - 1; n >= 0; n--)
+    {
+        GejDouble(r, r);
+        for (int i = 0; i < 4; i++)
+            if (n < nLen[i])
+                AddWnafDigit(r, wnaf[i][n], i < 2 ? tableA : ptableG, fNegate[i], i % 2 == 1);
+    }
+}
+
+
+//
+// Encodings
+//
+
+// The point with x coordinate r.x and y of the given parity, false if none
+static bool GeSetXo(CSecpGe& r, bool fOdd)
+{
+    CSecpFe x3, seven;
+    FeSqr(x3, r.x);
+    FeMul(x3, x3, r.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    if (!FeSqrt(r.y, x3))
+        return false;
+    FeNormalize(r.y);
+    if ((r.y.n[0] & 1) != (uint64_t)fOdd)
+        FeNegate(r.y, r.y);
+    return true;
+}
+
+// 33 or 65 byte public keys of valid points, others are left to OpenSSL
+static bool ParsePubKey(CSecpGe& r, const unsigned char* p, size_t nLen)
+{
+    if (nLen == 33 && (p[0] == 0x02 || p[0] == 0x03))
+    {
+        LimbsSetB32(r.x.n, p + 1);
+        if (!LimbsLess(r.x.n, SECP_P))
+            return false;
+        return GeSetXo(r, p[0] == 0x03);
+    }
+    if (nLen == 65 && p[0] == 0x04)
+    {
+        LimbsSetB32(r.x.n, p + 1);
+        LimbsSetB32(r.y.n, p + 33);
+        return LimbsLess(r.x.n, SECP_P) && LimbsLess(r.y.n, SECP_P) && GeIsValid(r);
+    }
+    return false;
+}
+
+// One positive INTEGER of a strict DER signature as a 32 byte big endian number
+static bool ParseDerInteger(unsigned char* b32, const unsigned char* p, size_t nLen)
+{
+    while (nLen > 0 && p[0] == 0)
+    {
+        p++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+    memset(b32, 0, 32);
+    memcpy(b32 + 32 - nLen, p, nLen);
+    return true;
+}
+
+// Strict DER: 0x30 len 0x02 lenR R 0x02 lenS S, minimal positive integers and
+// nothing after, so OpenSSL reads the same r and s however lax its parser is
+static bool ParseSignature(unsigned char* r32, unsigned char* s32, const unsigned char* sig, size_t nLen)
+{
+    if (nLen < 8 || nLen > 72)
+        return false;
+    if (sig[0] != 0x30 || sig[1] != nLen - 2)
+        return false;
+    size_t nLenR = sig[3];
+    if (5 + nLenR >= nLen)
+        return false;
+    size_t nLenS = sig[5 + nLenR];
+    if (nLenR + nLenS + 6 != nLen)
+        return false;
+
+    if (sig[2] != 0x02 || nLenR == 0 || (sig[4] & 0x80))
+        return false;
+    if (nLenR > 1 && sig[4] == 0x00 && !(sig[5] & 0x80))
+        return false;
+
+    if (sig[nLenR + 4] != 0x02 || nLenS == 0 || (sig[nLenR + 6] & 0x80))
+        return false;
+    if (nLenS > 1 && sig[nLenR + 6] == 0x00 && !(sig[nLenR + 7] & 0x80))
+        return false;
+
+    return ParseDerInteger(r32, sig + 4, nLenR) && ParseDerInteger(s32, sig + 6 + nLenR, nLenS);
+}
+
+int Secp256k1Verify(const unsigned char* phash, const unsigned char* psig, size_t nSigLen,
+                    const unsigned char* ppubkey, size_t nPubKeyLen)
+{
+    CSecpGe q;
+    unsigned char r32[32], s32[32];
+    if (!ParsePubKey(q, ppubkey, nPubKeyLen) || !ParseSignature(r32, s32, psig, nSigLen))
+        return SECP256K1_UNSUPPORTED;
+
+    CSecpScalar r, s, z;
+    if (!ScalarSetB32(r, r32) || !ScalarSetB32(s, s32) || LimbsZero(r.d) || LimbsZero(s.d))
+        return SECP256K1_UNSUPPORTED;
+    ScalarSetB32Reduce(z, phash);
+
+    // R = (z/s)G + (r/s)Q
+    CSecpScalar sinv, u1, u2;
+    ScalarInv(sinv, s);
+    ScalarMul(u1, z, sinv);
+    ScalarMul(u2, r, sinv);
+    CSecpGej pr;
+    Ecmult(pr, q, u2, u1);
+    if (pr.fInfinity)
+        return SECP256K1_INVALID;
+
+    // R.x mod n == r, compared without leaving Jacobian coordinates. R.x may
+    // be r + n when that is still below p.
+    CSecpFe xr, z2, t;
+    FeSqr(z2, pr.z);
+    FeSetLimbs(xr, r.d);
+    FeMul(t, xr, z2);
+    if (FeEqual(t, pr.x))
+        return SECP256K1_VALID;
+    if (!LimbsLess(r.d, SECP_P_MINUS_N))
+        return SECP256K1_INVALID;
+    CSecpFe n;
+    FeSetLimbs(n, SECP_N);
+    FeAdd(xr, xr, n);
+    FeMul(t, xr, z2);
+    return FeEqual(t, pr.x) ? SECP256K1_VALID : SECP256K1_INVALID;
+}
+
+
+
+//
+// Signing
+//
+
+// kG as the sum over 64 windows of 4 bits of (k_i * 16^i)G. Entry j of
+// window i holds (j * 16^i)G + U_i, with U_i = 2^i * H for the first 63
+// windows and U_63 the negated sum of those. Nobody knows the discrete log
+// of H, whose x coordinate is the text below, so a partial sum is never
+// the point added to it and the additions need no special cases.
+static const int COMB_WINDOWS = 64;
+static const int COMB_POINTS = 16;
+static const char SECP_NUMS_X[] = "The scalar for this x is unknown";
+
+static const CSecpGe* GetCombTable()
+{
+    static CSecpGe* ptable = NULL;
+    // Built by the first signature, function statics initialise once
+    static struct CBuild
+    {
+        CBuild()
+        {
+            CSecpGe g, h;
+            FeSetLimbs(g.x, SECP_GX);
+            FeSetLimbs(g.y, SECP_GY);
+            LimbsSetB32(h.x.n, (const unsigned char*)SECP_NUMS_X);
+            GeSetXo(h, false);
+
+            CSecpGej* pj = new CSecpGej[COMB_WINDOWS * COMB_POINTS];
+            CSecpGej base, u, sum;
+            GejSetGe(base, g);
+            GejSetGe(u, h);
+            sum.fInfinity = true;
+            for (int i = 0; i < COMB_WINDOWS; i++)
+            {
+                if (i < COMB_WINDOWS - 1)
+                    GejAdd(sum, sum, u);
+                else
+                {
+                    u = sum;
+                    FeNegate(u.y, u.y);
+                }
+                pj[i * COMB_POINTS] = u;
+                for (int j = 1; j < COMB_POINTS; j++)
+                    GejAdd(pj[i * COMB_POINTS + j], pj[i * COMB_POINTS + j - 1], base);
+                for (int j = 0; j < 4; j++)
+                    GejDouble(base, base);
+                GejDouble(u, u);
+            }
+            ptable = new CSecpGe[COMB_WINDOWS * COMB_POINTS];
+            GeSetGejBatch(ptable, pj, COMB_WINDOWS * COMB_POINTS);
+            delete[] pj;
+        }
+    } build;
+    return ptable;
+}
+
+// r = prow[nIndex], reading every entry of the row so the memory accesses do
+// not depend on nIndex
+static void GeTableGet(CSecpGe& r, const CSecpGe* prow, unsigned int nIndex)
+{
+    memset(&r, 0, sizeof(r));
+    for (unsigned int j = 0; j < (unsigned int)COMB_POINTS; j++)
+    {
+        uint64_t mask = 0 - (((uint64_t)(j ^ nIndex) - 1) >> 63);
+        for (int i = 0; i < 4; i++)
+        {
+            r.x.n[i] |= prow[j].x.n[i] & mask;
+            r.y.n[i] |= prow[j].y.n[i] & mask;
+        }
+    }
+}
+
+// r = kG, constant time in k
+static void EcmultGen(CSecpGej& r, const CSecpScalar& k)
+{
+    const CSecpGe* ptable = GetCombTable();
+    CSecpGe p;
+    GeTableGet(p, ptable, k.d[0] & 15);
+    GejSetGe(r, p);
+    for (int i = 1; i < COMB_WINDOWS; i++)
+    {
+        GeTableGet(p, ptable + i * COMB_POINTS, (k.d[i / 16] >> ((i % 16) * 4)) & 15);
+        GejAddGeConst(r, r, p);
+    }
+    SecureClear(&p, sizeof(p));
+}
+
+// Deterministic nonces (RFC 6979 section 3.2, HMAC-SHA256): the same key and
+// digest always give the same k, no random number generator involved
+struct CRfc6979
+{
+    unsigned char k[32], v[32];
+    bool fRetry;
+};
+
+// K = HMAC_K(V || nSep [|| x || h]), V = HMAC_K(V)
+static void Rfc6979Update(CRfc6979& rng, unsigned char nSep, const unsigned char* pseckey, const unsigned char* phash)
+{
+    HMAC_SHA256_CTX ctx;
+    HMAC_SHA256_Init(&ctx, rng.k, 32);
+    HMAC_SHA256_Update(&ctx, rng.v, 32);
+    HMAC_SHA256_Update(&ctx, &nSep, 1);
+    if (pseckey)
+    {
+        HMAC_SHA256_Update(&ctx, pseckey, 32);
+        HMAC_SHA256_Update(&ctx, phash, 32);
+    }
+    HMAC_SHA256_Final(rng.k, &ctx);
+    HMAC_SHA256_Init(&ctx, rng.k, 32);
+    HMAC_SHA256_Update(&ctx, rng.v, 32);
+    HMAC_SHA256_Final(rng.v, &ctx);
+    SecureClear(&ctx, sizeof(ctx));
+}
+
+// phash is the digest already reduced mod n
+static void Rfc6979Init(CRfc6979& rng, const unsigned char* pseckey, const unsigned char* phash)
+{
+    memset(rng.v, 0x01, 32);
+    memset(rng.k, 0x00, 32);
+    Rfc6979Update(rng, 0x00, pseckey, phash);
+    Rfc6979Update(rng, 0x01, pseckey, phash);
+    rng.fRetry = false;
+}
+
+// The next candidate, after a rejected one the state moves on first
+static void Rfc6979Generate(CRfc6979& rng, unsigned char* pnonce)
+{
+    if (rng.fRetry)
+        Rfc6979Update(rng, 0x00, NULL, NULL);
+    HMAC_SHA256_CTX ctx;
+    HMAC_SHA256_Init(&ctx, rng.k, 32);
+    HMAC_SHA256_Update(&ctx, rng.v, 32);
+    HMAC_SHA256_Final(rng.v, &ctx);
+    SecureClear(&ctx, sizeof(ctx));
+    memcpy(pnonce, rng.v, 32);
+    rng.fRetry = true;
+}
+
+static void ScalarGetB32(unsigned char* b32, const CSecpScalar& a)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            b32[i * 8 + j] = (unsigned char)(a.d[3 - i] >> (56 - 8 * j));
+}
+
+// A 32 byte big endian number as a minimal positive DER INTEGER, returns the
+// bytes written, at most 35
+static size_t SerializeDerInteger(unsigned char* p, const unsigned char* b32)
+{
+    size_t nSkip = 0;
+    while (nSkip < 31 && b32[nSkip] == 0)
+        nSkip++;
+    size_t nPad = (b32[nSkip] & 0x80) ? 1 : 0;
+    p[0] = 0x02;
+    p[1] = (unsigned char)(32 - nSkip + nPad);
+    p[2] = 0x00;
+    memcpy(p + 2 + nPad, b32 + nSkip, 32 - nSkip);
+    return 2 + 32 - nSkip + nPad;
+}
+
+bool Secp256k1Sign(const unsigned char* phash, const unsigned char* pseckey, unsigned char* psig, size_t* pnSigLen)
+{
+    CSecpScalar d, z, k, r, s;
+    if (!ScalarSetB32(d, pseckey) || LimbsZero(d.d))
+        return false;
+    ScalarSetB32Reduce(z, phash);
+    unsigned char z32[32], k32[32];
+    ScalarGetB32(z32, z);
+
+    CRfc6979 rng;
+    Rfc6979Init(rng, pseckey, z32);
+    do
+    {
+        memset(r.d, 0, sizeof(r.d));
+        Rfc6979Generate(rng, k32);
+        if (!ScalarSetB32(k, k32) || LimbsZero(k.d))
+            continue;
+
+        // r = R.x mod n, R.x is below p < 2n
+        CSecpGej pr;
+        CSecpFe zi, x;
+        EcmultGen(pr, k);
+        FeInv(zi, pr.z);
+        FeSqr(zi, zi);
+        FeMul(x, pr.x, zi);
+        FeNormalize(x);
+        uint64_t t[4];
+        memcpy(r.d, x.n, sizeof(r.d));
+        uint64_t borrow = LimbsSub(t, r.d, SECP_N);
+        LimbsCmov(r.d, t, borrow - 1);
+
+        // s = (z + r * d) / k
+        ScalarMul(s, r, d);
+        ScalarAdd(s, s, z);
+        ScalarInv(k, k);
+        ScalarMul(s, s, k);
+        SecureClear(&pr, sizeof(pr));
+    } while (LimbsZero(r.d) || LimbsZero(s.d));
+    SecureClear(&d, sizeof(d));
+    SecureClear(&k, sizeof(k));
+    SecureClear(k32, sizeof(k32));
+    SecureClear(&rng, sizeof(rng));
+
+    unsigned char r32[32], s32[32];
+    ScalarGetB32(r32, r);
+    ScalarGetB32(s32, s);
+    size_t nLen = SerializeDerInteger(psig + 2, r32);
+    nLen += SerializeDerInteger(psig + 2 + nLen, s32);
+    psig[0] = 0x30;
+    psig[1] = (unsigned char)nLen;
+    *pnSigLen = nLen + 2;
+    return true;
+}
+
+#else
+
+int Secp256k1Verify(const unsigned char* phash, const unsigned char* psig, size_t nSigLen,
+                    const unsigned char* ppubkey, size_t nPubKeyLen)
+{
+    return SECP256K1_UNSUPPORTED;
+}
+
+bool Secp256k1Sign(const unsigned char* phash, const unsigned char* pseckey, unsigned char* psig, size_t* pnSigLen)
+{
+    return false;
+}
+
+#endif
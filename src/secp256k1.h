@@ -0,0 +1,35 @@
+// Copyright (c) 2013 Pennies developers and contributors
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PENNIES_SECP256K1_H
+#define PENNIES_SECP256K1_H
+
+#include <stddef.h>
+
+/** Answers of Secp256k1Verify */
+enum
+{
+    SECP256K1_INVALID = 0,
+    SECP256K1_VALID = 1,
+    // Left to OpenSSL: an encoding it may read differently, or no native
+    // verifier on this platform
+    SECP256K1_UNSUPPORTED = -1,
+};
+
+/** Verify a signature with secp256k1 arithmetic of our own instead of OpenSSL.
+ * Only handles strict DER signatures and 33 or 65 byte public keys that are
+ * valid points, where every OpenSSL version gives the same answer.
+ * @param[in] phash	32 byte digest, in the byte order ECDSA_verify takes it
+ */
+int Secp256k1Verify(const unsigned char* phash, const unsigned char* psig, size_t nSigLen,
+                    const unsigned char* ppubkey, size_t nPubKeyLen);
+
+/** Sign with secp256k1 arithmetic of our own, in time that does not depend on
+ * the key or the nonce. The nonce comes from the key and the digest (RFC 6979).
+ * @param[in] pseckey	32 byte big endian private key
+ * @param[out] psig	strict DER signature, room for 72 bytes
+ * @return false for a key out of range or no native signer on this platform
+ */
+bool Secp256k1Sign(const unsigned char* phash, const unsigned char* pseckey, unsigned char* psig, size_t* pnSigLen);
+
+#endif
@@ -1141,4 +1141,64 @@ public:
     }
 };
 
+/** Read-only stream over bytes owned by someone else, such as a mapped block
+ * file. Objects deserialize straight out of the buffer without first being
+ * copied into a CDataStream.
+ */
+class CBufferReader
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    const char* pread;
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pbegin = pbeginIn;
+        pend = pendIn;
+        pread = pbeginIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    //
+    // Stream subset
+    //
+    bool empty() const           { return pread == pend; }
+    size_t size() const          { return pend - pread; }
+    size_t tell() const          { return pread - pbegin; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pread))
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pread, nSize);
+        pread += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,197 @@
+// Copyright (c) 2013 Pennies developers and contributors
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PENNIES_SMALLVECTOR_H
+#define PENNIES_SMALLVECTOR_H
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#include <boost/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+/** STL-like vector that keeps up to N elements inside the object and only
+ * goes to the heap past that. Iterators are plain pointers and are invalidated
+ * by anything that grows or shrinks the container. */
+template <typename T, unsigned int N> class smallvector
+{
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef unsigned int size_type;
+
+protected:
+    size_type nSize;
+    size_type nCapacity;
+    // NULL while the elements are in buffer
+    T* pheap;
+    typename boost::aligned_storage<sizeof(T) * N, boost::alignment_of<T>::value>::type buffer;
+
+    T* data() { return pheap ? pheap : static_cast<T*>(buffer.address()); }
+    const T* data() const { return pheap ? pheap : static_cast<const T*>(buffer.address()); }
+
+    void destroy(T* pbegin, T* pend)
+    {
+        for (T* p = pbegin; p != pend; ++p)
+            p->~T();
+    }
+
+public:
+    smallvector() : nSize(0), nCapacity(N), pheap(NULL) {}
+
+    smallvector(const smallvector& b) : nSize(0), nCapacity(N), pheap(NULL)
+    {
+        assign(b.begin(), b.end());
+    }
+
+    template <typename InputIterator>
+    smallvector(InputIterator first, InputIterator last) : nSize(0), nCapacity(N), pheap(NULL)
+    {
+        assign(first, last);
+    }
+
+    ~smallvector()
+    {
+        clear();
+        if (pheap)
+            ::operator delete(pheap);
+    }
+
+    smallvector& operator=(const smallvector& b)
+    {
+        if (&b != this)
+            assign(b.begin(), b.end());
+        return *this;
+    }
+
+    iterator begin() { return data(); }
+    const_iterator begin() const { return data(); }
+    iterator end() { return data() + nSize; }
+    const_iterator end() const { return data() + nSize; }
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    size_type capacity() const { return nCapacity; }
+
+    reference operator[](size_type pos) { return data()[pos]; }
+    const_reference operator[](size_type pos) const { return data()[pos]; }
+    reference back() { return data()[nSize - 1]; }
+    const_reference back() const { return data()[nSize - 1]; }
+
+    reference at(size_type pos)
+    {
+        if (pos >= nSize)
+            throw std::out_of_range("smallvector::at() : out of range");
+        return data()[pos];
+    }
+
+    const_reference at(size_type pos) const
+    {
+        if (pos >= nSize)
+            throw std::out_of_range("smallvector::at() : out of range");
+        return data()[pos];
+    }
+
+    void reserve(size_type n)
+    {
+        if (n <= nCapacity)
+            return;
+        T* pnew = static_cast<T*>(::operator new(sizeof(T) * n));
+        T* pold = data();
+        for (size_type i = 0; i < nSize; i++)
+        {
+            new (pnew + i) T(pold[i]);
+            pold[i].~T();
+        }
+        if (pheap)
+            ::operator delete(pheap);
+        pheap = pnew;
+        nCapacity = n;
+    }
+
+    void clear()
+    {
+        destroy(begin(), end());
+        nSize = 0;
+    }
+
+    template <typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        clear();
+        reserve(std::distance(first, last));
+        for (T* p = data(); first != last; ++first, ++p, ++nSize)
+            new (p) T(*first);
+    }
+
+    void resize(size_type n, const T& x = T())
+    {
+        if (n < nSize)
+        {
+            destroy(begin() + n, end());
+            nSize = n;
+            return;
+        }
+        reserve(n);
+        for (T* p = end(); nSize < n; ++p, ++nSize)
+            new (p) T(x);
+    }
+
+    void push_back(const T& x)
+    {
+        if (nSize == nCapacity)
+        {
+            // x may be one of our own elements
+            T copy(x);
+            reserve(nCapacity * 2);
+            new (end()) T(copy);
+        }
+        else
+            new (end()) T(x);
+        nSize++;
+    }
+
+    void pop_back()
+    {
+        back().~T();
+        nSize--;
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        iterator pend = std::copy(last, end(), first);
+        destroy(pend, end());
+        nSize = pend - begin();
+        return first;
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator insert(iterator pos, const T& x)
+    {
+        size_type nPos = pos - begin();
+        T copy(x);
+        push_back(copy);
+        std::copy_backward(begin() + nPos, end() - 1, end());
+        data()[nPos] = copy;
+        return begin() + nPos;
+    }
+
+    friend bool operator==(const smallvector& a, const smallvector& b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+
+    friend bool operator!=(const smallvector& a, const smallvector& b)
+    {
+        return !(a == b);
+    }
+};
+
+#endif
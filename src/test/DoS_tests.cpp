@@ -8,6 +8,7 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
 
+#include "checkpoints.h"
 #include "main.h"
 #include "wallet.h"
 #include "net.h"
@@ -132,6 +133,52 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
     
 }
 
+// A header timestamped just past the Nfactor scrypt_hash accepts is turned
+// down for its timestamp, without a DoS score, and no hash is cached for it
+BOOST_AUTO_TEST_CASE(DoS_nfactor_bound)
+{
+    SetMockTime(1400000000);
+    int64 nLimit = GetAdjustedTime() + nMaxClockDrift;
+    unsigned char nMax = scrypt_nfactor_max();
+    BOOST_CHECK_EQUAL(nMax, GetNfactor(nLimit));
+
+    // First timestamp at the next Nfactor
+    int64 nLo = nLimit, nHi = nLimit + 1;
+    while (GetNfactor(nHi) <= nMax)
+        nHi += nHi - nLo;
+    while (nHi - nLo > 1)
+    {
+        int64 nMid = (nLo + nHi) / 2;
+        if (GetNfactor(nMid) > nMax)
+            nHi = nMid;
+        else
+            nLo = nMid;
+    }
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    txCoinBase.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(txCoinBase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    block.nTime = nHi;
+    BOOST_CHECK(block.GetHash() == ~uint256(0));
+    BOOST_CHECK(block.uhash == 0);
+    BOOST_CHECK(!block.CheckBlock());
+    BOOST_CHECK_EQUAL(block.nDoS, 0);
+
+    // One second earlier it still hashes, and is still too far ahead
+    block.nTime = nLo;
+    BOOST_CHECK(block.GetHash() != ~uint256(0));
+    BOOST_CHECK(!block.CheckBlock());
+    BOOST_CHECK_EQUAL(block.nDoS, 0);
+
+    SetMockTime(0);
+}
+
 CTransaction RandomOrphan()
 {
     std::map<uint256, CDataStream*>::iterator it;
@@ -311,4 +358,91 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     LimitOrphanTxSize(0);
 }
 
+// Score of connecting a PoW block that spends txSpend, wherever it was recorded
+static int ConnectBlockDoS(CTxDB& txdb, const CTransaction& txSpend, CKey& key)
+{
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].scriptPubKey = CScript() << key.GetPubKey() << OP_CHECKSIG;
+    CBlock block;
+    block.vtx.push_back(txCoinBase);
+    block.vtx.push_back(txSpend);
+    block.nTime = GetAdjustedTime();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(key.Sign(block.GetHash(), block.vchBlockSig));
+
+    // Only checked, transactions at CDiskTxPos(1,1,1) are in the memory pool
+    CBlockIndex index;
+    index.pprev = pindexGenesisBlock;
+    index.nHeight = 1;
+    index.nFile = 1;
+    index.nBlockPos = 1;
+    index.nTime = block.nTime;
+    BOOST_CHECK(!block.ConnectBlock(txdb, &index, true));
+
+    int nDoS = block.nDoS;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        nDoS += tx.nDoS;
+    return nDoS;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_scriptcheck)
+{
+    SetMockTime(1400000000);
+    CKey key;
+    key.MakeNewKey(true);
+
+    // Spent from the memory pool: one output that only fails strict P2SH,
+    // one that always fails
+    CScript redeem = CScript() << OP_0;
+    CTransaction txFrom;
+    txFrom.vin.resize(1);
+    txFrom.vin[0].prevout.n = 0;
+    txFrom.vin[0].prevout.hash = GetRandHash();
+    txFrom.vin[0].scriptSig << OP_1;
+    txFrom.vout.resize(2);
+    txFrom.vout[0].nValue = 2*COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(redeem.GetID());
+    txFrom.vout[1].nValue = 2*COIN;
+    txFrom.vout[1].scriptPubKey = CScript() << OP_0;
+    {
+        LOCK(mempool.cs);
+        mempool.addUnchecked(txFrom.GetHash(), txFrom);
+    }
+
+    CTransaction txP2SH;
+    txP2SH.vin.resize(1);
+    txP2SH.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txP2SH.vin[0].scriptSig << static_cast<std::vector<unsigned char> >(redeem);
+    txP2SH.vout.resize(1);
+    txP2SH.vout[0].nValue = 1*COIN;
+    txP2SH.vout[0].scriptPubKey = CScript() << OP_1;
+    CTransaction txBad = txP2SH;
+    txBad.vin[0].prevout.n = 1;
+    txBad.vin[0].scriptSig = CScript() << OP_1;
+
+    CTxDB txdb;
+    txdb.TxnBegin();
+    BOOST_CHECK(txdb.UpdateTxIndex(txFrom.GetHash(), CTxIndex(CDiskTxPos(1,1,1), txFrom.vout.size())));
+
+    // Signatures are not checked below the last checkpoint
+    int nBestHeightSave = nBestHeight;
+    nBestHeight = Checkpoints::GetTotalBlocksEstimate();
+
+    // Checked in ConnectInputs, then on a script check thread
+    BOOST_CHECK_EQUAL(ConnectBlockDoS(txdb, txP2SH, key), 0);
+    BOOST_CHECK_EQUAL(ConnectBlockDoS(txdb, txBad, key), 100);
+    StartScriptCheckThreads(1);
+    BOOST_CHECK_EQUAL(ConnectBlockDoS(txdb, txP2SH, key), 0);
+    BOOST_CHECK_EQUAL(ConnectBlockDoS(txdb, txBad, key), 100);
+
+    nBestHeight = nBestHeightSave;
+    txdb.TxnAbort();
+    mempool.remove(txFrom);
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,28 @@
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(hash_tests)
+
+BOOST_AUTO_TEST_CASE(hash4way)
+{
+    // Every length Hash4Way takes, a different message in each lane
+    unsigned char pchMsg[4][55];
+    const unsigned char* pmsg[4];
+    for (size_t nLen = 0; nLen <= 55; nLen++)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            for (size_t i = 0; i < sizeof(pchMsg[l]); i++)
+                pchMsg[l][i] = (unsigned char)(i * 7 + l * 31 + nLen);
+            pmsg[l] = pchMsg[l];
+        }
+        uint256 hash[4];
+        Hash4Way(pmsg, nLen, hash);
+        for (int l = 0; l < 4; l++)
+            BOOST_CHECK(hash[l] == Hash(pchMsg[l], pchMsg[l] + nLen));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -21,7 +21,7 @@ typedef vector<unsigned char> valtype;
 
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                         bool fValidatePayToScriptHash, int nHashType);
+                         bool fValidatePayToScriptHash, int nHashType, bool fCacheStore, const CSignatureHasher* phasher);
 
 BOOST_AUTO_TEST_SUITE(multisig_tests)
 
@@ -14,7 +14,7 @@ using namespace std;
 // Test routines internal to script.cpp:
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                         bool fValidatePayToScriptHash, int nHashType);
+                         bool fValidatePayToScriptHash, int nHashType, bool fCacheStore, const CSignatureHasher* phasher);
 
 // Helpers:
 static std::vector<unsigned char>
@@ -21,7 +21,7 @@ using namespace boost::algorithm;
 
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                         bool fValidatePayToScriptHash, int nHashType);
+                         bool fValidatePayToScriptHash, int nHashType, bool fCacheStore, const CSignatureHasher* phasher);
 
 CScript
 ParseScript(string s)
@@ -442,4 +442,61 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_signature_hasher)
+{
+    CTransaction tx;
+    for (int i = 0; i < 5; i++)
+    {
+        CTxIn txin(GetRandHash(), i);
+        txin.scriptSig << i << OP_DROP;
+        txin.nSequence = i;
+        tx.vin.push_back(txin);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        CTxOut txout;
+        txout.nValue = (i + 1) * COIN;
+        txout.scriptPubKey << i << OP_EQUAL;
+        tx.vout.push_back(txout);
+    }
+    tx.nLockTime = 123;
+
+    // With codeseparators to drop, and without
+    CScript scriptCodes[] = {CScript() << OP_CODESEPARATOR << OP_DUP << OP_CODESEPARATOR << OP_HASH160,
+                             CScript() << OP_DUP << OP_HASH160};
+    int nHashTypes[] = {0, SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY, 0x42};
+    CSignatureHasher hasher(tx);
+    BOOST_FOREACH(const CScript& scriptCode, scriptCodes)
+        for (unsigned int nIn = 0; nIn <= tx.vin.size(); nIn++)
+            BOOST_FOREACH(int nHashType, nHashTypes)
+                BOOST_CHECK(hasher.GetHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, tx, nIn, nHashType));
+}
+
+// HasPush answers whether FindAndDelete would remove anything, which decides
+// whether a signature check copies the script
+BOOST_AUTO_TEST_CASE(script_HasPush)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        valtype vch(GetRandInt(3) == 0 ? 300 : GetRandInt(4));
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = GetRandInt(2);
+        CScript script;
+        for (int nOps = GetRandInt(5); nOps > 0; nOps--)
+        {
+            int nRand = GetRandInt(4);
+            if (nRand == 0)
+                script << vch;
+            else if (nRand == 1)
+                script << valtype(GetRandInt(3), 1);
+            else if (nRand == 2)
+                script << OP_CHECKSIG;
+            else
+                script.push_back((unsigned char)GetRandInt(256));
+        }
+        CScript scriptDeleted(script);
+        BOOST_CHECK_EQUAL(script.HasPush(vch.empty() ? NULL : &vch[0], vch.size()), scriptDeleted.FindAndDelete(CScript(vch)) > 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
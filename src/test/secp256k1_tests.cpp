@@ -0,0 +1,139 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include "key.h"
+#include "secp256k1.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+// The answer OpenSSL gives, 1 for a good signature
+static int OpenSSLVerify(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char* pbegin = &vchPubKey[0];
+    int nRet = -1;
+    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        nRet = ECDSA_verify(0, (const unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey);
+    EC_KEY_free(pkey);
+    return nRet;
+}
+
+static int NativeVerify(const uint256& hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+{
+    return Secp256k1Verify((const unsigned char*)&hash, &vchSig[0], vchSig.size(), &vchPubKey[0], vchPubKey.size());
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_matches_openssl)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+
+        uint256 hash = GetRandHash();
+        if (i == 0)
+            hash = 0;
+        if (i == 1)
+            hash = ~uint256(0);
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        int nNative = NativeVerify(hash, vchSig, vchPubKey);
+#if defined(__SIZEOF_INT128__)
+        BOOST_CHECK_EQUAL(nNative, SECP256K1_VALID);
+#endif
+        if (nNative != SECP256K1_UNSUPPORTED)
+            BOOST_CHECK_EQUAL(nNative == SECP256K1_VALID, OpenSSLVerify(hash, vchSig, vchPubKey) == 1);
+        BOOST_CHECK(key.GetPubKey().Verify(hash, vchSig));
+
+        // Another digest
+        uint256 hashOther = hash ^ (uint256(1) << (i % 256));
+        nNative = NativeVerify(hashOther, vchSig, vchPubKey);
+        if (nNative != SECP256K1_UNSUPPORTED)
+            BOOST_CHECK_EQUAL(nNative == SECP256K1_VALID, OpenSSLVerify(hashOther, vchSig, vchPubKey) == 1);
+        BOOST_CHECK(!key.GetPubKey().Verify(hashOther, vchSig));
+
+        // A flipped bit anywhere in the signature, including its DER framing
+        vector<unsigned char> vchSigBad(vchSig);
+        vchSigBad[i % vchSigBad.size()] ^= 1 << (i % 8);
+        nNative = NativeVerify(hash, vchSigBad, vchPubKey);
+        if (nNative != SECP256K1_UNSUPPORTED)
+            BOOST_CHECK_EQUAL(nNative == SECP256K1_VALID, OpenSSLVerify(hash, vchSigBad, vchPubKey) == 1);
+        BOOST_CHECK(!key.GetPubKey().Verify(hash, vchSigBad));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_unsupported)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    // Trailing garbage and a padded integer are not strict DER
+    vector<unsigned char> vchSigLax(vchSig);
+    vchSigLax.push_back(0);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSigLax, key.GetPubKey().Raw()), SECP256K1_UNSUPPORTED);
+
+    vchSigLax = vchSig;
+    vchSigLax[1]++;
+    vchSigLax[3]++;
+    vchSigLax.insert(vchSigLax.begin() + 4, 0);
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSigLax, key.GetPubKey().Raw()), SECP256K1_UNSUPPORTED);
+
+    // Nor is a public key that is not on the curve
+    vector<unsigned char> vchPubKeyBad(65, 0);
+    vchPubKeyBad[0] = 0x04;
+    vchPubKeyBad[64] = 1;
+    BOOST_CHECK_EQUAL(NativeVerify(hash, vchSig, vchPubKeyBad), SECP256K1_UNSUPPORTED);
+    BOOST_CHECK(!CPubKey(vchPubKeyBad).Verify(hash, vchSig));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_sign)
+{
+    // Private key 1 and SHA256("Satoshi Nakamoto"), a common RFC 6979 vector
+    unsigned char vchKey[32] = {0};
+    vchKey[31] = 1;
+    vector<unsigned char> vchHash = ParseHex("a0dc65ffca799873cbea0ac274015b9526505daaaed385155425f7337704883e");
+    unsigned char vchSig[72];
+    size_t nSigLen = 0;
+#if defined(__SIZEOF_INT128__)
+    BOOST_CHECK(Secp256k1Sign(&vchHash[0], vchKey, vchSig, &nSigLen));
+    BOOST_CHECK_EQUAL(HexStr(vchSig, vchSig + nSigLen), "3046022100934b1ea10a4b3c1757e2b0c017d0b6143ce3c9a7e6a4a49860d7a6ab210ee3d8022100dbbd3162d46e9f9bef7feb87c16dc13b4f6568a87f4e83f728e2443ba586675c");
+#endif
+
+    // Native signatures are good signatures to OpenSSL, and keys of n or
+    // above are refused
+    fNativeSign = true;
+    for (int i = 0; i < 50; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSigNative;
+        BOOST_CHECK(key.Sign(hash, vchSigNative));
+        BOOST_CHECK_EQUAL(OpenSSLVerify(hash, vchSigNative, key.GetPubKey().Raw()), 1);
+#if defined(__SIZEOF_INT128__)
+        // and they are the deterministic ones, not OpenSSL's
+        bool fCompressed;
+        CSecret vchSecret = key.GetSecret(fCompressed);
+        BOOST_CHECK(Secp256k1Sign((const unsigned char*)&hash, &vchSecret[0], vchSig, &nSigLen));
+        BOOST_CHECK(vchSigNative == vector<unsigned char>(vchSig, vchSig + nSigLen));
+#endif
+    }
+    fNativeSign = false;
+    memset(vchKey, 0xff, sizeof(vchKey));
+    BOOST_CHECK(!Secp256k1Sign(&vchHash[0], vchKey, vchSig, &nSigLen));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
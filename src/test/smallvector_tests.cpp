@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+#include "smallvector.h"
+#include "util.h"
+
+#define NUM_TESTS 64
+#define NUM_OPS 200
+
+typedef smallvector<unsigned char, 8> bytevector;
+
+class smallvectortester
+{
+private:
+    smallvector<bytevector, 4> small;
+    vector<vector<unsigned char> > real;
+
+public:
+    size_t size() const { return real.size(); }
+
+    void check()
+    {
+        BOOST_CHECK_EQUAL(small.size(), real.size());
+        for (unsigned int i = 0; i < real.size(); i++)
+            BOOST_CHECK(vector<unsigned char>(small[i].begin(), small[i].end()) == real[i]);
+    }
+
+    void push_back(const vector<unsigned char>& vch)
+    {
+        small.push_back(bytevector(vch.begin(), vch.end()));
+        real.push_back(vch);
+        check();
+    }
+
+    void pop_back()
+    {
+        small.pop_back();
+        real.pop_back();
+        check();
+    }
+
+    // Copy of one of the elements, to the end or into the middle
+    void duplicate(unsigned int nFrom, unsigned int nTo)
+    {
+        vector<unsigned char> vch = real[nFrom];
+        small.insert(small.begin() + nTo, small[nFrom]);
+        real.insert(real.begin() + nTo, vch);
+        check();
+    }
+
+    void erase(unsigned int nFirst, unsigned int nLast)
+    {
+        small.erase(small.begin() + nFirst, small.begin() + nLast);
+        real.erase(real.begin() + nFirst, real.begin() + nLast);
+        check();
+    }
+
+    void copy()
+    {
+        smallvector<bytevector, 4> other(small);
+        BOOST_CHECK(other == small);
+        other = small;
+        BOOST_CHECK(other == small);
+        small = other;
+        check();
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(smallvector_tests)
+
+// Test that a smallvector behaves like a vector, whether its elements are
+// inline or on the heap
+BOOST_AUTO_TEST_CASE(smallvector_like_vector)
+{
+    for (int nTest = 0; nTest < NUM_TESTS; nTest++)
+    {
+        smallvectortester tester;
+        for (int nOp = 0; nOp < NUM_OPS; nOp++)
+        {
+            int nRand = GetRandInt(6);
+            if (nRand <= 1 || tester.size() == 0)
+            {
+                vector<unsigned char> vch(GetRandInt(GetRandInt(4) == 0 ? 32 : 8));
+                for (unsigned int i = 0; i < vch.size(); i++)
+                    vch[i] = GetRandInt(256);
+                tester.push_back(vch);
+            }
+            else if (nRand == 2)
+                tester.pop_back();
+            else if (nRand == 3)
+                tester.duplicate(GetRandInt(tester.size()), GetRandInt(tester.size() + 1));
+            else if (nRand == 4)
+            {
+                unsigned int nFirst = GetRandInt(tester.size());
+                tester.erase(nFirst, nFirst + GetRandInt(tester.size() - nFirst + 1));
+            }
+            else
+                tester.copy();
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,54 @@
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+// The wallet's index of unspent and immature transactions, and the balances
+// cached from it
+BOOST_AUTO_TEST_SUITE(wallet_balance_tests)
+
+BOOST_AUTO_TEST_CASE(balance_index_tests)
+{
+    CWallet* pwallet = pwalletMain;
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwallet->AddKey(key));
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    int64 nUnconfirmed = pwallet->GetUnconfirmedBalance();
+
+    // Not in a block and not from us, so it counts as unconfirmed
+    CWalletTx wtx;
+    wtx.nLockTime = 0;
+    wtx.vout.push_back(CTxOut(1 * CENT, scriptPubKey));
+    wtx.vout.push_back(CTxOut(3 * CENT, scriptPubKey));
+    BOOST_CHECK(pwallet->AddToWallet(wtx));
+    uint256 hash = wtx.GetHash();
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed + 4 * CENT);
+
+    // Spending one output is picked up without a rebuild
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(hash, 1));
+    pwallet->WalletUpdateSpent(txSpend);
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed + 1 * CENT);
+
+    // Once fully spent the transaction leaves the index
+    txSpend.vin[0].prevout.n = 0;
+    pwallet->WalletUpdateSpent(txSpend);
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // A coin coming back without passing through the wallet, the way a
+    // reorganize can bring back a matured or spent one, is only seen again
+    // after the index is rebuilt
+    pwallet->mapWallet[hash].MarkUnspent(0);
+    pwallet->BlockChainReorganized();
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed + 1 * CENT);
+
+    pwallet->EraseFromWallet(hash);
+    BOOST_CHECK_EQUAL(pwallet->GetUnconfirmedBalance(), nUnconfirmed);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
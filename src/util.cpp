@@ -53,6 +53,8 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <pthread.h>
+# include <sched.h>
 #endif
 
 #ifndef WIN32
@@ -1358,6 +1360,71 @@ void RenameThread(const char* name)
 #endif
 }
 
+bool SetThreadAffinity(int nCpu)
+{
+#if defined(WIN32)
+    if (nCpu < 0 || nCpu >= (int)(sizeof(DWORD_PTR) * 8))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << nCpu) != 0;
+#elif defined(__linux__)
+    if (nCpu < 0 || nCpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(nCpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)nCpu;
+    return false;
+#endif
+}
+
+std::vector<int> GetAllowedCpus()
+{
+    std::vector<int> vCpus;
+#if defined(WIN32)
+    DWORD_PTR nProcessMask, nSystemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask))
+        for (int nCpu = 0; nCpu < (int)(sizeof(DWORD_PTR) * 8); nCpu++)
+            if (nProcessMask & ((DWORD_PTR)1 << nCpu))
+                vCpus.push_back(nCpu);
+#elif defined(__linux__)
+    // The main thread's mask, which a pinned thread asking for its own would not give
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(getpid(), sizeof(set), &set) == 0)
+        for (int nCpu = 0; nCpu < CPU_SETSIZE; nCpu++)
+            if (CPU_ISSET(nCpu, &set))
+                vCpus.push_back(nCpu);
+#endif
+    if (vCpus.empty())
+        for (int nCpu = 0; nCpu < (int)boost::thread::hardware_concurrency(); nCpu++)
+            vCpus.push_back(nCpu);
+    return vCpus;
+}
+
+int GetCpuNumaNode(int nCpu)
+{
+#if defined(__linux__)
+    // sysfs links each cpu to its node as cpuN/nodeM
+    boost::filesystem::path pathCpu(strprintf("/sys/devices/system/cpu/cpu%d", nCpu));
+    try
+    {
+        for (boost::filesystem::directory_iterator it(pathCpu), end; it != end; ++it)
+        {
+            std::string strName = it->path().filename().string();
+            if (strName.size() > 4 && strName.compare(0, 4, "node") == 0)
+                return atoi(strName.substr(4));
+        }
+    } catch (boost::filesystem::filesystem_error &e) {
+    }
+    return 0;
+#else
+    (void)nCpu;
+    return 0;
+#endif
+}
+
 bool NewThread(void(*pfn)(void*), void* parg)
 {
     try
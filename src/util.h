@@ -351,6 +351,12 @@ inline int64 GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64 GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64 nTime)
 {
     time_t n = nTime;
@@ -464,6 +470,10 @@ public:
         Init();
     }
 
+    // Carry on from the state after a common prefix
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX& ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
@@ -627,6 +637,12 @@ inline void ExitThread(size_t nExitCode)
 #endif
 
 void RenameThread(const char* name);
+// Pin the calling thread to one logical cpu, false if unsupported or refused
+bool SetThreadAffinity(int nCpu);
+// Logical cpus the process may run on (taskset, cgroup cpusets), in order
+std::vector<int> GetAllowedCpus();
+// NUMA node a logical cpu belongs to, 0 where unknown
+int GetCpuNumaNode(int nCpu);
 
 inline uint32_t ByteReverse(uint32_t value)
 {
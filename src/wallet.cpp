@@ -354,6 +354,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %syac %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    nWalletUpdated++;
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -367,6 +368,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        RebuildWalletIndex();
+        nWalletUpdated++;
     }
 }
 
@@ -479,6 +482,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        UpdateWalletIndex(wtx);
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx);
 
@@ -520,6 +525,7 @@ bool CWallet::EraseFromWallet(uint256 hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        nWalletUpdated++;
     }
     return true;
 }
@@ -848,6 +854,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %syac %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    nWalletUpdated++;
                 }
             }
             else
@@ -953,50 +960,130 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+void CWallet::IndexWalletTx(const CWalletTx& wtx) const
 {
-    int64 nTotal = 0;
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            setWalletUnspent.insert(hash);
+            break;
         }
     }
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        setWalletImmature.insert(hash);
+}
+
+// File a new or changed transaction in the balance index
+void CWallet::UpdateWalletIndex(const CWalletTx& wtx)
+{
+    IndexWalletTx(wtx);
+    nWalletUpdated++;
+}
 
-    return nTotal;
+void CWallet::RebuildWalletIndex() const
+{
+    setWalletUnspent.clear();
+    setWalletImmature.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        IndexWalletTx((*it).second);
+    fWalletIndexStale = false;
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+// Coins only leave setWalletImmature once mature and setWalletUnspent once
+// spent, and a reorganize onto another branch can undo either: rebuild the
+// index on the next balance query
+void CWallet::BlockChainReorganized()
+{
+    LOCK(cs_wallet);
+    fWalletIndexStale = true;
+    fBalancesCached = false;
+}
+
+// Recompute the balances if the best chain or the wallet changed since the
+// last time, visiting only the indexed transactions
+void CWallet::UpdateBalances() const
 {
-    int64 nTotal = 0;
+    if (fWalletIndexStale)
+        RebuildWalletIndex();
+
+    if (fBalancesCached && hashBalancesBestChain == hashBestChain && nBalancesWalletUpdated == nWalletUpdated)
+        return;
+    hashBalancesBestChain = hashBestChain;
+    nBalancesWalletUpdated = nWalletUpdated;
+    nBalanceCached = nUnconfirmedBalanceCached = nImmatureBalanceCached = nStakeCached = nNewMintCached = 0;
+
+    // Finality can change with time alone, don't reuse balances that depend on it
+    fBalancesCached = true;
+
+    set<uint256>::iterator it = setWalletUnspent.begin();
+    while (it != setWalletUnspent.end())
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        if (mi == mapWallet.end())
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            setWalletUnspent.erase(it++);
+            continue;
         }
+        const CWalletTx* pcoin = &(*mi).second;
+        bool fUnspent = false;
+        for (unsigned int i = 0; i < pcoin->vout.size() && !fUnspent; i++)
+            fUnspent = !pcoin->IsSpent(i) && IsMine(pcoin->vout[i]);
+        if (!fUnspent)
+        {
+            setWalletUnspent.erase(it++);
+            continue;
+        }
+        if (!pcoin->IsFinal())
+            fBalancesCached = false;
+        if (pcoin->IsFinal() && pcoin->IsConfirmed())
+            nBalanceCached += pcoin->GetAvailableCredit();
+        else
+            nUnconfirmedBalanceCached += pcoin->GetAvailableCredit();
+        ++it;
     }
-    return nTotal;
-}
 
-int64 CWallet::GetImmatureBalance() const
-{
-    int64 nTotal = 0;
+    it = setWalletImmature.begin();
+    while (it != setWalletImmature.end())
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        if (mi == mapWallet.end() || (*mi).second.GetBlocksToMaturity() == 0)
         {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
+            setWalletImmature.erase(it++);
+            continue;
         }
+        const CWalletTx& wtx = (*mi).second;
+        int nDepth = wtx.GetDepthInMainChain();
+        if (wtx.IsCoinBase() && wtx.IsInMainChain())
+            nImmatureBalanceCached += GetCredit(wtx);
+        if (wtx.IsCoinStake() && nDepth > 0)
+            nStakeCached += GetCredit(wtx);
+        if (wtx.IsCoinBase() && nDepth > 0)
+            nNewMintCached += GetCredit(wtx);
+        ++it;
     }
-    return nTotal;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateBalances();
+    return nBalanceCached;
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateBalances();
+    return nUnconfirmedBalanceCached;
+}
+
+int64 CWallet::GetImmatureBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1006,8 +1093,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setWalletUnspent)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1068,28 +1158,16 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
 // ppcoin: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalances();
+    return nStakeCached;
 }
 
 int64 CWallet::GetNewMint() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    UpdateBalances();
+    return nNewMintCached;
 }
 
 bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
@@ -1373,6 +1451,53 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
+    // Choose coins to use
+    static int nMaxStakeSearchInterval = 60;
+    int64 nReserveBalance = 0;
+    if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
+        return error("CreateCoinStake : invalid reserve balance amount");
+    vector<CStakeKernelCandidate> vCandidates;
+    {
+        LOCK2(cs_main, cs_wallet);
+        int64 nBalance = GetBalance();
+        if (nBalance <= nReserveBalance)
+            return false;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64 nValueIn = 0;
+        if (!SelectCoins(nBalance - nReserveBalance, txNew.nTime, setCoins, nValueIn))
+            return false;
+
+        CTxDB txdb("r");
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            // only support pay to public key and pay to address
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            if (!Solver(pcoin.first->vout[pcoin.second].scriptPubKey, whichType, vSolutions))
+                continue;
+            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                continue;
+
+            CStakeKernelCandidate candidate;
+            if (!GetStakeKernelCandidate(txdb, *pcoin.first, pcoin.second, candidate))
+                continue;
+            if (candidate.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+                continue; // only count coins meeting min age requirement
+            vCandidates.push_back(candidate);
+        }
+    }
+
+    // pennies: every eligible coin is searched with the locks released.
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    size_t nKernel = 0;
+    unsigned int nTimeKernel = 0;
+    if (!FindStakeKernel(vCandidates, nBits, txNew.nTime, min(nSearchInterval, (int64)nMaxStakeSearchInterval), nKernel, nTimeKernel))
+        return false;
+    const COutPoint prevoutStake = vCandidates[nKernel].prevout;
+    if (fDebug && GetBoolArg("-printcoinstake"))
+        printf("CreateCoinStake : kernel found\n");
+
     LOCK2(cs_main, cs_wallet);
     txNew.vin.clear();
     txNew.vout.clear();
@@ -1380,11 +1505,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CScript scriptEmpty;
     scriptEmpty.clear();
     txNew.vout.push_back(CTxOut(0, scriptEmpty));
-    // Choose coins to use
+
+    // The wallet and the chain may have moved while searching: select the
+    // coins again and check the kernel for real
     int64 nBalance = GetBalance();
-    int64 nReserveBalance = 0;
-    if (mapArgs.count("-reservebalance") && !ParseMoney(mapArgs["-reservebalance"], nReserveBalance))
-        return error("CreateCoinStake : invalid reserve balance amount");
     if (nBalance <= nReserveBalance)
         return false;
     set<pair<const CWalletTx*,unsigned int> > setCoins;
@@ -1395,96 +1519,69 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
     int64 nCredit = 0;
-	
-	static int64 nQueryIndex = 0;
-	int64 nQueryMax = setCoins.size();
-	int64 nQueryStop = 10;
-	
+
     CScript scriptPubKeyKernel;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
+        if (pcoin.first->GetHash() != prevoutStake.hash || pcoin.second != prevoutStake.n)
+            continue;
+
         CTxDB txdb("r");
         CTxIndex txindex;
         if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-            continue;
+            break;
 
         // Read block header
         CBlock block;
         if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-            continue;
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-	    //
-	    nQueryIndex++;
-	    if(nQueryIndex % nQueryStop == 0){
-			break;
-	    }
-
-		if(nQueryIndex >= nQueryMax){
-			nQueryIndex = 0;
-		}
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown; n++)
+            break;
+        uint256 hashProofOfStake = 0;
+        if (!CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, nTimeKernel, hashProofOfStake))
+            break;
+
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to parse kernel\n");
+            break;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            break;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
         {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+            // convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-                // Found a kernel
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
-
-                txNew.nTime -= n; 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                break;  // unable to find corresponding public key
             }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
         }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        else
+            scriptPubKeyOut = scriptPubKeyKernel;
+
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
+        break;
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
@@ -1605,6 +1702,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                nWalletUpdated++;
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -1709,6 +1807,12 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        RebuildWalletIndex();
+        nWalletUpdated++;
+    }
+
     NewThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
 }
@@ -2100,6 +2204,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateWalletIndex(*pcoin);
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -2112,6 +2217,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64& nBalanceInQuestion, bool
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    nWalletUpdated++;
                 }
             }
         }
@@ -2135,6 +2241,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateWalletIndex(prev);
             }
         }
     }
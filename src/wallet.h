@@ -80,6 +80,27 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // pennies: transactions that may still hold an unspent output of ours,
+    // and coinbases and coinstakes that may not have matured. Balances and
+    // coin selection only visit these; they are pruned as they are visited
+    mutable std::set<uint256> setWalletUnspent;
+    mutable std::set<uint256> setWalletImmature;
+    // Set by a reorganize, which can bring back coins already pruned
+    mutable bool fWalletIndexStale;
+    // Bumped whenever a transaction or a spent flag changes
+    unsigned int nWalletUpdated;
+
+    // Balances as of hashBestChain and nWalletUpdated
+    mutable bool fBalancesCached;
+    mutable uint256 hashBalancesBestChain;
+    mutable unsigned int nBalancesWalletUpdated;
+    mutable int64 nBalanceCached, nUnconfirmedBalanceCached, nImmatureBalanceCached, nStakeCached, nNewMintCached;
+
+    void IndexWalletTx(const CWalletTx& wtx) const;
+    void UpdateWalletIndex(const CWalletTx& wtx);
+    void RebuildWalletIndex() const;
+    void UpdateBalances() const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -101,6 +122,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fWalletIndexStale = false;
+        nWalletUpdated = 0;
+        fBalancesCached = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -111,6 +135,9 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fWalletIndexStale = false;
+        nWalletUpdated = 0;
+        fBalancesCached = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -162,6 +189,7 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void BlockChainReorganized();
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);